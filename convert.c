@@ -0,0 +1,81 @@
+#include <string.h>
+#include <vmm.h>
+
+#include "tinyprintf.h"
+#include "hdaudio.h"
+#include "convert.h"
+
+// Converts unsigned 8-bit mono to signed 8-bit stereo
+void convert_1u8_2s8(void *dest, const void *src, size_t *destSize, size_t *srcSize)
+{
+	int nSamples = MIN(*srcSize, *destSize / 2);
+	int8_t        *d = dest;
+	const uint8_t *s = src;
+	for (int i = 0; i < nSamples; i++)
+	{
+		int8_t sample = *s++ - 0x80;
+		*d++ = sample;
+		*d++ = sample;
+		ASSERT((uint8_t *)s - (uint8_t *)src <= *srcSize);
+		ASSERT((uint8_t *)d - (uint8_t *)dest <= *destSize);
+	}
+	*srcSize = nSamples;
+	*destSize = nSamples * 2;
+}
+
+void convert_1u8_2s16(void *dest, const void *src, size_t *destSize, size_t *srcSize)
+{
+	int nSamples = MIN(*srcSize, *destSize / 4);
+	int16_t       *d = dest;
+	const uint8_t *s = src;
+	for (int i = 0; i < nSamples; i++)
+	{
+		int16_t sample = (*s++ - 0x80) << 8;
+		*d++ = sample;
+		*d++ = sample;
+		ASSERT((uint8_t *)s - (uint8_t *)src <= *srcSize);
+		ASSERT((uint8_t *)d - (uint8_t *)dest <= *destSize);
+	}
+	*srcSize = nSamples;
+	*destSize = nSamples * 4;
+}
+
+void convert_2u8_2s16(void *dest, const void *src, size_t *destSize, size_t *srcSize)
+{
+	int nSamples = MIN(*srcSize / 2, *destSize / 4) * 2;
+	int16_t       *d = dest;
+	const uint8_t *s = src;
+	for (int i = 0; i < nSamples; i++)
+	{
+		*d++ = (*s++ - 0x80) << 8;
+		ASSERT((uint8_t *)s - (uint8_t *)src <= *srcSize);
+		ASSERT((uint8_t *)d - (uint8_t *)dest <= *destSize);
+	}
+	*srcSize = nSamples;
+	*destSize = nSamples * 2;
+}
+
+void convert_1s16_2s16(void *dest, const void *src, size_t *destSize, size_t *srcSize)
+{
+	int nSamples = MIN(*srcSize / 2, *destSize / 4);
+	int16_t       *d = dest;
+	const int16_t *s = src;
+	for (int i = 0; i < nSamples; i++)
+	{
+		int16_t sample = *s++;
+		*d++ = sample;
+		*d++ = sample;
+		ASSERT((uint8_t *)s - (uint8_t *)src <= *srcSize);
+		ASSERT((uint8_t *)d - (uint8_t *)dest <= *destSize);
+	}
+	*srcSize = nSamples * 2;
+	*destSize = nSamples * 4;
+}
+
+// Simply copies stream data
+void convert_identity(void *dest, const void *src, size_t *destSize, size_t *srcSize)
+{
+	size_t size = MIN(*destSize, *srcSize);
+	*destSize = *srcSize = size;
+	memcpy(dest, src, size);
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <stddef.h>
+
+// Sample format converters used to fill a stream's DMA buffer.
+// On input, destSize and srcSize hold the space available in dest and the
+// number of bytes in src. On output, they hold the number of bytes produced
+// and consumed. Only whole source frames are converted.
+typedef void (*ConverterFunc)(void *dest, const void *src, size_t *destSize, size_t *srcSize);
+
+void convert_1u8_2s8(void *dest, const void *src, size_t *destSize, size_t *srcSize);
+void convert_1u8_2s16(void *dest, const void *src, size_t *destSize, size_t *srcSize);
+void convert_2u8_2s16(void *dest, const void *src, size_t *destSize, size_t *srcSize);
+void convert_1s16_2s16(void *dest, const void *src, size_t *destSize, size_t *srcSize);
+void convert_identity(void *dest, const void *src, size_t *destSize, size_t *srcSize);
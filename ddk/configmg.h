@@ -11,6 +11,8 @@
 #define	NUM_DLVXD_LOAD_TYPE   3  // Number of DLVxD load type.
 
 typedef	VOID *PFARVOID; // Pointer to a VOID.
+typedef	char *PFARCHAR; // Pointer to a CHAR.
+typedef	ULONG *PFARULONG; // Pointer to a ULONG.
 
 typedef DWORD CONFIGRET;
 
@@ -155,6 +157,8 @@ typedef	ULONG ENUMFUNC;
 #define SVC_CM_Get_Sibling              VXD_SERVICE(CONFIGMG_DEVICE_ID,  5)
 #define SVC_CM_Register_Device_Driver   VXD_SERVICE(CONFIGMG_DEVICE_ID, 14)
 #define SVC_CM_Get_Alloc_Log_Conf       VXD_SERVICE(CONFIGMG_DEVICE_ID, 59)
+#define SVC_CM_Read_Registry_Value      VXD_SERVICE(CONFIGMG_DEVICE_ID, 62)
+#define SVC_CM_Write_Registry_Value     VXD_SERVICE(CONFIGMG_DEVICE_ID, 63)
 #define SVC_CM_Call_Enumerator_Function VXD_SERVICE(CONFIGMG_DEVICE_ID, 84)
 
 #define	CM_GET_ALLOC_LOG_CONF_ALLOC	     0x00000000
@@ -167,6 +171,28 @@ CM_Get_Alloc_Log_Conf(PCMCONFIG pccBuffer, DEVNODE dnDevNode, ULONG ulFlags)
 	VxDJmp(SVC_CM_Get_Alloc_Log_Conf)
 }
 
+#define	CM_REGISTRY_HARDWARE 0x00000000  // Select hardware branch if NULL subkey
+#define	CM_REGISTRY_SOFTWARE 0x00000001  // Select software branch if NULL subkey
+
+#ifndef REG_BINARY
+#define REG_BINARY 3
+#endif
+#ifndef REG_DWORD
+#define REG_DWORD 4
+#endif
+
+static CONFIGRET __declspec(naked) __cdecl
+CM_Read_Registry_Value(DEVNODE dnDevNode, PFARCHAR pszSubKey, PFARCHAR pszValueName, ULONG ulExpectedType, PFARVOID pBuffer, PFARULONG pulLength, ULONG ulFlags)
+{
+	VxDJmp(SVC_CM_Read_Registry_Value)
+}
+
+static CONFIGRET __declspec(naked) __cdecl
+CM_Write_Registry_Value(DEVNODE dnDevNode, PFARCHAR pszSubKey, PFARCHAR pszValueName, ULONG ulType, PFARVOID pBuffer, ULONG ulLength, ULONG ulFlags)
+{
+	VxDJmp(SVC_CM_Write_Registry_Value)
+}
+
 static CONFIGRET __declspec(naked) __cdecl
 CM_Call_Enumerator_Function(DEVNODE dnDevNode, ENUMFUNC efFunc, ULONG ulRefData, PFARVOID pBuffer, ULONG ulBufferSize, ULONG ulFlags)
 {
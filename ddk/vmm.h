@@ -328,6 +328,7 @@ typedef CRS *PCRS;
 
 #define SVC_Get_VMM_Version     VXD_SERVICE(VMM_DEVICE_ID,   0)
 #define SVC_Get_Cur_VM_Handle   VXD_SERVICE(VMM_DEVICE_ID,   1)
+#define SVC_Schedule_Global_Event VXD_SERVICE(VMM_DEVICE_ID,  14)
 #define SVC_Map_Flat            VXD_SERVICE(VMM_DEVICE_ID,  28)
 #define SVC__HeapAllocate       VXD_SERVICE(VMM_DEVICE_ID,  79)
 #define SVC__HeapReAllocate     VXD_SERVICE(VMM_DEVICE_ID,  80)
@@ -350,6 +351,19 @@ Map_Flat(unsigned char segOffset, unsigned char offOfset)
 	__parm [ebx] [eax] \
 	__value [eax]
 
+typedef ULONG EVENTHANDLE;
+
+// The callback runs at event time, with the current VM handle in EBX and
+// refData in EDX
+static EVENTHANDLE __declspec(naked)
+Schedule_Global_Event(PVOID callback, ULONG refData)
+{
+	VxDJmp(SVC_Schedule_Global_Event)
+}
+#pragma aux Schedule_Global_Event \
+	__parm [esi] [edx] \
+	__value [esi]
+
 static PVOID __declspec(naked) __cdecl
 _HeapAllocate(ULONG nBytes, ULONG flags)
 {
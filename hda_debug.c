@@ -160,13 +160,10 @@ void hda_debug_dump_widget(struct HDACodec *codec, nodeid_t wID)
 	static const char spaces[] = "        ";
 	const char *indent = spaces + strlen(spaces) - 4;
 
-	uint32_t cmds[8], resps[8];
 	uint32_t caps;
 	int type;
 
-	cmds[0] = MAKE_COMMAND(codec->addr, wID, VERB_GET_PARAMETER, PARAM_AUDIO_WIDGET_CAP);
-	hda_run_commands(cmds, resps, 1);
-	caps = resps[0];
+	hda_get_parameter(codec, wID, PARAM_AUDIO_WIDGET_CAP, &caps);
 	type = GET_BITS(caps, 20, 4);
 
 	printf("%sWidget #%i (%s)\n",
@@ -215,7 +212,7 @@ void hda_debug_dump_widget(struct HDACodec *codec, nodeid_t wID)
 	{
 		uint32_t resp;
 
-		hda_run_command(MAKE_COMMAND(codec->addr, wID, VERB_GET_PARAMETER, PARAM_SUPP_PCM_SIZE_RATE), &resp);
+		hda_get_parameter(codec, wID, PARAM_SUPP_PCM_SIZE_RATE, &resp);
 		printf("%sSUPP_PCM_SIZE_RATE: 0x%08X\n",
 			indent, resp);
 		indent--;
@@ -248,7 +245,7 @@ void hda_debug_dump_widget(struct HDACodec *codec, nodeid_t wID)
 			indent, flag_list(resp, bitDepthFlags, ARRAY_COUNT(bitDepthFlags)));
 		indent++;
 
-		hda_run_command(MAKE_COMMAND(codec->addr, wID, VERB_GET_PARAMETER, PARAM_SUPP_STREAM_FORMATS), &resp);
+		hda_get_parameter(codec, wID, PARAM_SUPP_STREAM_FORMATS, &resp);
 		printf("%sSUPP_STREAM_FORMATS: 0x%08X\n",
 			indent, resp);
 		indent--;
@@ -267,7 +264,7 @@ void hda_debug_dump_widget(struct HDACodec *codec, nodeid_t wID)
 	{
 		uint32_t resp;
 
-		hda_run_command(MAKE_COMMAND(codec->addr, wID, VERB_GET_PARAMETER, PARAM_PIN_CAP), &resp);
+		hda_get_parameter(codec, wID, PARAM_PIN_CAP, &resp);
 		printf("%sPIN_CAP: 0x%08X\n",
 			indent, resp);
 		indent--;
@@ -299,7 +296,7 @@ void hda_debug_dump_widget(struct HDACodec *codec, nodeid_t wID)
 	{
 		uint32_t resp;
 		
-		hda_run_command(MAKE_COMMAND(codec->addr, wID, VERB_GET_PARAMETER, PARAM_INPUT_AMP_CAP), &resp);
+		hda_get_parameter(codec, wID, PARAM_INPUT_AMP_CAP, &resp);
 		printf("%sINPUT_AMP_CAP: 0x%08X\n",
 			indent, resp);
 		indent--;
@@ -312,7 +309,7 @@ void hda_debug_dump_widget(struct HDACodec *codec, nodeid_t wID)
 	{
 		uint32_t resp;
 		
-		hda_run_command(MAKE_COMMAND(codec->addr, wID, VERB_GET_PARAMETER, PARAM_OUTPUT_AMP_CAP), &resp);
+		hda_get_parameter(codec, wID, PARAM_OUTPUT_AMP_CAP, &resp);
 		printf("%sOUTPUT_AMP_CAP: 0x%08X\n",
 			indent, resp);
 		indent--;
@@ -325,7 +322,7 @@ void hda_debug_dump_widget(struct HDACodec *codec, nodeid_t wID)
 	{
 		uint32_t resp;
 
-		hda_run_command(MAKE_COMMAND(codec->addr, wID, VERB_GET_PARAMETER, PARAM_CONN_LIST_LENGTH), &resp);
+		hda_get_parameter(codec, wID, PARAM_CONN_LIST_LENGTH, &resp);
 		printf("%sCONN_LIST_LENGTH: 0x%08X (%i, %s form)\n",
 			indent, resp, GET_BITS(resp, 0, 7), (resp & (1 << 7)) ? "long" : "short");
 	}
@@ -333,7 +330,7 @@ void hda_debug_dump_widget(struct HDACodec *codec, nodeid_t wID)
 	{
 		uint32_t resp;
 
-		hda_run_command(MAKE_COMMAND(codec->addr, wID, VERB_GET_PARAMETER, PARAM_SUPP_POWER_STATES), &resp);
+		hda_get_parameter(codec, wID, PARAM_SUPP_POWER_STATES, &resp);
 		printf("%sSUPP_POWER_STATES: 0x%08X\n",
 			indent, resp);
 		indent--;
@@ -356,7 +353,7 @@ void hda_debug_dump_widget(struct HDACodec *codec, nodeid_t wID)
 	{
 		uint32_t resp;
 
-		hda_run_command(MAKE_COMMAND(codec->addr, wID, VERB_GET_PARAMETER, PARAM_PROCESSING_CAP), &resp);
+		hda_get_parameter(codec, wID, PARAM_PROCESSING_CAP, &resp);
 		printf("%sPROCESSING_CAP: 0x%08X (BenignCap=%s, NumCoeff=%i)\n",
 			indent, resp, bool_str(resp & (1 << 0)), GET_BITS(resp, 8, 8));
 	}
@@ -365,7 +362,7 @@ void hda_debug_dump_widget(struct HDACodec *codec, nodeid_t wID)
 	{
 		uint32_t resp;
 
-		hda_run_command(MAKE_COMMAND(codec->addr, wID, VERB_GET_PARAMETER, PARAM_GPIO_COUNT), &resp);
+		hda_get_parameter(codec, wID, PARAM_GPIO_COUNT, &resp);
 		printf("%sGPIO_COUNT: 0x%08X (NumGPIOs=%i, NumGPOs=%i, NumGPIs=%i, GPIUnsol=%s, GPIWake=%s)\n",
 			indent, resp, GET_BITS(resp, 0, 8), GET_BITS(resp, 8, 8), GET_BITS(resp, 16, 8), bool_str(resp & (1 << 30)), bool_str(resp & (1 << 31)));
 	}
@@ -374,7 +371,7 @@ void hda_debug_dump_widget(struct HDACodec *codec, nodeid_t wID)
 	{
 		uint32_t resp;
 
-		hda_run_command(MAKE_COMMAND(codec->addr, wID, VERB_GET_PARAMETER, PARAM_VOLUME_KNOB_CAP), &resp);
+		hda_get_parameter(codec, wID, PARAM_VOLUME_KNOB_CAP, &resp);
 		printf("%sVOLUME_KNOB_CAP: 0x%08X (NumSteps=%i, Delta=%s)\n",
 			indent, resp, GET_BITS(resp, 0, 7), bool_str(resp & (1 << 7)));
 	}
@@ -384,16 +381,14 @@ void hda_debug_dump_widget(struct HDACodec *codec, nodeid_t wID)
 
 void hda_debug_dump_codec(struct HDACodec *codec)
 {
-	uint32_t cmds[8];
 	uint32_t resps[8];
 	int fgIDStart, fgIDCount;
 
 	printf("Codec #%i\n", codec->addr);
 
-	cmds[0] = MAKE_COMMAND(codec->addr, 0, VERB_GET_PARAMETER, PARAM_VENDOR_ID);
-	cmds[1] = MAKE_COMMAND(codec->addr, 0, VERB_GET_PARAMETER, PARAM_REVISION_ID);
-	cmds[2] = MAKE_COMMAND(codec->addr, 0, VERB_GET_PARAMETER, PARAM_SUB_NODE_COUNT);
-	hda_run_commands(cmds, resps, 3);
+	hda_get_parameter(codec, 0, PARAM_VENDOR_ID, &resps[0]);
+	hda_get_parameter(codec, 0, PARAM_REVISION_ID, &resps[1]);
+	hda_get_parameter(codec, 0, PARAM_SUB_NODE_COUNT, &resps[2]);
 	fgIDCount = GET_BITS(resps[2], 0, 8);
 	fgIDStart = GET_BITS(resps[2], 16, 8);
 	printf(" Vendor=0x%04X, Device=0x%04X, Rev=%i.%i, RevID=%i, Stepping=%i\n",
@@ -408,10 +403,9 @@ void hda_debug_dump_codec(struct HDACodec *codec)
 		int wIDStart, wIDCount;
 
 		printf("  Function Group #%i\n", fgID);
-		cmds[0] = MAKE_COMMAND(codec->addr, fgID, VERB_GET_PARAMETER, PARAM_FUNC_GRP_TYPE);
-		cmds[1] = MAKE_COMMAND(codec->addr, fgID, VERB_GET_PARAMETER, PARAM_SUB_NODE_COUNT);
-		cmds[2] = MAKE_COMMAND(codec->addr, fgID, VERB_GET_GPIO_DATA, 0);
-		hda_run_commands(cmds, resps, 3);
+		hda_get_parameter(codec, fgID, PARAM_FUNC_GRP_TYPE, &resps[0]);
+		hda_get_parameter(codec, fgID, PARAM_SUB_NODE_COUNT, &resps[1]);
+		hda_run_command(MAKE_COMMAND(codec->addr, fgID, VERB_GET_GPIO_DATA, 0), &resps[2]);
 		fgType = GET_BITS(resps[0], 0, 8);
 		wIDCount = GET_BITS(resps[1], 0, 8);
 		wIDStart = GET_BITS(resps[1], 16, 8);
@@ -420,8 +414,7 @@ void hda_debug_dump_codec(struct HDACodec *codec)
 
 		if (fgType == 1)  // Audio Function Group
 		{
-			cmds[0] = MAKE_COMMAND(codec->addr, fgID, VERB_GET_PARAMETER, PARAM_AUDIO_FUNC_GRP_CAP);
-			hda_run_commands(cmds, resps, 1);
+			hda_get_parameter(codec, fgID, PARAM_AUDIO_FUNC_GRP_CAP, &resps[0]);
 			printf("   AFG Caps: OutDelay=%i, InDelay=%i, Beep=%s\n",
 				GET_BITS(resps[0], 0, 4), GET_BITS(resps[0], 8, 4), bool_str(resps[0] & (1 << 16)));
 		}
@@ -28,6 +28,26 @@
 static BOOL tprintfInitialized = FALSE;
 static VxDAPIEntry vxdEntry = NULL;
 
+// Records an event in the VxD's trace ring (see hda_trace.h). Unlike dprintf,
+// this doesn't format anything or write to the serial port, so it is cheap
+// enough to leave on in frequently called code.
+#define TRACE(name, arg0, arg1, arg2, arg3) \
+	trace_event(HDA_TRACE_##name, (DWORD)(arg0), (DWORD)(arg1), (DWORD)(arg2), (DWORD)(arg3))
+
+static void trace_event(UINT id, DWORD arg0, DWORD arg1, DWORD arg2, DWORD arg3)
+{
+	struct HDATraceRecord record;
+
+	if (vxdEntry == NULL)
+		return;
+	record.id = id;
+	record.args[0] = arg0;
+	record.args[1] = arg1;
+	record.args[2] = arg2;
+	record.args[3] = arg3;
+	hda_vxd_trace(vxdEntry, &record);
+}
+
 // Prints a single character to the COM serial port
 // Used by tinyprintf
 static void putc(void *unused, char c)
@@ -155,13 +175,17 @@ DWORD DLL_EXPORT DriverProc(DWORD dwDriverID, HANDLE hDriver,
 }
 
 static const int numDevs = 1;
-static const int maxClients = 1;
 static const int maxChannels = 2;
 
+// Each client plays through an output stream of its own in the VxD, or is
+// mixed into one, so there is no limit on clients here. Opening fails once the
+// VxD has nowhere left to play.
 struct ClientInfo
 {
 	WAVEOPENDESC wavOpen;
 	DWORD dwFlags;
+	WORD hStream;  // handle of the client's stream in the VxD
+	DWORD volume;  // left volume in the low word, right in the high word
 };
 typedef struct ClientInfo NEAR *NPClientInfo;
 typedef struct ClientInfo FAR *FPClientInfo;
@@ -177,9 +201,7 @@ static void do_driver_callback(struct ClientInfo *client, WORD msg, DWORD dwPara
 	DWORD  dwUser     = wavOpen->dwInstance;
 	DWORD  dwParam2   = 0;
 
-	dprintf("do_driver_callback: wavOpen=0x%lX\n", wavOpen);
-	dprintf("DriverCallback(0x%08lX, %u, 0x%X, %u, 0x%08lX, 0x%08lX, 0x%08lX)\n",
-		dwCallback, uFlags, hDevice, uMessage, dwUser, dwParam1, dwParam2);
+	TRACE(DRIVER_CALLBACK, uMessage, dwParam1, 0, 0);
 
 	// DriverCallback is documented in the DDK to return a BOOL indicating
 	// whether the call succeeded. However, due to a bug in Windows itself
@@ -203,7 +225,7 @@ DWORD DLL_EXPORT wave_block_finished(WAVEHDR FAR *wavHdr)
 	wavHdr->dwFlags &= ~WHDR_INQUEUE;
 
 	struct ClientInfo FAR *client = (struct ClientInfo FAR *)wavHdr->reserved;
-	dprintf("wave_block_finished: wavHdr 0x%lX, client 0x%lX\n", wavHdr, client);
+	TRACE(WAVE_BLOCK_FINISHED, wavHdr, 0, 0, 0);
 	do_driver_callback(client, WOM_DONE, (DWORD)wavHdr);
 	return 1;
 }
@@ -256,8 +278,7 @@ DWORD DLL_EXPORT wodMessage(UINT uDeviceID, WORD uMsg, DWORD dwUser, DWORD dwPar
 {
 	struct ClientInfo FAR *client;
 
-	dprintf("wodMessage(%u, %s, 0x%08lX, 0x%08lX, 0x%08lX)\n",
-		uDeviceID, wod_message_name(uMsg), dwUser, dwParam1, dwParam2);
+	TRACE(WOD_MESSAGE, uMsg, dwUser, dwParam1, dwParam2);
 
 	switch (uMsg)
 	{
@@ -357,9 +378,15 @@ DWORD DLL_EXPORT wodMessage(UINT uDeviceID, WORD uMsg, DWORD dwUser, DWORD dwPar
 			}
 			client->wavOpen = *wavOpen;
 			client->dwFlags = dwParam2;
+			if (!hda_vxd_open_stream(vxdEntry, lpFormat, &client->hStream))
+			{
+				dprintf("no output stream available\n");
+				GlobalFree(HIWORD(client));
+				return MMSYSERR_ALLOCATED;
+			}
+			client->volume = 0xFFFFFFFF;
 			// Save it into dwUser so that we can retrieve it later during WODM_WRITE
 			*(FPClientInfo FAR *)dwUser = client;
-			hda_vxd_open_stream(vxdEntry, lpFormat);
 			do_driver_callback(client, WOM_OPEN, 0);
 			dprintf("device opened!\n");
 		}
@@ -367,8 +394,8 @@ DWORD DLL_EXPORT wodMessage(UINT uDeviceID, WORD uMsg, DWORD dwUser, DWORD dwPar
 	case WODM_CLOSE:
 		// Sent to deallocate a specified device
 		// If there are buffers still playing, return WAVERR_STILLPLAYING
-		hda_vxd_close_stream(vxdEntry);
 		client = (struct ClientInfo FAR *)dwUser;
+		hda_vxd_close_stream(vxdEntry, client->hStream);
 		do_driver_callback(client, WOM_CLOSE, 0);
 		GlobalFree(HIWORD(client));
 		dprintf("device closed\n");
@@ -394,11 +421,28 @@ DWORD DLL_EXPORT wodMessage(UINT uDeviceID, WORD uMsg, DWORD dwUser, DWORD dwPar
 		wavHdr->dwFlags &= ~WHDR_DONE;
 		wavHdr->dwFlags |= WHDR_INQUEUE;
 		client = (struct ClientInfo FAR *)dwUser;
-		dprintf("WODM_WRITE wavHdr 0x%lX, client 0x%lX\n", wavHdr, client);
 		// We can now store the client info in the "reserved" field of the WAVEHDR.
 		// The MSSNDSYS DDK example does that, so it's okay.
 		wavHdr->reserved = (DWORD)client;
-		hda_vxd_submit_wave_block(vxdEntry, wavHdr);
+		hda_vxd_submit_wave_block(vxdEntry, client->hStream, wavHdr);
+		return MMSYSERR_NOERROR;
+	case WODM_GETVOLUME:
+		// Sent to get the volume of a client
+		// dwParam1 - pointer to a DWORD receiving the volume
+		client = (struct ClientInfo FAR *)dwUser;
+		if (client == NULL)
+			return MMSYSERR_NOTSUPPORTED;  // there is no device-wide volume
+		*(DWORD FAR *)dwParam1 = client->volume;
+		return MMSYSERR_NOERROR;
+	case WODM_SETVOLUME:
+		// Sent to set the volume of a client
+		// dwParam1 - left volume in the low word, right in the high word
+		client = (struct ClientInfo FAR *)dwUser;
+		if (client == NULL)
+			return MMSYSERR_NOTSUPPORTED;  // there is no device-wide volume
+		if (!hda_vxd_set_volume(vxdEntry, client->hStream, LOWORD(dwParam1), HIWORD(dwParam1)))
+			return MMSYSERR_NOTSUPPORTED;
+		client->volume = dwParam1;
 		return MMSYSERR_NOERROR;
 	}
 
@@ -10,19 +10,29 @@
 #include <pci.h>
 #include <shell.h>
 #include <vpicd.h>
-#include <vtd.h>
 #include <vwin32.h>
 
 #include "tinyprintf.h"
 #include "hdaudio.h"
 #include "memory.h"
+#include "convert.h"
+#include "mix.h"
+#include "timer.h"
 #include "hda_vxd_api.h"
 
-#define BKPT __asm int 3
+#ifdef HDA_SIM
+#include "hdasim_port.h"
+#else
+#define BKPT        __asm int 3
+#define FLUSH_CACHE __asm wbinvd
+#define SET_CARRY   __asm stc
+#define CLEAR_CARRY __asm clc
+#endif
 
 typedef uint16_t nodeid_t;
 
 #define HDA_QUIRK_FORCE_STEREO (1 << 0)
+#define HDA_QUIRK_POSITION_LPIB (1 << 1)  // the DMA position buffer can't be trusted
 
 DEVNODE hdaDevNode;
 struct HDARegs *hdaRegs;
@@ -50,7 +60,33 @@ physaddr_t        rirbPhys;
 unsigned int      rirbLength;
 unsigned int      rirbRP;
 
-#define STREAM_CHUNK_SIZE 4096
+static BOOL corbRunning;  // the CORB and RIRB are set up
+static unsigned int cmdWindow;  // maximum number of commands awaiting a response
+
+// A stream's DMA buffer holds about as much audio as its target latency, split
+// into BDL entries. The controller interrupts at the end of every few entries
+// (the IOC interval), and the entries played since the last interrupt are
+// refilled together. The latency can be set with the "Latency" registry
+// value (in milliseconds) or the HDA_VXD_SET_LATENCY ioctl.
+#define STREAM_DEFAULT_LATENCY 100  // milliseconds
+#define STREAM_MIN_LATENCY 8
+#define STREAM_MAX_LATENCY 2000
+#define STREAM_MIN_CHUNKS 4  // BDL entries, and IOC intervals, the buffer is split into, at least
+#define STREAM_MAX_CHUNK_TIME 25  // milliseconds; keeps each refill short
+#define STREAM_BUFFER_SIZE (64 * 4096)  // the largest DMA buffer
+#define STREAM_MAX_BDL_ENTRIES 256
+#define STREAM_MAX_IOC_INTERVAL 16  // BDL entries refilled per interrupt
+#define STREAM_ALIGN 128  // BDL entries must start on 128-byte boundaries
+
+static uint32_t streamLatency = STREAM_DEFAULT_LATENCY;
+
+// Sets the target latency of streams opened from now on, and returns the one
+// that will actually be used
+static uint32_t stream_set_latency(uint32_t latency)
+{
+	streamLatency = MIN(MAX(latency, STREAM_MIN_LATENCY), STREAM_MAX_LATENCY);
+	return streamLatency;
+}
 
 // An entry in a stream's Buffer Descriptor List (BDL)
 struct HDABufferDesc
@@ -69,10 +105,28 @@ struct AudioBlock
 	size_t bytesWritten;
 };
 
-#define OUTPUT_STREAM_TAG 1
+#define OUTPUT_STREAM_TAG 1  // of the first output stream; the others follow
 #define INPUT_STREAM_TAG  2
 
-typedef void (*ConverterFunc)(void *dest, const void *src, size_t *destSize, size_t *srcSize);
+// A client playing through a stream, identified by the handle that
+// HDA_VXD_OPEN_STREAM returned. A stream normally has a single voice, whose
+// blocks are converted straight into the DMA buffer. Clients that found no
+// stream free share one, and their voices are mixed (see stream_mix).
+struct HDAVoice
+{
+	struct HDAStream *stream;  // NULL if the voice is free
+	struct HDAVoice *next;  // next voice of the same stream
+	struct AudioBlock *blockList;
+	ConverterFunc converter;  // into the stream's format, or NULL if the voice must be mixed
+	ConverterFunc mixConverter;  // into signed 16-bit stereo, or NULL if the stream can't be mixed
+	uint32_t gain[2];  // left and right, see MIX_GAIN_UNITY
+};
+
+#define MAX_VOICES 32
+#define STREAM_MAX_VOICES 8  // voices mixed into one stream
+#define MIX_FRAMES 256  // frames mixed at a time
+
+static struct HDAVoice voices[MAX_VOICES];
 
 struct HDAStream
 {
@@ -85,33 +139,47 @@ struct HDAStream
 	struct HDABufferDesc *bdl;
 	physaddr_t bdlPhys;
 	int numBDLEntries;
+	uint32_t chunkSize;  // size of each BDL entry
+	unsigned int iocInterval;  // BDL entries per buffer completion interrupt
 	uint8_t sampleBits;
 	uint8_t chanCount;
-	struct AudioBlock *blockList;
+	uint32_t sampleRate;
+	struct HDAVoice *voices;  // clients playing through the stream
+	unsigned int voicesCount;
 	uint32_t currPos;  // current read/write position in waveBuf
-	ConverterFunc converter;
+	ConverterFunc converter;  // from the format the stream was opened with
+	uint32_t bytesPerSec;  // data rate of waveBuf
+	uint32_t fifoSize;  // bytes the DMA engine may fetch ahead of SDLPIB
+	unsigned long long lastIntTime;  // time of the last buffer completion interrupt
+	BOOL open;  // handed out by HDA_VXD_OPEN_STREAM
+	struct HDAStreamStats stats;
 };
 
-struct HDAStream outStream;
+// One for each output stream descriptor. Every stream has its own stream tag,
+// so each client plays through its own DMA engine and codec converters.
+static struct HDAStream *outStreams;
+static unsigned int outStreamsCount;
 
 #define MAX_CODECS 15
 struct HDACodec codecs[MAX_CODECS];
 unsigned int    codecsCount;
 
-static void hda_codec_init(struct HDACodec *codec);
+struct HDAInitTimes initTimes = { TIMER_CLOCK_RATE, HDA_INIT_PENDING };
+
+static void hda_codecs_init(void);
+static void topology_record(uint32_t command);
+static BOOL alloc_widgets(struct HDAAudioFuncGroup *afg);
+static void hda_unsol_queue(unsigned int codecAddr, uint32_t response);
 
 //------------------------------------------------------------------------------
 // Misc. Functions
 //------------------------------------------------------------------------------
 
-#define TIMER_CLOCK_RATE 1193182  // Frequency of the Programmable Interrupt Timer
-#define MICROSECS_TO_TICKS(microsecs) ((unsigned long long)(microsecs) * TIMER_CLOCK_RATE / 1000000)
-
 // Busy-waits for the specified number of clock ticks
 static void wait_ticks(unsigned long ticks)
 {
-	unsigned long long end = VTD_Get_Real_Time() + ticks;
-	while (VTD_Get_Real_Time() < end)
+	unsigned long long end = timer_read() + ticks;
+	while (timer_read() < end)
 		;
 }
 
@@ -119,10 +187,10 @@ static void wait_ticks(unsigned long ticks)
 // runs the ontimeout code if the time expires
 #define WAIT_FOR(cond, maxWait, ontimeout) \
 do { \
-	unsigned long long timeout = VTD_Get_Real_Time() + (maxWait); \
+	unsigned long long timeout = timer_read() + (maxWait); \
 	while (!(cond)) \
 	{ \
-		if (VTD_Get_Real_Time() > timeout) \
+		if (timer_read() > timeout) \
 		{ \
 			ontimeout; \
 			break; \
@@ -136,6 +204,7 @@ static BOOL pci_read_word(uint16_t *value, DEVNODE devnode, uint32_t offset)
 	return (CM_Call_Enumerator_Function(devnode, PCI_ENUM_FUNC_GET_DEVICE_INFO, offset, value, sizeof(*value), 0) == CR_SUCCESS);
 }
 
+#ifndef HDA_SIM
 // Disables interrupts and returns the previous interrupt flag
 static uint16_t __declspec(naked) disable_interrupts(void)
 {
@@ -162,10 +231,29 @@ static void __declspec(naked) restore_interrupts(uint16_t iflag)
 }
 #pragma aux restore_interrupts __parm [eax]
 
+// Enables interrupts and halts the CPU until one arrives. STI only takes effect
+// after the next instruction, so an interrupt that is already pending still
+// wakes up the HLT.
+static void __declspec(naked) wait_for_interrupt(void)
+{
+	__asm {
+		sti
+		hlt
+		ret
+	}
+}
+#endif
+
 //------------------------------------------------------------------------------
 // Controller hardware
 //------------------------------------------------------------------------------
 
+// Codecs request a status change in STATESTS within this many microseconds
+// (25 frames) of the controller leaving reset
+#define CODEC_REPORT_TIME 521
+
+static unsigned long long codecsReportedTime;  // every codec is in STATESTS by then
+
 // Resets the entire controller to a known state
 static BOOL hda_controller_reset(void)
 {
@@ -195,6 +283,9 @@ static BOOL hda_controller_reset(void)
 		MICROSECS_TO_TICKS(1000000),
 		dprintf("ERROR: unable to reset HDA controller\n"); return FALSE;
 	);
+	// Hold the link in reset for at least 100 microseconds, so that the codecs
+	// see it and report in again afterwards
+	wait_ticks(MICROSECS_TO_TICKS(100));
 	// Take the controller out of reset
 	hdaRegs->GCTL |= GCTL_CRST;
 	// And make sure it actually came out of reset (CRST should be 1)
@@ -204,8 +295,16 @@ static BOOL hda_controller_reset(void)
 		dprintf("ERROR: HDA controller is stuck in reset\n"); return FALSE;
 	);
 
-	// Wait at least 512 microseconds for all codecs to register themselves
-	wait_ticks(MICROSECS_TO_TICKS(521));
+	// Only wait for the first codec to register itself, so that commands can
+	// be sent. The codecs are counted later, when they all have.
+	codecsReportedTime = timer_read() + MICROSECS_TO_TICKS(CODEC_REPORT_TIME);
+	WAIT_FOR(
+		hdaRegs->STATESTS != 0,
+		MICROSECS_TO_TICKS(CODEC_REPORT_TIME),
+		dprintf("no codecs yet\n");
+	);
+
+	hdaRegs->GCTL |= GCTL_UNSOL;  // accept unsolicited responses
 
 	hdaRegs->INTCTL |= INTCTL_SIE_MASK | INTCTL_GIE;  // enable stream interrupts
 
@@ -308,349 +407,1978 @@ static BOOL hda_controller_setup_corb_rirb(void)
 	// Reset RIRB write pointer to 0 (HDA spec section 3.3.27)
 	hdaRegs->RIRBWP |= RIRBWP_RIRBWPRST;
 
+	// Keep fewer commands in flight than either ring can hold (see hda_cmd_fill)
+	cmdWindow = MIN(corbLength, rirbLength) - 1;
+
 	hdaRegs->RINTCNT = 255;  // seems to be needed for QEMU's emulated card but not real hardware?
 
-	// Start CORB/RIRB DMA
+	// Start CORB/RIRB DMA. Responses are collected by the interrupt handler.
 	hdaRegs->CORBCTL |= CORBCTL_CORBRUN | CORBCTL_CMEIE;
-	hdaRegs->RIRBCTL |= RIRBCTL_RIRBDMAEN;
+	hdaRegs->RIRBCTL |= RIRBCTL_RIRBDMAEN | RIRBCTL_RINTCTL;
+	hdaRegs->INTCTL |= INTCTL_CIE;
+	corbRunning = TRUE;
 
 	return TRUE;
 }
 
-// Sends commands through the HDA controller using the CORB
-static BOOL hda_cmd_send(const uint32_t *commands, unsigned int count)
+// The controller can also write the position of each stream's DMA engine to
+// a buffer in RAM, 8 bytes per stream in stream descriptor order. Reading it
+// is much cheaper than an uncached MMIO read of SDLPIB, but some chipsets
+// update it late or not at all, so it is checked against SDLPIB until it has
+// agreed often enough (see hda_stream_get_position).
+static volatile uint32_t *dmaPositions;
+static physaddr_t dmaPositionsPhys;
+static int positionSource = HDA_POSITION_LPIB;
+static unsigned int positionMatches;
+static unsigned int positionMismatches;
+
+#define POSITION_CHECKS         16  // agreeing positions needed to trust the buffer
+#define POSITION_MAX_MISMATCHES 3   // disagreeing positions that rule it out
+#define POSITION_SLACK          32  // bytes the two may differ by beyond the FIFO size
+
+// Vendors whose controllers are known to report bad positions in the buffer
+static const uint16_t positionBufferBlacklist[] =
+{
+	0x1106,  // VIA
+};
+
+static void hda_controller_setup_position_buffer(void)
 {
-	unsigned int corbRP = hdaRegs->CORBRP;
-	unsigned int corbWP = hdaRegs->CORBWP;
+	int numStreams = GCAP_ISS(hdaRegs->GCAP) + GCAP_OSS(hdaRegs->GCAP) + GCAP_BSS(hdaRegs->GCAP);
+	uint16_t vendor;
 
-	// CORB should be empty, as this is the only code that writes to it
-	ASSERT(corbRP == corbWP);
-	// Should check before writing too many commands
-	ASSERT(count <= corbLength);
-	// Write entries to CORB
-	for (unsigned int numWritten = 0; numWritten < count; numWritten++)
+	positionSource = HDA_POSITION_LPIB;
+	positionMatches = 0;
+	positionMismatches = 0;
+	if (pci_read_word(&vendor, hdaDevNode, 0))
 	{
-		corbWP = (corbWP + 1) % corbLength;
-		corb[corbWP] = commands[numWritten];
+		for (int i = 0; i < ARRAY_COUNT(positionBufferBlacklist); i++)
+		{
+			if (vendor == positionBufferBlacklist[i])
+				hdaQuirks |= HDA_QUIRK_POSITION_LPIB;
+		}
 	}
-	hdaRegs->CORBWP = corbWP;  // Tell the controller that there are new commands
-	// Wait for the controller to receive all commands
-	WAIT_FOR(
-		hdaRegs->CORBRP == corbWP,
-		MICROSECS_TO_TICKS(1000000),
-		dprintf("CORB send timed out\n"); return FALSE;
-	);
-	return TRUE;
+	if (hdaQuirks & HDA_QUIRK_POSITION_LPIB)
+	{
+		dprintf("not using the DMA position buffer on this chipset\n");
+		return;
+	}
+
+	if (dmaPositions == NULL)
+		dmaPositions = memory_alloc_phys(numStreams * 8, &dmaPositionsPhys);
+	if (dmaPositions == NULL)
+	{
+		dprintf("failed to allocate DMA position buffer\n");
+		return;
+	}
+	memset((void *)dmaPositions, 0, numStreams * 8);
+	ASSERT((dmaPositionsPhys & 0x7F) == 0);
+	dprintf("DMA position buffer: phys=0x%08X, virt=0x%08X\n", dmaPositionsPhys, dmaPositions);
+
+	hdaRegs->DPUBASE = 0;
+	hdaRegs->DPLBASE = dmaPositionsPhys | DPLBASE_DPBE;
+	positionSource = HDA_POSITION_VALIDATING;
 }
 
-// Receives responses from the commands that were sent
-static BOOL hda_cmd_recv(uint32_t *responses, unsigned int count)
+struct HDAVerbStats verbStats = { TIMER_CLOCK_RATE };
+
+static int verb_class(uint32_t command)
 {
-	// get responses
-	unsigned int i = 0;
-	while (i < count)
-	{
-		// wait for the controller to write response(s)
-		WAIT_FOR(
-			hdaRegs->RIRBWP != rirbRP,
-			MICROSECS_TO_TICKS(1000000),
-			dprintf("RIRB recv timed out\n"); return FALSE;
-		);
+	unsigned int verb = GET_BITS(command, 8, 12);
+
+	if (verb == VERB_GET_PARAMETER)
+		return HDA_VERB_CLASS_GET_PARAMETER;
+	// Both the 12-bit get verbs (0xFxx) and the 4-bit ones (0xA-0xD) have the
+	// top bit set; none of the set verbs do.
+	if (verb & 0x800)
+		return HDA_VERB_CLASS_GET;
+	return HDA_VERB_CLASS_SET;
+}
 
-		// read a response
-		rirbRP = (rirbRP + 1) % rirbLength;
-		struct RIRBEntry response = rirb[rirbRP];
-		if (!(response.resp_ex & (1 << 4)))
-			responses[i++] = response.response;
-	}
+// Returns the histogram bucket for a time in timer ticks
+static int stats_bucket(uint32_t ticks)
+{
+	int bucket = 0;
+
+	while (bucket < HDA_STATS_LATENCY_BUCKETS - 1 && (ticks >> bucket) != 0)
+		bucket++;
+	return bucket;
+}
+
+// Records the round trip time of a command whose response just arrived
+static void stats_record_latency(uint32_t command, unsigned long long roundTrip)
+{
+	struct HDAVerbClassStats *cls = &verbStats.classes[verb_class(command)];
+	uint32_t latency = MIN(roundTrip, 0xFFFFFFFF);
+
+	cls->latencyHist[stats_bucket(latency)]++;
+	if (cls->responses == 0 || latency < cls->latencyMin)
+		cls->latencyMin = latency;
+	if (latency > cls->latencyMax)
+		cls->latencyMax = latency;
+	cls->latencyTotal += latency;
+	cls->responses++;
+}
+
+// Clears the verb statistics
+static void stats_reset(void)
+{
+	memset(&verbStats, 0, sizeof(verbStats));
+	verbStats.timerRate = timerRate;
+}
 
-	// skip over any unsolicited responses
-	while (rirbRP != hdaRegs->RIRBWP)
+// Batches waiting for the controller, in the order they were submitted.
+// Commands are streamed into the CORB as room frees up, so several batches
+// may be in flight at once. Each codec answers its own commands in order, but
+// the responses of different codecs may interleave, so they are routed back
+// using the codec address in the RIRB entry.
+static struct HDACommandBatch *cmdQueue;
+static struct HDACommandBatch *cmdQueueTail;
+static struct HDACommandBatch *cmdSendBatch;  // first batch with commands not yet in the CORB
+
+static BOOL cmdImmediate;  // lone commands go through the Immediate Command interface
+
+// The CORB entries after cmdTail up to and including cmdHead may still be
+// waiting for a response
+static unsigned int cmdHead;
+static unsigned int cmdTail;
+static unsigned int cmdOutstanding;  // commands sent that have not been answered yet
+static unsigned long long cmdProgressTime;  // when the controller last made progress
+
+// What each CORB entry is waiting for
+static struct HDACommandBatch *corbBatch[256];  // NULL once answered
+static uint16_t corbIndex[256];  // index of the command in its batch
+static unsigned long long corbSendTime[256];  // when it was handed to the controller
+
+// How long the controller may go without answering anything before the
+// oldest command is given up on. Codecs answer within a few frames, so while
+// they are being probed a much shorter time will do; afterwards, something
+// else (like a power state change) may legitimately hold them up.
+#define CMD_TIMEOUT 1000000  // microseconds
+#define CMD_PROBE_TIMEOUT 10000
+#define CMD_IMMEDIATE_TIMEOUT 1000
+
+static unsigned long cmdTimeout = CMD_TIMEOUT;
+
+// A codec that fails to answer this many commands in a row is given up on.
+// Commands to it fail right away from then on, instead of each waiting for
+// its own timeout.
+#define CMD_MAX_CONSECUTIVE_TIMEOUTS 3
+
+static uint16_t cmdDeadCodecs;  // bit n is set if codec n was given up on
+static uint8_t cmdConsecutiveTimeouts[16];  // by codec address
+
+// Responses each codec still owes for commands that were given up on. A codec
+// answers in order, so if it was only slow, the next this many responses from
+// it belong to those commands and not to the ones sent after them.
+static uint16_t cmdLateResponses[16];  // by codec address
+
+// Counts a command that was not answered in time against its codec
+static void hda_cmd_codec_timeout(uint32_t command)
+{
+	unsigned int addr = command >> 28;
+
+	verbStats.classes[verb_class(command)].timeouts++;
+	verbStats.codecTimeouts[addr]++;
+	if (++cmdConsecutiveTimeouts[addr] >= CMD_MAX_CONSECUTIVE_TIMEOUTS && !(cmdDeadCodecs & (1 << addr)))
 	{
-		rirbRP = (rirbRP + 1) % rirbLength;
-		if (!(rirb[rirbRP].resp_ex & (1 << 4)))
-		{
-			dprintf("excess solicited responses\n");
-			return FALSE;
-		}
+		dprintf("codec %i stopped responding, giving up on it\n", addr);
+		cmdDeadCodecs |= 1 << addr;
 	}
-
-	return TRUE;
 }
 
-// Sends commands to the controller and receives the responses
-BOOL hda_run_commands(const uint32_t *commands, uint32_t *responses, unsigned int count)
+// Copies as many pending commands into the CORB as there is room for.
+// Called with interrupts disabled or from the interrupt handler.
+static void hda_cmd_fill(void)
 {
-	return hda_cmd_send(commands, count) && hda_cmd_recv(responses, count);
+	unsigned int written = 0;
+	unsigned long long now;
+
+	if (cmdSendBatch == NULL)
+		return;
+	now = timer_read();
+	// Limiting the entries in use to less than the size of either ring means
+	// neither the CORB nor the RIRB can overflow.
+	while (cmdSendBatch != NULL && (cmdHead + corbLength - cmdTail) % corbLength < cmdWindow)
+	{
+		struct HDACommandBatch *batch = cmdSendBatch;
+		uint32_t command = batch->commands[batch->sent];
+
+		cmdHead = (cmdHead + 1) % corbLength;
+		corb[cmdHead] = command;
+		corbBatch[cmdHead] = batch;
+		corbIndex[cmdHead] = batch->sent++;
+		corbSendTime[cmdHead] = now;
+		verbStats.classes[verb_class(command)].count++;
+		if (batch->sent == batch->count)
+			cmdSendBatch = batch->next;
+		cmdOutstanding++;
+		written++;
+	}
+	if (written == 0)
+		return;
+	if (cmdOutstanding == written)  // the controller was idle
+		cmdProgressTime = now;
+	// Interrupt when half of the window has been answered, so that the CORB
+	// is refilled before the controller runs dry (0 means 256)
+	hdaRegs->RINTCNT = MIN(cmdOutstanding, MAX(cmdWindow / 2, 1)) & RINTCNT_RINTCNT_MASK;
+	hdaRegs->CORBWP = cmdHead;  // Tell the controller that there are new commands
 }
 
-// Sends a single command to the controller and receives the response
-BOOL hda_run_command(uint32_t command, uint32_t *response)
+// Marks a CORB entry as answered, and frees up the entries at the tail that
+// no longer wait for anything
+static void hda_cmd_retire(unsigned int pos)
 {
-	return hda_run_commands(&command, response, 1);
+	corbBatch[pos] = NULL;
+	cmdOutstanding--;
+	while (cmdTail != cmdHead && corbBatch[(cmdTail + 1) % corbLength] == NULL)
+		cmdTail = (cmdTail + 1) % corbLength;
 }
 
-// Discovers and initializes all codecs attached to the controller
-static BOOL hda_controller_enum_codecs(void)
+// Removes a batch from the queue and notifies the submitter
+static void hda_cmd_complete(struct HDACommandBatch *batch, BOOL success)
 {
-	uint16_t statests = hdaRegs->STATESTS;
+	struct HDACommandBatch **link = &cmdQueue;
+	struct HDACommandBatch *prev = NULL;
 
-	codecsCount = 0;
-	for (int i = 0; i < MAX_CODECS; i++)
+	while (*link != batch)
 	{
-		if (statests & (1 << i))
-		{
-			struct HDACodec *codec = &codecs[codecsCount++];
-			memset(codec, 0, sizeof(*codec));
-			codec->addr = i;
-			hda_codec_init(codec);
-		}
+		ASSERT(*link != NULL);
+		prev = *link;
+		link = &prev->next;
 	}
-	if (codecsCount == 0)
+	*link = batch->next;
+	if (cmdQueueTail == batch)
+		cmdQueueTail = prev;
+	if (cmdSendBatch == batch)
+		cmdSendBatch = batch->next;
+
+	batch->failed = !success;
+	batch->done = TRUE;
+	if (batch->callback != NULL)
+		batch->callback(batch);
+}
+
+// Returns the CORB entry of the oldest unanswered command sent to a codec,
+// or -1 if there is none
+static int hda_cmd_find_pending(unsigned int codecAddr)
+{
+	for (unsigned int pos = cmdTail; pos != cmdHead; )
 	{
-		dprintf("no codecs found\n");
-		return FALSE;
+		pos = (pos + 1) % corbLength;
+		if (corbBatch[pos] != NULL && (corb[pos] >> 28) == codecAddr)
+			return pos;
 	}
-	return TRUE;
+	return -1;
 }
 
-//------------------------------------------------------------------------------
-// HDA codecs
-//------------------------------------------------------------------------------
+// Fails a batch whose first unanswered command is in CORB entry pos. Any of
+// its commands still in the CORB may yet be answered, and those responses are
+// dropped when they come in.
+static void hda_cmd_abandon(struct HDACommandBatch *batch, unsigned int pos)
+{
+	for (; pos != (cmdHead + 1) % corbLength; pos = (pos + 1) % corbLength)
+	{
+		if (corbBatch[pos] == batch)
+		{
+			cmdLateResponses[corb[pos] >> 28]++;
+			hda_cmd_retire(pos);
+		}
+	}
+	hda_cmd_complete(batch, FALSE);
+}
 
-// Returns the widget in the codec with the given node ID
-static struct HDAWidget *get_widget_by_id(struct HDACodec *codec, nodeid_t nodeID)
+// Gives up on the batch that owns the oldest unanswered command
+static void hda_cmd_timeout(void)
 {
-	ASSERT(nodeID >= codec->afg.widgetsStart && nodeID < codec->afg.widgetsStart + codec->afg.widgetsCount);
-	struct HDAWidget *widget = &codec->afg.widgets[nodeID - codec->afg.widgetsStart];
-	ASSERT(widget->nodeID == nodeID);
-	return widget;
+	unsigned int oldest = (cmdTail + 1) % corbLength;
+	struct HDACommandBatch *batch = corbBatch[oldest];
+	uint32_t command = corb[oldest];
+
+	ASSERT(batch != NULL);
+	if ((hdaRegs->CORBRP & CORBRP_CORBRP_MASK) != cmdHead)
+	{
+		verbStats.sendTimeouts++;
+		dprintf("CORB send timed out\n");
+	}
+	else
+	{
+		hda_cmd_codec_timeout(command);
+		dprintf("RIRB recv timed out (codec %i)\n", command >> 28);
+	}
+	hda_cmd_abandon(batch, oldest);
+	// Nothing else that is waiting for a codec that was given up on will be
+	// answered either
+	if (cmdDeadCodecs & (1 << (command >> 28)))
+	{
+		int pos;
+		while ((pos = hda_cmd_find_pending(command >> 28)) >= 0)
+			hda_cmd_abandon(corbBatch[pos], pos);
+	}
+	cmdProgressTime = timer_read();
+	hda_cmd_fill();
 }
 
-// Finds the shortest path from the specified widget to an "Audio Output" widget and
-// sets the connections appropriately
-// Returns the length of the path, or INT_MAX if none was found
-static int build_output_path(struct HDACodec *codec, struct HDAWidget *widget)
+// Moves responses from the RIRB into the batches they belong to, then
+// refills the CORB. Called from the interrupt handler, or with interrupts
+// disabled.
+static void hda_cmd_harvest(void)
 {
-	uint32_t command, response;
-	int pathLen = INT_MAX;
-	widget->outPath = 0;
+	unsigned int rirbWP = hdaRegs->RIRBWP & RIRBWP_RIRBWP_MASK;
+	unsigned long long now;
 
-	for (int i = 0; i < widget->connectionsCount; i++)
+	if (rirbRP == rirbWP)
+		return;
+	now = timer_read();
+	while (rirbRP != rirbWP)
 	{
-		uint16_t nodeID = widget->connections[i];
-		if (nodeID < codec->afg.widgetsStart || nodeID >= codec->afg.widgetsStart + codec->afg.widgetsCount)
+		rirbRP = (rirbRP + 1) % rirbLength;
+		struct RIRBEntry response = rirb[rirbRP];
+
+		if (response.resp_ex & (1 << 4))
 		{
-			dprintf("warning: widget %i has invalid connection %i\n", widget->nodeID, nodeID);
+			hda_unsol_queue(response.resp_ex & 0xF, response.response);
 			continue;
 		}
-		struct HDAWidget *input = get_widget_by_id(codec, nodeID);
-		if (input->type == WIDGET_TYPE_AUDIO_OUTPUT)  // found it!
+		if (cmdLateResponses[response.resp_ex & 0xF] > 0)
 		{
-			pathLen = 1;
-			widget->outPath = nodeID;
-			break;
+			// Answers a command that was given up on
+			cmdLateResponses[response.resp_ex & 0xF]--;
+			verbStats.lateResponses++;
+			continue;
 		}
-		int len = 1 + build_output_path(codec, input);
-		if (len < pathLen)
+		int pos = hda_cmd_find_pending(response.resp_ex & 0xF);
+		if (pos < 0)
 		{
-			pathLen = len;
-			widget->outPath = nodeID;
+			// Probably a late response to a batch that timed out
+			verbStats.excessSolicited++;
+			dprintf("excess solicited responses\n");
+			continue;
 		}
+		struct HDACommandBatch *batch = corbBatch[pos];
+		unsigned int index = corbIndex[pos];
+		hda_cmd_retire(pos);
+		cmdProgressTime = now;
+		cmdConsecutiveTimeouts[response.resp_ex & 0xF] = 0;
+		stats_record_latency(batch->commands[index], now - corbSendTime[pos]);
+		batch->responses[index] = response.response;
+		if (++batch->received == batch->count)
+			hda_cmd_complete(batch, TRUE);
 	}
+	hda_cmd_fill();
+}
+
+// Sends a command through the Immediate Command interface and busy-waits for
+// the response. For a single command, this is much quicker than the CORB and
+// RIRB, which involve two DMA transfers and an interrupt.
+static BOOL hda_cmd_immediate(uint32_t command, uint32_t *response)
+{
+	unsigned long long start;
+
+	if (cmdDeadCodecs & (1 << (command >> 28)))
+		return FALSE;
+	WAIT_FOR(
+		!(hdaRegs->ICIS & ICIS_ICB),
+		MICROSECS_TO_TICKS(CMD_IMMEDIATE_TIMEOUT),
+		verbStats.sendTimeouts++; dprintf("immediate command interface busy\n"); return FALSE;
+	);
+	hdaRegs->ICIS = ICIS_IRV;  // Clear the previous response
+	hdaRegs->ICOI = command;
+	verbStats.classes[verb_class(command)].count++;
+	verbStats.immediate++;
+	start = timer_read();
+	hdaRegs->ICIS = ICIS_ICB;  // Send it
+	WAIT_FOR(
+		hdaRegs->ICIS & ICIS_IRV,
+		MICROSECS_TO_TICKS(CMD_IMMEDIATE_TIMEOUT),
+		hda_cmd_codec_timeout(command); dprintf("immediate command timed out\n"); return FALSE;
+	);
+	*response = hdaRegs->ICII;
+	cmdConsecutiveTimeouts[command >> 28] = 0;
+	stats_record_latency(command, timer_read() - start);
+	return TRUE;
+}
 
-	// Select the connection
-	if (pathLen < INT_MAX)
+// Queues a batch of commands of any length to be sent to the controller.
+// Returns immediately; batch->callback (if not NULL) is called once the
+// responses are in or the batch has failed, possibly from the interrupt
+// handler. The batch and its arrays must stay valid until then.
+BOOL hda_submit_commands(struct HDACommandBatch *batch)
+{
+	uint16_t iflag;
+
+	batch->sent = 0;
+	batch->received = 0;
+	batch->failed = FALSE;
+	batch->done = FALSE;
+	batch->next = NULL;
+	verbStats.batches++;
+	for (unsigned int i = 0; i < batch->count; i++)
 	{
-		if (widget->type != WIDGET_TYPE_AUDIO_MIXER)  // Mixers have a hard-wired list of inputs and grab audio from all of them, therefore not selectable
+		if (cmdDeadCodecs & (1 << (batch->commands[i] >> 28)))
 		{
-			int i;
-			// find index in the connection list
-			for (i = 0; i < widget->connectionsCount; i++)
-				if (widget->outPath == widget->connections[i])
-					break;
-			ASSERT(i < widget->connectionsCount);
-			// set the connection
-			command = MAKE_COMMAND(codec->addr, widget->nodeID, VERB_SET_CONNECTION_SELECT_CTRL, i);
-			hda_run_commands(&command, &response, 1);
-			dprintf("connected widget %i to input %i\n",
-				widget->nodeID, widget->outPath);
+			batch->failed = TRUE;
+			batch->done = TRUE;
+			if (batch->callback != NULL)
+				batch->callback(batch);
+			return TRUE;
+		}
+	}
+	if (batch->count == 0 || !corbRunning)
+	{
+		// Without the CORB, the commands are sent one by one right away
+		while (batch->received < batch->count)
+		{
+			if (!hda_cmd_immediate(batch->commands[batch->received], &batch->responses[batch->received]))
+			{
+				batch->failed = TRUE;
+				break;
+			}
+			batch->received++;
 		}
+		batch->sent = batch->received;
+		batch->done = TRUE;
+		if (batch->callback != NULL)
+			batch->callback(batch);
+		return TRUE;
 	}
 
-	return pathLen;
+	iflag = disable_interrupts();
+	if (cmdQueue == NULL)
+		cmdQueue = batch;
+	else
+		cmdQueueTail->next = batch;
+	cmdQueueTail = batch;
+	if (cmdSendBatch == NULL)
+		cmdSendBatch = batch;
+	hda_cmd_fill();
+	restore_interrupts(iflag);
+	return TRUE;
 }
 
-// If the widget has an output amplifier, unmutes it and sets its gain to max
-static void unmute_widget(struct HDACodec *codec, struct HDAWidget *widget)
+// Waits until *flag becomes TRUE, which a batch callback is expected to do.
+// Rather than spinning, the CPU is halted until the RIRB interrupt (or some
+// other one) comes in. If interrupts are disabled, the RIRB is polled instead.
+static void hda_cmd_wait_flag(volatile BOOL *flag)
 {
-	uint32_t commands[1], responses[1];
-	if (widget->caps & WIDGET_CAP_OUTPUT_AMP)
+	for (;;)
 	{
-		commands[0] = MAKE_COMMAND(codec->addr, widget->nodeID, VERB_GET_PARAMETER, PARAM_OUTPUT_AMP_CAP);
-		hda_run_commands(commands, responses, 1);
-		int maxGain = GET_BITS(responses[0], 8, 7);  // NumSteps field
-		uint32_t ampGainMute = maxGain | (1 << 15) | (1 << 13) | (1 << 12);
-		commands[0] = MAKE_COMMAND(codec->addr, widget->nodeID, VERB_SET_AMP_GAIN_MUTE, ampGainMute);
-		hda_run_commands(commands, responses, 1);
+		uint16_t iflag = disable_interrupts();
+
+		// Responses that did not raise an interrupt, if there are any
+		hda_cmd_harvest();
+		if (*flag)
+		{
+			restore_interrupts(iflag);
+			break;
+		}
+		// The command holding things up may belong to someone else's batch
+		if (cmdOutstanding > 0 && timer_read() - cmdProgressTime > MICROSECS_TO_TICKS(cmdTimeout))
+		{
+			hda_cmd_timeout();
+			restore_interrupts(iflag);
+			continue;
+		}
+		if (iflag)
+			wait_for_interrupt();  // re-enables interrupts
+		else
+			restore_interrupts(iflag);
 	}
 }
 
-static BOOL hda_func_group_init(struct HDACodec *codec, struct HDAAudioFuncGroup *afg)
+// Waits until a submitted batch is done
+static BOOL hda_wait_commands(struct HDACommandBatch *batch)
 {
-	uint32_t commands[2], responses[2];
-	struct HDAWidget *widget;
+	hda_cmd_wait_flag(&batch->done);
+	return !batch->failed;
+}
 
-	dprintf(" Audio Function Group #%i, %i widgets, start %i\n", afg->nodeID, afg->widgetsCount, afg->widgetsStart);
-	afg->widgets = memory_alloc(sizeof(*afg->widgets) * afg->widgetsCount);
-	if (afg->widgets == NULL)
-	{
-		dprintf("memory allocation failed\n");
+// Sends commands to the controller and receives the responses
+BOOL hda_run_commands(const uint32_t *commands, uint32_t *responses, unsigned int count)
+{
+	struct HDACommandBatch batch = { commands, responses, count };
+
+	// A lone command doesn't need the CORB, unless it would overtake commands
+	// already in there
+	if (count == 1 && cmdImmediate && cmdQueue == NULL)
+		return hda_cmd_immediate(commands[0], responses);
+	return hda_submit_commands(&batch) && hda_wait_commands(&batch);
+}
+
+// Decides whether lone commands can use the Immediate Command interface.
+// It is optional, and not every controller supports it while the CORB is
+// running, so it must give the same answer as the CORB.
+static BOOL hda_cmd_probe_immediate(void)
+{
+	uint16_t statests = hdaRegs->STATESTS;
+	uint32_t command;
+	uint32_t response;
+	uint32_t corbResponse;
+	int addr;
+
+	cmdImmediate = FALSE;
+	for (addr = 0; addr < MAX_CODECS; addr++)
+		if (statests & (1 << addr))
+			break;
+	if (addr == MAX_CODECS)
 		return FALSE;
+	command = MAKE_COMMAND(addr, 0, VERB_GET_PARAMETER, PARAM_VENDOR_ID);
+	if (!hda_cmd_immediate(command, &response))
+		return FALSE;
+	if (corbRunning)
+	{
+		if (!hda_run_commands(&command, &corbResponse, 1) || corbResponse != response)
+			return FALSE;
 	}
-	memset(afg->widgets, 0, sizeof(*afg->widgets) * afg->widgetsCount);
+	cmdImmediate = TRUE;
+	return TRUE;
+}
 
-	// Collect information about widgets and initialize them
-	widget = afg->widgets;
-	for (nodeid_t nodeID = afg->widgetsStart; nodeID < afg->widgetsStart + afg->widgetsCount; nodeID++, widget++)
+// Times round trips of a command through the CORB/RIRB and through the
+// Immediate Command interface, alternating between the two
+static void hda_cmd_benchmark(uint32_t command, unsigned int iterations, struct HDACommandBench *bench)
+{
+	memset(bench, 0, sizeof(*bench));
+	bench->timerRate = timerRate;
+	bench->command = command;
+	bench->immediateUsed = cmdImmediate;
+	for (unsigned int i = 0; i < iterations; i++)
 	{
-		commands[0] = MAKE_COMMAND(codec->addr, nodeID, VERB_GET_PARAMETER, PARAM_AUDIO_WIDGET_CAP);
-		hda_run_commands(commands, responses, 1);
-		widget->caps = responses[0];
-		widget->nodeID = nodeID;
-		widget->type = GET_BITS(widget->caps, 20, 4);
-
-		dprintf("  Widget #%i, type = %i\n", nodeID, widget->type);
-
-		if (widget->type == WIDGET_TYPE_PIN_COMPLEX)
+		for (int path = 0; path < 2; path++)
 		{
-			commands[0] = MAKE_COMMAND(codec->addr, nodeID, VERB_GET_PARAMETER, PARAM_PIN_CAP);
-			hda_run_commands(commands, responses, 1);
-			widget->pinCaps = responses[0];
-			// For some reason, EAPD needs to be enabled if the widget supports
-			// it, or else we just get silence
-			if (widget->pinCaps & PINCAP_EAPD)
+			struct HDACommandPathStats *stats = path ? &bench->immediate : &bench->corb;
+			struct HDACommandBatch batch = { &command, &bench->response, 1 };
+			unsigned long long start = timer_read();
+			BOOL success;
+
+			if (path)
+				success = hda_cmd_immediate(command, &bench->response);
+			else
+				success = corbRunning && hda_submit_commands(&batch) && hda_wait_commands(&batch);
+			uint32_t time = MIN(timer_read() - start, 0xFFFFFFFF);
+			if (!success)
 			{
-				commands[0] = MAKE_COMMAND(codec->addr, nodeID, VERB_SET_EAPD_ENABLE, (1 << 1));
-				hda_run_commands(commands, responses, 1);
+				stats->failures++;
+				continue;
 			}
+			if (stats->count == 0 || time < stats->timeMin)
+				stats->timeMin = time;
+			stats->timeMax = MAX(stats->timeMax, time);
+			stats->timeTotal += time;
+			stats->count++;
 		}
+	}
+}
 
-		widget->connectionsCount = 0;
-		if (widget->caps & WIDGET_CAP_CONN_LIST)
-		{
-			commands[0] = MAKE_COMMAND(codec->addr, nodeID, VERB_GET_PARAMETER, PARAM_CONN_LIST_LENGTH);
-			hda_run_commands(commands, responses, 1);
-			BOOL longForm = (responses[0] & (1 << 7)) != 0;
-			widget->connectionsCount = responses[0] & 0x3F;
-			int perSet = longForm ? 2 : 4;  // long form returns two 16-bit entries per set, while short form returns four 8-bit entries per set
+// Sends a single command to the controller and receives the response
+BOOL hda_run_command(uint32_t command, uint32_t *response)
+{
+	return hda_run_commands(&command, response, 1);
+}
 
-			if (widget->connectionsCount > MAX_CONNECTIONS)
-			{
-				widget->connectionsCount = MAX_CONNECTIONS;
-				dprintf("Warning: widget #%i's connection list is too long!\n", nodeID);
-			}
-			dprintf("   Connections (%i):\n", widget->connectionsCount);
-			dprintf("    ");
-			for (int i = 0; i < widget->connectionsCount; i++)
-			{
-				int index = i % perSet;
-				if (index == 0)  // fetch the next set of entries
-				{
-					commands[0] = MAKE_COMMAND(codec->addr, nodeID, VERB_GET_CONNECTION_LIST_ENTRY, i - index);
-					hda_run_commands(commands, responses, 1);
-				}
-				if (longForm)
-					widget->connections[i] = (responses[0] >> (index * 16)) & 0xFFFF;
-				else
-					widget->connections[i] = (responses[0] >> (index * 8)) & 0xFF;
-				dprintf("%i ", widget->connections[i]);
-			}
-			dprintf("\n");
-		}
-	}
+// Returns the codec at an address, or NULL if there is none
+static struct HDACodec *codec_by_addr(unsigned int addr)
+{
+	for (int i = 0; i < codecsCount; i++)
+		if (codecs[i].addr == addr)
+			return &codecs[i];
+	return NULL;
+}
 
-	dprintf("building paths\n");
+//------------------------------------------------------------------------------
+// Parameter cache
+//------------------------------------------------------------------------------
 
-	// Find widget paths, from Pin Complex to Audio Output
-	widget = afg->widgets;
-	for (nodeid_t nodeID = afg->widgetsStart; nodeID < afg->widgetsStart + afg->widgetsCount; nodeID++, widget++)
+// Parameters (VERB_GET_PARAMETER) describe what a node can do and never
+// change, so each one only needs to be read from the codec once. Enumeration
+// fills in the ones it reads, and the rest are cached the first time they are
+// asked for. Only the root node, the audio function group and its widgets
+// have a cache.
+
+static struct HDAParamCache *param_cache(struct HDACodec *codec, nodeid_t nodeID)
+{
+	struct HDAAudioFuncGroup *afg = &codec->afg;
+
+	if (nodeID == 0)
+		return &codec->params;
+	if (afg->nodeID != 0 && nodeID == afg->nodeID)
+		return &afg->params;
+	if (afg->widgets != NULL && nodeID >= afg->widgetsStart && nodeID < afg->widgetsStart + afg->widgetsCount)
+		return &afg->widgetCaches[nodeID - afg->widgetsStart].params;
+	return NULL;
+}
+
+// If the command reads a parameter, returns the cache it belongs in
+static struct HDAParamCache *param_cache_for_command(uint32_t command, unsigned int *param)
+{
+	struct HDACodec *codec;
+
+	if (GET_BITS(command, 8, 12) != VERB_GET_PARAMETER)
+		return NULL;
+	*param = GET_BITS(command, 0, 8);
+	if (*param >= HDA_PARAM_CACHE_COUNT || (codec = codec_by_addr(command >> 28)) == NULL)
+		return NULL;
+	return param_cache(codec, GET_BITS(command, 20, 8));
+}
+
+// Remembers the response to a command if it was a parameter read
+static void param_cache_store(uint32_t command, uint32_t response)
+{
+	unsigned int param;
+	struct HDAParamCache *cache = param_cache_for_command(command, &param);
+
+	if (cache != NULL)
 	{
-		if (widget->type == WIDGET_TYPE_PIN_COMPLEX && (widget->pinCaps & PINCAP_OUTPUT))
-		{
-			build_output_path(codec, widget);
-			if (widget->outPath != 0)
-			{
-				dprintf("enabling output pin %i\n", nodeID);
+		cache->values[param] = response;
+		cache->valid |= 1 << param;
+	}
+}
 
-				// enable output
-				uint32_t pinCtrl;
-				commands[0] = MAKE_COMMAND(codec->addr, widget->nodeID, VERB_GET_PIN_CONTROL, 0);
-				hda_run_commands(commands, &pinCtrl, 1);
-				pinCtrl |= PIN_CONTROL_OUTPUT_ENABLE;
-				commands[0] = MAKE_COMMAND(codec->addr, widget->nodeID, VERB_SET_PIN_CONTROL, pinCtrl);
-				hda_run_commands(commands, responses, 1);
+// Gets the response to a command from the cache, if the command is a
+// parameter read that has been seen before
+static BOOL param_cache_lookup(uint32_t command, uint32_t *response)
+{
+	unsigned int param;
+	struct HDAParamCache *cache = param_cache_for_command(command, &param);
 
-				// unmute all nodes in path
-				struct HDAWidget *w;
-				for (w = widget; w->outPath != 0; w = get_widget_by_id(codec, w->outPath))
-					unmute_widget(codec, w);
-				ASSERT(w->type == WIDGET_TYPE_AUDIO_OUTPUT);
-				// set stream tag
-				w->streamTag = OUTPUT_STREAM_TAG;
-				commands[0] = MAKE_COMMAND(codec->addr, w->nodeID, VERB_SET_CONVERTER_STREAM_CHANNEL, (widget->streamTag << 4) | 0);
-				hda_run_commands(commands, responses, 1);
-				unmute_widget(codec, w);
-				if (w->caps & WIDGET_CAP_DIGITAL)
-				{
-					// There's an extra bit that we need to enable for digital Audio Outputs
-					uint32_t digiconv;
-					commands[0] = MAKE_COMMAND(codec->addr, w->nodeID, VERB_GET_DIGICONVERT, 0);
-					hda_run_commands(commands, &digiconv, 1);
-					digiconv |= 1;
-					commands[0] = MAKE_COMMAND(codec->addr, w->nodeID, VERB_SET_DIGICONVERT0, (digiconv & 0xFF));
-					hda_run_commands(commands, responses, 1);
+	if (cache == NULL || !(cache->valid & (1 << param)))
+		return FALSE;
+	*response = cache->values[param];
+	verbStats.paramCacheHits++;
+	return TRUE;
+}
+
+// Reads a parameter of a node
+BOOL hda_get_parameter(struct HDACodec *codec, nodeid_t nodeID, unsigned int param, uint32_t *value)
+{
+	uint32_t command = MAKE_COMMAND(codec->addr, nodeID, VERB_GET_PARAMETER, param);
+
+	if (param_cache_lookup(command, value))
+		return TRUE;
+	if (!hda_run_command(command, value))
+		return FALSE;
+	param_cache_store(command, *value);
+	return TRUE;
+}
+
+// Reads the input or output amplifier capabilities of a widget. Widgets
+// without WIDGET_CAP_AMP_PARAM_OVERRIDE use the function group's defaults.
+BOOL hda_get_amp_caps(struct HDACodec *codec, struct HDAWidget *widget, BOOL output, uint32_t *caps)
+{
+	nodeid_t nodeID = (widget->caps & WIDGET_CAP_AMP_PARAM_OVERRIDE) ? widget->nodeID : codec->afg.nodeID;
+
+	return hda_get_parameter(codec, nodeID, output ? PARAM_OUTPUT_AMP_CAP : PARAM_INPUT_AMP_CAP, caps);
+}
+
+//------------------------------------------------------------------------------
+// Shadow state
+//------------------------------------------------------------------------------
+
+// Most of a widget's controls change only when the driver (or hdactl, through
+// the driver) sets them, so the driver can remember what it set them to.
+// Commands that would set a control to the value it already has are skipped,
+// and reads of a known value are answered without asking the codec. Reads of
+// the power state and the digital converter bits always go to the codec,
+// because their responses report more than what was set. The codec can
+// change EAPD by itself, and a volume knob can change amp gains, so those
+// aren't answered from the shadow state either. Power state changes and
+// function group resets make the codec forget its settings, and the shadow
+// state of its widgets along with them.
+
+struct ShadowVerbs
+{
+	uint16_t set;
+	uint16_t get;  // 0 if reads can't be answered from the shadow state
+};
+
+// Indexed by the SHADOW_* controls
+static const struct ShadowVerbs shadowVerbs[SHADOW_CONTROLS_COUNT] =
+{
+	{ VERB_SET_CONNECTION_SELECT_CTRL,   VERB_GET_CONNECTION_SELECT_CTRL },
+	{ VERB_SET_POWER_STATE,              0 },
+	{ VERB_SET_CONVERTER_STREAM_CHANNEL, VERB_GET_CONVERTER_STREAM_CHANNEL },
+	{ VERB_SET_PIN_CONTROL,              VERB_GET_PIN_CONTROL },
+	{ VERB_SET_EAPD_ENABLE,              0 },
+	{ VERB_SET_DIGICONVERT0,             0 },
+	{ VERB_SET_DIGICONVERT1,             0 },
+	{ VERB_SET_CONV_CHAN_COUNT,          VERB_GET_CONV_CHAN_COUNT },
+};
+
+// Returns the shadow state of the widget a command is addressed to, or NULL if
+// it isn't for a widget of an enumerated audio function group
+static struct HDAWidgetShadow *shadow_for_command(uint32_t command)
+{
+	struct HDACodec *codec = codec_by_addr(command >> 28);
+	nodeid_t nodeID = GET_BITS(command, 20, 8);
+
+	if (codec == NULL || codec->afg.widgets == NULL
+	 || nodeID < codec->afg.widgetsStart || nodeID >= codec->afg.widgetsStart + codec->afg.widgetsCount)
+		return NULL;
+	return &codec->afg.widgetCaches[nodeID - codec->afg.widgetsStart].shadow;
+}
+
+// Splits a command into its verb and payload. The 4-bit verbs (0x2-0xD) have
+// a 16-bit payload, and are returned as 0x200-0xD00.
+static unsigned int command_verb(uint32_t command, unsigned int *payload)
+{
+	unsigned int verb = GET_BITS(command, 8, 12);
+
+	if ((verb >> 8) == 0x7 || (verb >> 8) == 0xF)
+	{
+		*payload = GET_BITS(command, 0, 8);
+		return verb;
+	}
+	*payload = GET_BITS(command, 0, 16);
+	return verb & 0xF00;
+}
+
+// Forgets the state of all of a codec's widgets
+static void shadow_clear_codec(struct HDACodec *codec)
+{
+	for (int i = 0; i < codec->afg.widgetsCount; i++)
+		memset(&codec->afg.widgetCaches[i].shadow, 0, sizeof(struct HDAWidgetShadow));
+}
+
+// Returns TRUE if a codec has a volume knob, which changes the gains of the
+// amps it controls without the driver knowing
+static BOOL codec_has_volume_knob(const struct HDACodec *codec)
+{
+	for (int i = 0; i < codec->afg.widgetsCount; i++)
+	{
+		if (codec->afg.widgets[i].type == WIDGET_TYPE_VOLUME_KNOB)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+// Returns the index into amp[] of an amplifier, or -1 if it isn't shadowed
+static int amp_slot(BOOL output, unsigned int index)
+{
+	if (output)
+		return 0;
+	return (index < SHADOW_INPUT_AMPS) ? 1 + index : -1;
+}
+
+// Lists the amplifiers (slot, side) that a VERB_SET_AMP_GAIN_MUTE payload
+// applies to. Returns how many there are, or -1 if any isn't shadowed.
+static int amp_set_targets(unsigned int payload, int targets[4][2])
+{
+	int count = 0;
+
+	for (int dir = 0; dir < 2; dir++)  // output, input
+	{
+		if (!(payload & (1 << (15 - dir))))
+			continue;
+		int slot = amp_slot(dir == 0, GET_BITS(payload, 8, 4));
+		for (int side = 0; side < 2; side++)  // right, left
+		{
+			if (!(payload & (1 << (12 + side))))
+				continue;
+			if (slot < 0)
+				return -1;
+			targets[count][0] = slot;
+			targets[count][1] = side;
+			count++;
+		}
+	}
+	return count;
+}
+
+// Returns the control a 12-bit verb sets or gets, or -1 if it isn't shadowed
+static int shadow_control(unsigned int verb, BOOL *set)
+{
+	for (int i = 0; i < SHADOW_CONTROLS_COUNT; i++)
+	{
+		*set = (verb == shadowVerbs[i].set);
+		if (*set || (shadowVerbs[i].get != 0 && verb == shadowVerbs[i].get))
+			return i;
+	}
+	return -1;
+}
+
+// Returns TRUE if a command can be skipped: it sets a control to the value it
+// already has, or it reads a value that is known. The response is the one
+// the codec would give.
+static BOOL shadow_lookup(uint32_t command, uint32_t *response)
+{
+	struct HDAWidgetShadow *shadow = shadow_for_command(command);
+	unsigned int verb, payload;
+	int targets[4][2];
+	BOOL hit = FALSE;
+	BOOL set;
+
+	if (shadow == NULL)
+		return FALSE;
+	verb = command_verb(command, &payload);
+	*response = 0;
+	switch (verb)
+	{
+	case VERB_SET_CONVERTER_FORMAT:
+		hit = (shadow->valid & SHADOW_FORMAT_VALID) && shadow->format == payload;
+		break;
+	case VERB_GET_CONVERTER_FORMAT:
+		hit = (shadow->valid & SHADOW_FORMAT_VALID) != 0;
+		*response = shadow->format;
+		break;
+	case VERB_SET_AMP_GAIN_MUTE:
+	{
+		if (codec_has_volume_knob(codec_by_addr(command >> 28)))
+			break;
+		int count = amp_set_targets(payload, targets);
+		hit = (count > 0);
+		for (int i = 0; i < count; i++)
+		{
+			int slot = targets[i][0], side = targets[i][1];
+			if (!(shadow->ampValid[side] & (1 << slot)) || shadow->amp[slot][side] != (payload & 0xFF))
+				hit = FALSE;
+		}
+		break;
+	}
+	case VERB_GET_AMP_GAIN_MUTE:
+	{
+		if (codec_has_volume_knob(codec_by_addr(command >> 28)))
+			break;
+		int slot = amp_slot((payload & GET_AMP_GAIN_MUTE_OUTPUT) != 0, GET_BITS(payload, 0, 4));
+		int side = (payload & GET_AMP_GAIN_MUTE_LEFT) ? 1 : 0;
+		if (slot >= 0 && (shadow->ampValid[side] & (1 << slot)))
+		{
+			hit = TRUE;
+			*response = shadow->amp[slot][side];
+		}
+		break;
+	}
+	default:
+	{
+		int control = shadow_control(verb, &set);
+		// Power state changes are always sent, since the widget may have
+		// been powered down along with its function group, and EAPD sets
+		// are, since the codec may have changed it
+		if (control == SHADOW_POWER_STATE || control == SHADOW_EAPD)
+			break;
+		if (control >= 0 && (shadow->valid & (1 << control)))
+		{
+			if (set)
+				hit = (shadow->controls[control] == payload);
+			else
+			{
+				hit = TRUE;
+				*response = shadow->controls[control];
+			}
+		}
+		break;
+	}
+	}
+	if (hit)
+		verbStats.shadowHits++;
+	return hit;
+}
+
+// Records the value a control was set to, or the value read from it
+static void shadow_store(uint32_t command, uint32_t response)
+{
+	struct HDAWidgetShadow *shadow = shadow_for_command(command);
+	unsigned int verb, payload;
+	int targets[4][2];
+	BOOL set;
+
+	if (shadow == NULL)
+	{
+		// A function group's power state applies to all of its widgets, and
+		// they may lose their settings, as they do when it is reset
+		struct HDACodec *codec = codec_by_addr(command >> 28);
+		if (codec != NULL && codec->afg.widgets != NULL && GET_BITS(command, 20, 8) == codec->afg.nodeID)
+		{
+			verb = command_verb(command, &payload);
+			if (verb == VERB_SET_POWER_STATE || verb == VERB_FUNCTION_RESET)
+				shadow_clear_codec(codec);
+		}
+		return;
+	}
+	verb = command_verb(command, &payload);
+	switch (verb)
+	{
+	case VERB_SET_CONVERTER_FORMAT:
+	case VERB_GET_CONVERTER_FORMAT:
+		shadow->format = (verb == VERB_SET_CONVERTER_FORMAT) ? payload : GET_BITS(response, 0, 16);
+		shadow->valid |= SHADOW_FORMAT_VALID;
+		break;
+	case VERB_SET_AMP_GAIN_MUTE:
+	{
+		int count = amp_set_targets(payload, targets);
+		for (int i = 0; i < count; i++)
+		{
+			shadow->amp[targets[i][0]][targets[i][1]] = payload & 0xFF;
+			shadow->ampValid[targets[i][1]] |= 1 << targets[i][0];
+		}
+		break;
+	}
+	case VERB_GET_AMP_GAIN_MUTE:
+	{
+		int slot = amp_slot((payload & GET_AMP_GAIN_MUTE_OUTPUT) != 0, GET_BITS(payload, 0, 4));
+		int side = (payload & GET_AMP_GAIN_MUTE_LEFT) ? 1 : 0;
+		if (slot >= 0)
+		{
+			shadow->amp[slot][side] = response & 0xFF;
+			shadow->ampValid[side] |= 1 << slot;
+		}
+		break;
+	}
+	case VERB_GET_DIGICONVERT:
+		shadow->controls[SHADOW_DIGICONV0] = GET_BITS(response, 0, 8);
+		shadow->controls[SHADOW_DIGICONV1] = GET_BITS(response, 8, 8);
+		shadow->valid |= (1 << SHADOW_DIGICONV0) | (1 << SHADOW_DIGICONV1);
+		break;
+	default:
+	{
+		int control = shadow_control(verb, &set);
+		if (control < 0)
+			break;
+		// Don't trust anything else across a power state change
+		if (control == SHADOW_POWER_STATE && set)
+			memset(shadow, 0, sizeof(*shadow));
+		shadow->controls[control] = set ? payload : GET_BITS(response, 0, 8);
+		shadow->valid |= 1 << control;
+		break;
+	}
+	}
+}
+
+// Forgets the state of the widget a command was sent to, after the command
+// failed and its effect is unknown
+static void shadow_forget(uint32_t command)
+{
+	struct HDAWidgetShadow *shadow = shadow_for_command(command);
+
+	if (shadow != NULL)
+		memset(shadow, 0, sizeof(*shadow));
+}
+
+static BOOL run_commands_and_cache(const uint32_t *commands, uint32_t *responses, unsigned int count)
+{
+	if (count == 0)
+		return TRUE;
+	if (!hda_run_commands(commands, responses, count))
+	{
+		for (unsigned int i = 0; i < count; i++)
+			shadow_forget(commands[i]);
+		return FALSE;
+	}
+	for (unsigned int i = 0; i < count; i++)
+	{
+		param_cache_store(commands[i], responses[i]);
+		shadow_store(commands[i], responses[i]);
+	}
+	return TRUE;
+}
+
+// Runs commands, answering parameter reads from the cache and skipping the
+// ones the shadow state makes unnecessary. The commands in between are sent
+// as usual.
+static BOOL hda_run_commands_cached(const uint32_t *commands, uint32_t *responses, unsigned int count)
+{
+	unsigned int start = 0;
+
+	for (unsigned int i = 0; i < count; i++)
+	{
+		// Recorded even if the shadow state skips it, since the codec won't
+		// necessarily be in the same state the next time
+		topology_record(commands[i]);
+		if (param_cache_lookup(commands[i], &responses[i]) || shadow_lookup(commands[i], &responses[i]))
+		{
+			if (!run_commands_and_cache(commands + start, responses + start, i - start))
+				return FALSE;
+			start = i + 1;
+		}
+		else if (verb_class(commands[i]) == HDA_VERB_CLASS_SET)
+		{
+			// Later commands in the batch see the new value
+			shadow_store(commands[i], 0);
+		}
+	}
+	return run_commands_and_cache(commands + start, responses + start, count - start);
+}
+
+// Runs commands without answering any of them from the shadow state, so that
+// hdactl sees what the codec reports. The shadow state learns from them as
+// usual.
+static BOOL hda_run_commands_uncached(const uint32_t *commands, uint32_t *responses, unsigned int count)
+{
+	for (unsigned int i = 0; i < count; i++)
+		topology_record(commands[i]);
+	return run_commands_and_cache(commands, responses, count);
+}
+
+//------------------------------------------------------------------------------
+// Unsolicited responses
+//------------------------------------------------------------------------------
+
+// Codecs report events such as a jack being plugged in with unsolicited
+// responses, which arrive in the RIRB between ordinary responses. A node only
+// sends them after being given a tag with VERB_SET_UNSOLRESP, and the tag
+// identifies the handler. The handlers usually need to send commands of their
+// own, so they can't run in the interrupt handler; it just queues the
+// responses and schedules a global event to dispatch them.
+
+static volatile BOOL unsolEventPending;
+
+static void unsol_event(HVM hVM, ULONG refData)
+{
+	unsolEventPending = FALSE;
+	for (int i = 0; i < codecsCount; i++)
+	{
+		struct HDACodec *codec = &codecs[i];
+		while (codec->unsolTail != codec->unsolHead)
+		{
+			uint32_t response = codec->unsolQueue[codec->unsolTail];
+			codec->unsolTail = (codec->unsolTail + 1) % HDA_UNSOL_QUEUE_SIZE;
+			struct HDAUnsolEntry *entry = &codec->unsol[(response >> 26) % HDA_UNSOL_TAGS];
+			if (entry->handler != NULL)
+				entry->handler(codec, entry->nodeID, response, entry->context);
+			else
+				dprintf("codec %i: unsolicited response %08X with unknown tag\n", codec->addr, response);
+		}
+	}
+}
+#pragma aux unsol_event \
+	__parm [ebx] [edx]
+
+// Called by hda_cmd_harvest for each unsolicited response in the RIRB
+static void hda_unsol_queue(unsigned int codecAddr, uint32_t response)
+{
+	struct HDACodec *codec = codec_by_addr(codecAddr);
+	unsigned int next = (codec != NULL) ? (codec->unsolHead + 1) % HDA_UNSOL_QUEUE_SIZE : 0;
+	if (codec == NULL || next == codec->unsolTail)
+	{
+		verbStats.unsolicitedSkipped++;
+		return;
+	}
+	verbStats.unsolicited++;
+	codec->unsolQueue[codec->unsolHead] = response;
+	codec->unsolHead = next;
+	if (!unsolEventPending)
+	{
+		unsolEventPending = TRUE;
+		Schedule_Global_Event(unsol_event, 0);
+	}
+}
+
+// Has the node send unsolicited responses to a handler. Returns the tag given
+// to the node, or -1 if there was none left or the node didn't respond.
+int hda_unsol_register(struct HDACodec *codec, nodeid_t nodeID, HDAUnsolHandler handler, void *context)
+{
+	uint32_t response;
+	int tag;
+
+	for (tag = 1; tag < HDA_UNSOL_TAGS; tag++)
+		if (codec->unsol[tag].handler == NULL)
+			break;
+	if (tag == HDA_UNSOL_TAGS)
+	{
+		dprintf("codec %i: out of unsolicited response tags\n", codec->addr);
+		return -1;
+	}
+	codec->unsol[tag].context = context;
+	codec->unsol[tag].nodeID = nodeID;
+	codec->unsol[tag].handler = handler;
+	if (!hda_run_command(MAKE_COMMAND(codec->addr, nodeID, VERB_SET_UNSOLRESP, (1 << 7) | tag), &response))
+	{
+		codec->unsol[tag].handler = NULL;
+		return -1;
+	}
+	return tag;
+}
+
+void hda_unsol_unregister(struct HDACodec *codec, int tag)
+{
+	uint32_t response;
+
+	ASSERT(tag > 0 && tag < HDA_UNSOL_TAGS && codec->unsol[tag].handler != NULL);
+	hda_run_command(MAKE_COMMAND(codec->addr, codec->unsol[tag].nodeID, VERB_SET_UNSOLRESP, 0), &response);
+	codec->unsol[tag].handler = NULL;
+}
+
+// Discovers and initializes all codecs attached to the controller
+static BOOL hda_controller_enum_codecs(void)
+{
+	unsigned long long now = timer_read();
+	uint16_t statests;
+
+	if (now < codecsReportedTime)
+		wait_ticks(codecsReportedTime - now);
+	statests = hdaRegs->STATESTS;
+	initTimes.codecMask = statests;
+	codecsCount = 0;
+	for (int i = 0; i < MAX_CODECS; i++)
+	{
+		if (statests & (1 << i))
+		{
+			struct HDACodec *codec = &codecs[codecsCount++];
+			memset(codec, 0, sizeof(*codec));
+			codec->addr = i;
+		}
+	}
+	if (codecsCount == 0)
+	{
+		dprintf("no codecs found\n");
+		return FALSE;
+	}
+	hda_codecs_init();
+
+	// Forget the codecs that stopped responding
+	int kept = 0;
+	for (int i = 0; i < codecsCount; i++)
+	{
+		struct HDACodec *codec = &codecs[i];
+		if (cmdDeadCodecs & (1 << codec->addr))
+		{
+			initTimes.droppedCodecs |= 1 << codec->addr;
+			if (codec->afg.connections != NULL)
+				memory_free(codec->afg.connections);
+			if (codec->afg.widgets != NULL)
+				memory_free(codec->afg.widgets);
+			continue;
+		}
+		if (kept != i)
+			codecs[kept] = *codec;
+		kept++;
+	}
+	memset(&codecs[kept], 0, (codecsCount - kept) * sizeof(codecs[0]));
+	codecsCount = kept;
+	if (codecsCount == 0)
+	{
+		dprintf("no codecs responded\n");
+		return FALSE;
+	}
+	return TRUE;
+}
+
+//------------------------------------------------------------------------------
+// Topology cache
+//------------------------------------------------------------------------------
+
+// Enumerating a codec and setting up its output paths takes a few hundred
+// verbs, and happens during boot. What it finds is saved in the software key
+// of the devnode, one value per codec, along with the SET verbs that were
+// sent. If the next boot finds the same codec on the same controller, the
+// widgets are loaded from there and the verbs are replayed in one batch. A
+// codec that doesn't match its cache is enumerated again, and the cache is
+// rewritten.
+
+// Must change whenever the layout of the cache does, or the verbs that setting
+// up a codec sends, so that caches written by other versions are ignored
+#define TOPOLOGY_CACHE_VERSION 2
+
+#define TOPOLOGY_MAX_INIT_VERBS 256
+
+struct TopologyCache
+{
+	uint32_t version;
+	uint32_t size;  // of the whole value
+	uint16_t pciVendorID;  // of the controller
+	uint16_t pciDeviceID;
+	uint32_t vendorID;  // of the codec
+	uint32_t revisionID;
+	uint32_t subNodeCount;
+	struct HDAParamCache params;  // of the root node
+	nodeid_t afgNodeID;
+	uint8_t widgetsStart;
+	uint8_t widgetsCount;
+	struct HDAParamCache afgParams;
+	uint32_t initVerbsCount;
+	uint32_t connectionsCount;
+	// followed by the widgets and their caches (as in memory), the SET verbs,
+	// then the connection lists
+};
+
+// Returns the size of a cache with these counts
+static uint32_t topology_cache_size(unsigned int widgetsCount, unsigned int initVerbsCount, unsigned int connectionsCount)
+{
+	return sizeof(struct TopologyCache)
+	     + widgetsCount * (sizeof(struct HDAWidget) + sizeof(struct HDAWidgetCache))
+	     + initVerbsCount * sizeof(uint32_t)
+	     + connectionsCount * sizeof(nodeid_t);
+}
+
+// Returns TRUE if every widget loaded from the cache is where its node ID says
+// it is and only refers to connections and widgets that exist, so that a
+// stale or corrupt cache can't send the path code outside the arrays
+static BOOL topology_check_widgets(const struct HDAAudioFuncGroup *afg, uint32_t connectionsCount)
+{
+	for (int i = 0; i < afg->widgetsCount; i++)
+	{
+		const struct HDAWidget *widget = &afg->widgets[i];
+
+		if (widget->nodeID != afg->widgetsStart + i
+		 || widget->connectionsStart + widget->connectionsCount > connectionsCount
+		 || (widget->outPath != 0 && (widget->outPath < afg->widgetsStart
+		  || widget->outPath >= afg->widgetsStart + afg->widgetsCount)))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+static void topology_value_name(struct HDACodec *codec, char *name)
+{
+	strcpy(name, "Topology0");
+	name[8] = "0123456789ABCDEF"[codec->addr];
+}
+
+// Fills in the header fields that identify the hardware. The codec's are read
+// in one batch, or come from the parameter cache if enumeration read them.
+static BOOL topology_identify(struct HDACodec *codec, struct TopologyCache *cache)
+{
+	uint32_t commands[3], responses[3];
+	uint16_t vendor, device;
+
+	if (!pci_read_word(&vendor, hdaDevNode, 0) || !pci_read_word(&device, hdaDevNode, 2))
+		return FALSE;
+	commands[0] = MAKE_COMMAND(codec->addr, 0, VERB_GET_PARAMETER, PARAM_VENDOR_ID);
+	commands[1] = MAKE_COMMAND(codec->addr, 0, VERB_GET_PARAMETER, PARAM_REVISION_ID);
+	commands[2] = MAKE_COMMAND(codec->addr, 0, VERB_GET_PARAMETER, PARAM_SUB_NODE_COUNT);
+	if (!hda_run_commands_cached(commands, responses, 3))
+		return FALSE;
+	cache->version = TOPOLOGY_CACHE_VERSION;
+	cache->pciVendorID = vendor;
+	cache->pciDeviceID = device;
+	cache->vendorID = responses[0];
+	cache->revisionID = responses[1];
+	cache->subNodeCount = responses[2];
+	return TRUE;
+}
+
+// Called with every command sent while setting up a codec
+static void topology_record(uint32_t command)
+{
+	struct HDACodec *codec;
+
+	if (verb_class(command) != HDA_VERB_CLASS_SET)
+		return;
+	codec = codec_by_addr(command >> 28);
+	if (codec == NULL || codec->initVerbs == NULL)
+		return;
+	// Too many to record makes the count invalid, so nothing is saved
+	if (codec->initVerbsCount < TOPOLOGY_MAX_INIT_VERBS)
+		codec->initVerbs[codec->initVerbsCount] = command;
+	codec->initVerbsCount++;
+}
+
+static void topology_record_start(struct HDACodec *codec)
+{
+	codec->initVerbs = memory_alloc(TOPOLOGY_MAX_INIT_VERBS * sizeof(uint32_t));
+	codec->initVerbsCount = 0;
+}
+
+static void topology_record_stop(struct HDACodec *codec)
+{
+	if (codec->initVerbs != NULL)
+		memory_free(codec->initVerbs);
+	codec->initVerbs = NULL;
+}
+
+// Saves the topology of a codec that was just set up, along with the SET
+// verbs that were recorded
+static void topology_save(struct HDACodec *codec)
+{
+	struct HDAAudioFuncGroup *afg = &codec->afg;
+	struct TopologyCache *cache;
+	struct HDAWidgetCache *widgetCaches;
+	uint32_t *initVerbs;
+	uint32_t size;
+	char valueName[16];
+
+	if (codec->initVerbs == NULL || codec->initVerbsCount > TOPOLOGY_MAX_INIT_VERBS)
+		return;
+	size = topology_cache_size(afg->widgetsCount, codec->initVerbsCount, afg->connectionsCount);
+	cache = memory_alloc(size);
+	if (cache == NULL)
+		return;
+	memset(cache, 0, sizeof(*cache));
+	if (!topology_identify(codec, cache))
+		goto done;
+	cache->size = size;
+	cache->params = codec->params;
+	cache->afgNodeID = afg->nodeID;
+	cache->widgetsStart = afg->widgetsStart;
+	cache->widgetsCount = afg->widgetsCount;
+	cache->afgParams = afg->params;
+	cache->initVerbsCount = codec->initVerbsCount;
+	cache->connectionsCount = afg->connectionsCount;
+	memcpy(cache + 1, afg->widgets, afg->widgetsCount * (sizeof(struct HDAWidget) + sizeof(struct HDAWidgetCache)));
+	// The control values will be whatever the codec resets to
+	widgetCaches = (struct HDAWidgetCache *)((struct HDAWidget *)(cache + 1) + afg->widgetsCount);
+	for (int i = 0; i < afg->widgetsCount; i++)
+		memset(&widgetCaches[i].shadow, 0, sizeof(widgetCaches[i].shadow));
+	initVerbs = (uint32_t *)(widgetCaches + afg->widgetsCount);
+	memcpy(initVerbs, codec->initVerbs, codec->initVerbsCount * sizeof(uint32_t));
+	memcpy(initVerbs + codec->initVerbsCount, afg->connections, afg->connectionsCount * sizeof(nodeid_t));
+
+	topology_value_name(codec, valueName);
+	if (CM_Write_Registry_Value(hdaDevNode, NULL, valueName, REG_BINARY, cache, size, CM_REGISTRY_SOFTWARE) != CR_SUCCESS)
+		dprintf("codec %i: could not save topology\n", codec->addr);
+done:
+	memory_free(cache);
+}
+
+// Sets up a codec from its topology cache, if it has one and it's for the same
+// hardware. Returns FALSE if the codec has to be enumerated.
+static BOOL topology_load(struct HDACodec *codec)
+{
+	struct HDAAudioFuncGroup *afg = &codec->afg;
+	struct TopologyCache *cache = NULL;
+	struct TopologyCache current;
+	uint32_t *initVerbs;
+	uint32_t *responses;
+	size_t widgetsSize;
+	ULONG size = 0;
+	char valueName[16];
+
+	// Find out how big it is, then read it
+	topology_value_name(codec, valueName);
+	CM_Read_Registry_Value(hdaDevNode, NULL, valueName, REG_BINARY, NULL, &size, CM_REGISTRY_SOFTWARE);
+	if (size < sizeof(*cache))
+		return FALSE;
+	cache = memory_alloc(size);
+	if (cache == NULL)
+		return FALSE;
+	if (CM_Read_Registry_Value(hdaDevNode, NULL, valueName, REG_BINARY, cache, &size, CM_REGISTRY_SOFTWARE) != CR_SUCCESS
+	 || cache->version != TOPOLOGY_CACHE_VERSION || cache->size != size
+	 || cache->initVerbsCount > TOPOLOGY_MAX_INIT_VERBS
+	 || size != topology_cache_size(cache->widgetsCount, cache->initVerbsCount, cache->connectionsCount))
+		goto failed;
+
+	memset(&current, 0, sizeof(current));
+	if (!topology_identify(codec, &current)
+	 || current.pciVendorID != cache->pciVendorID || current.pciDeviceID != cache->pciDeviceID
+	 || current.vendorID != cache->vendorID || current.revisionID != cache->revisionID
+	 || current.subNodeCount != cache->subNodeCount)
+	{
+		dprintf("codec %i: topology cache is for different hardware\n", codec->addr);
+		goto failed;
+	}
+
+	codec->childStart = GET_BITS(cache->subNodeCount, 16, 8);
+	codec->childCount = GET_BITS(cache->subNodeCount, 0, 8);
+	codec->params = cache->params;
+	afg->nodeID = cache->afgNodeID;
+	afg->widgetsStart = cache->widgetsStart;
+	afg->widgetsCount = cache->widgetsCount;
+	afg->params = cache->afgParams;
+	if (!alloc_widgets(afg))
+		goto failed;
+	widgetsSize = afg->widgetsCount * (sizeof(struct HDAWidget) + sizeof(struct HDAWidgetCache));
+	memcpy(afg->widgets, cache + 1, widgetsSize);
+	if (!topology_check_widgets(afg, cache->connectionsCount))
+	{
+		dprintf("codec %i: topology cache is corrupt\n", codec->addr);
+		goto failed_widgets;
+	}
+	initVerbs = (uint32_t *)((uint8_t *)(cache + 1) + widgetsSize);
+	if (cache->connectionsCount > 0)
+	{
+		afg->connections = memory_alloc(cache->connectionsCount * sizeof(nodeid_t));
+		if (afg->connections == NULL)
+			goto failed_widgets;
+		memcpy(afg->connections, initVerbs + cache->initVerbsCount, cache->connectionsCount * sizeof(nodeid_t));
+		afg->connectionsCount = cache->connectionsCount;
+	}
+
+	// Program the paths
+	responses = memory_alloc(cache->initVerbsCount * sizeof(uint32_t) + 1);
+	if (responses == NULL)
+		goto failed_widgets;
+	if (!hda_run_commands_cached(initVerbs, responses, cache->initVerbsCount))
+	{
+		dprintf("codec %i: setting up paths from the topology cache failed\n", codec->addr);
+		memory_free(responses);
+		goto failed_widgets;
+	}
+	memory_free(responses);
+	dprintf("codec %i: loaded %i widgets and %i verbs from the topology cache\n",
+		codec->addr, afg->widgetsCount, cache->initVerbsCount);
+	memory_free(cache);
+	return TRUE;
+
+failed_widgets:
+	if (afg->connections != NULL)
+		memory_free(afg->connections);
+	memory_free(afg->widgets);
+	memset(afg, 0, sizeof(*afg));
+failed:
+	memory_free(cache);
+	return FALSE;
+}
+
+//------------------------------------------------------------------------------
+// HDA codecs
+//------------------------------------------------------------------------------
+
+// Returns the widget in the codec with the given node ID
+static struct HDAWidget *get_widget_by_id(struct HDACodec *codec, nodeid_t nodeID)
+{
+	ASSERT(nodeID >= codec->afg.widgetsStart && nodeID < codec->afg.widgetsStart + codec->afg.widgetsCount);
+	struct HDAWidget *widget = &codec->afg.widgets[nodeID - codec->afg.widgetsStart];
+	ASSERT(widget->nodeID == nodeID);
+	return widget;
+}
+
+// Returns the widget's connection list, which has connectionsCount entries
+static nodeid_t *get_widget_connections(struct HDACodec *codec, struct HDAWidget *widget)
+{
+	return codec->afg.connections + widget->connectionsStart;
+}
+
+// Returns the rest of a widget
+static struct HDAWidgetCache *get_widget_cache(struct HDACodec *codec, struct HDAWidget *widget)
+{
+	return &codec->afg.widgetCaches[widget - codec->afg.widgets];
+}
+
+// Finds the shortest path from every widget to an "Audio Output" widget at
+// once, with a breadth-first search outwards from the Audio Outputs against
+// the direction of the connections. Each widget's outPath is set to the next
+// node on its path, or 0 if there is none. Where several connections lead to
+// equally short paths, the first one in the connection list wins.
+static void plan_output_paths(struct HDACodec *codec)
+{
+	struct HDAAudioFuncGroup *afg = &codec->afg;
+	uint8_t dist[256];  // hops to an Audio Output, indexed like afg->widgets, or 0xFF if unreached
+	BOOL reached = TRUE;
+
+	for (int i = 0; i < afg->widgetsCount; i++)
+	{
+		afg->widgets[i].outPath = 0;
+		dist[i] = (afg->widgets[i].type == WIDGET_TYPE_AUDIO_OUTPUT) ? 0 : 0xFF;
+	}
+
+	// Each pass reaches the widgets that are one hop further away than the
+	// last. Every widget is reached at most once, so cycles in the connection
+	// graph can't send this around in circles.
+	for (int d = 0; reached; d++)
+	{
+		reached = FALSE;
+		for (int i = 0; i < afg->widgetsCount; i++)
+		{
+			struct HDAWidget *widget = &afg->widgets[i];
+			nodeid_t *connections = get_widget_connections(codec, widget);
+			if (dist[i] != 0xFF)
+				continue;
+			for (int j = 0; j < widget->connectionsCount; j++)
+			{
+				nodeid_t nodeID = connections[j];
+				if (nodeID < afg->widgetsStart || nodeID >= afg->widgetsStart + afg->widgetsCount)
+				{
+					if (d == 0)
+						dprintf("warning: widget %i has invalid connection %i\n", widget->nodeID, nodeID);
+					continue;
+				}
+				if (dist[nodeID - afg->widgetsStart] == d)
+				{
+					dist[i] = d + 1;
+					widget->outPath = nodeID;
+					reached = TRUE;
+					break;
+				}
+			}
+		}
+	}
+}
+
+// Sets the connections along a widget's path to an "Audio Output"
+static void select_output_path(struct HDACodec *codec, struct HDAWidget *widget)
+{
+	uint32_t command, response;
+
+	for (struct HDAWidget *w = widget; w->outPath != 0; w = get_widget_by_id(codec, w->outPath))
+	{
+		// Mixers have a hard-wired list of inputs and grab audio from all of
+		// them, therefore not selectable. A single connection needs no selecting.
+		if (w->type == WIDGET_TYPE_AUDIO_MIXER || w->connectionsCount < 2)
+			continue;
+		int i;
+		// find index in the connection list
+		for (i = 0; i < w->connectionsCount; i++)
+			if (w->outPath == get_widget_connections(codec, w)[i])
+				break;
+		ASSERT(i < w->connectionsCount);
+		command = MAKE_COMMAND(codec->addr, w->nodeID, VERB_SET_CONNECTION_SELECT_CTRL, i);
+		hda_run_commands_cached(&command, &response, 1);
+		dprintf("connected widget %i to input %i\n", w->nodeID, w->outPath);
+	}
+}
+
+// If the widget has an output amplifier, unmutes it and sets its gain to max
+static void unmute_widget(struct HDACodec *codec, struct HDAWidget *widget)
+{
+	uint32_t commands[1], responses[1];
+	if (widget->caps & WIDGET_CAP_OUTPUT_AMP)
+	{
+		uint32_t ampCaps;
+		if (!hda_get_amp_caps(codec, widget, TRUE, &ampCaps))
+			return;
+		int maxGain = GET_BITS(ampCaps, 8, 7);  // NumSteps field
+		uint32_t ampGainMute = maxGain | (1 << 15) | (1 << 13) | (1 << 12);
+		commands[0] = MAKE_COMMAND(codec->addr, widget->nodeID, VERB_SET_AMP_GAIN_MUTE, ampGainMute);
+		hda_run_commands_cached(commands, responses, 1);
+	}
+}
+
+// If the mixer has input amplifiers, unmutes the one for a connection at 0 dB
+static void unmute_mixer_input(struct HDACodec *codec, struct HDAWidget *mixer, int index)
+{
+	uint32_t ampCaps, command, response;
+
+	ASSERT(index <= SET_AMP_GAIN_MUTE_MAX_INDEX);
+	if (!(mixer->caps & WIDGET_CAP_INPUT_AMP) || !hda_get_amp_caps(codec, mixer, FALSE, &ampCaps))
+		return;
+	int offset = GET_BITS(ampCaps, 0, 7);  // Offset field, the gain step for 0 dB
+	uint32_t ampGainMute = offset | (1 << 14) | (1 << 13) | (1 << 12) | (index << 8);
+	command = MAKE_COMMAND(codec->addr, mixer->nodeID, VERB_SET_AMP_GAIN_MUTE, ampGainMute);
+	hda_run_commands_cached(&command, &response, 1);
+}
+
+static void jack_sense_changed(struct HDACodec *codec, nodeid_t nodeID, uint32_t response, void *context)
+{
+	uint32_t pinSense;
+
+	if (!hda_run_command(MAKE_COMMAND(codec->addr, nodeID, VERB_GET_PIN_SENSE, 0), &pinSense))
+		return;
+	dprintf("codec %i: jack at pin %i %s\n", codec->addr, nodeID, (pinSense & (1 << 31)) ? "plugged in" : "unplugged");
+	TRACE(JACK, codec->addr, nodeID, pinSense >> 31, 0);
+}
+
+// Gets told when something is plugged into or unplugged from a jack
+static void hda_jacks_init(struct HDACodec *codec)
+{
+	struct HDAAudioFuncGroup *afg = &codec->afg;
+	struct HDAWidget *widget = afg->widgets;
+
+	for (int i = 0; i < afg->widgetsCount; i++, widget++)
+	{
+		if (widget->type == WIDGET_TYPE_PIN_COMPLEX
+		 && (afg->widgetCaches[i].pinCaps & PINCAP_PRESENCEDETECT) && (widget->caps & WIDGET_CAP_UNSOLICITED))
+			hda_unsol_register(codec, widget->nodeID, jack_sense_changed, NULL);
+	}
+}
+
+// Sets up the output paths of an enumerated audio function group
+static BOOL hda_func_group_init(struct HDACodec *codec, struct HDAAudioFuncGroup *afg)
+{
+	uint32_t commands[2], responses[2];
+	struct HDAWidget *widget;
+
+	dprintf("building paths\n");
+
+	// Find widget paths, from Pin Complex to Audio Output
+	plan_output_paths(codec);
+	widget = afg->widgets;
+	for (nodeid_t nodeID = afg->widgetsStart; nodeID < afg->widgetsStart + afg->widgetsCount; nodeID++, widget++)
+	{
+		if (widget->type == WIDGET_TYPE_PIN_COMPLEX && (get_widget_cache(codec, widget)->pinCaps & PINCAP_OUTPUT))
+		{
+			if (widget->outPath != 0)
+			{
+				dprintf("enabling output pin %i\n", nodeID);
+				select_output_path(codec, widget);
+
+				// enable output
+				uint32_t pinCtrl;
+				commands[0] = MAKE_COMMAND(codec->addr, widget->nodeID, VERB_GET_PIN_CONTROL, 0);
+				hda_run_commands_cached(commands, &pinCtrl, 1);
+				pinCtrl |= PIN_CONTROL_OUTPUT_ENABLE;
+				commands[0] = MAKE_COMMAND(codec->addr, widget->nodeID, VERB_SET_PIN_CONTROL, pinCtrl);
+				hda_run_commands_cached(commands, responses, 1);
+
+				// unmute all nodes in path
+				struct HDAWidget *w;
+				for (w = widget; w->outPath != 0; w = get_widget_by_id(codec, w->outPath))
+					unmute_widget(codec, w);
+				ASSERT(w->type == WIDGET_TYPE_AUDIO_OUTPUT);
+				// set stream tag
+				w->streamTag = OUTPUT_STREAM_TAG;
+				commands[0] = MAKE_COMMAND(codec->addr, w->nodeID, VERB_SET_CONVERTER_STREAM_CHANNEL, (w->streamTag << 4) | 0);
+				hda_run_commands_cached(commands, responses, 1);
+				unmute_widget(codec, w);
+				if (w->caps & WIDGET_CAP_DIGITAL)
+				{
+					// There's an extra bit that we need to enable for digital Audio Outputs
+					uint32_t digiconv;
+					commands[0] = MAKE_COMMAND(codec->addr, w->nodeID, VERB_GET_DIGICONVERT, 0);
+					hda_run_commands_cached(commands, &digiconv, 1);
+					digiconv |= 1;
+					commands[0] = MAKE_COMMAND(codec->addr, w->nodeID, VERB_SET_DIGICONVERT0, (digiconv & 0xFF));
+					hda_run_commands_cached(commands, responses, 1);
+				}
+			}
+		}
+	}
+
+	return TRUE;
+}
+
+// Allocates the widgets of an audio function group, cleared
+static BOOL alloc_widgets(struct HDAAudioFuncGroup *afg)
+{
+	size_t size = afg->widgetsCount * (sizeof(*afg->widgets) + sizeof(*afg->widgetCaches));
+
+	afg->widgets = memory_alloc(size);
+	if (afg->widgets == NULL)
+		return FALSE;
+	memset(afg->widgets, 0, size);
+	afg->widgetCaches = (struct HDAWidgetCache *)(afg->widgets + afg->widgetsCount);
+	return TRUE;
+}
+
+// Codecs are enumerated in waves. Each step sends one batch per codec, with
+// the commands for every node the step applies to, so that the CORB stays
+// full and a codec is probed in a handful of round trips however many widgets
+// it has. All codecs are enumerated at once, each moving on to its next step
+// as soon as its own batch is answered.
+enum
+{
+	ENUM_ROOT,  // vendor ID and function groups
+	ENUM_FUNC_GROUPS,  // type and widgets of each function group
+	ENUM_WIDGET_CAPS,  // capabilities of each widget
+	ENUM_PIN_CAPS,  // pin capabilities and connection list lengths
+	ENUM_CONN_LISTS,  // connection list entries, and enabling EAPD
+	ENUM_DONE,
+};
+
+#define ENUM_DEADLINE 500000  // microseconds
+
+struct CodecEnum
+{
+	struct HDACodec *codec;
+	int state;
+	BOOL incomplete;  // stopped early, so the topology isn't saved
+	struct HDACommandBatch batch;
+	uint32_t *commands;
+	uint32_t *responses;
+	unsigned int capacity;  // number of commands the arrays have room for
+};
+
+// Returns the number of entries fetched by each VERB_GET_CONNECTION_LIST_ENTRY
+static int conn_list_entries_per_command(struct HDACodec *codec, struct HDAWidget *widget)
+{
+	// The connection list length was cached during the previous step. Long
+	// form lists have two 16-bit entries per response, short form ones four
+	// 8-bit entries.
+	return (get_widget_cache(codec, widget)->params.values[PARAM_CONN_LIST_LENGTH] & (1 << 7)) ? 2 : 4;
+}
+
+// Fills in the commands for the current step, or just counts them if
+// commands is NULL. Returns how many there are.
+static unsigned int codec_enum_commands(struct CodecEnum *e, uint32_t *commands)
+{
+	struct HDACodec *codec = e->codec;
+	struct HDAAudioFuncGroup *afg = &codec->afg;
+	struct HDAWidget *widget = afg->widgets;
+	uint8_t addr = codec->addr;
+	unsigned int count = 0;
+
+#define ADD_COMMAND(nodeID, verb, payload) \
+	do { if (commands != NULL) commands[count] = MAKE_COMMAND(addr, nodeID, verb, payload); count++; } while (0)
+
+	switch (e->state)
+	{
+	case ENUM_ROOT:
+		ADD_COMMAND(0, VERB_GET_PARAMETER, PARAM_VENDOR_ID);
+		ADD_COMMAND(0, VERB_GET_PARAMETER, PARAM_SUB_NODE_COUNT);
+		ADD_COMMAND(0, VERB_GET_PARAMETER, PARAM_REVISION_ID);  // for the topology cache
+		break;
+	case ENUM_FUNC_GROUPS:
+		for (nodeid_t nodeID = codec->childStart; nodeID < codec->childStart + codec->childCount; nodeID++)
+		{
+			ADD_COMMAND(nodeID, VERB_GET_PARAMETER, PARAM_FUNC_GRP_TYPE);
+			ADD_COMMAND(nodeID, VERB_GET_PARAMETER, PARAM_SUB_NODE_COUNT);
+		}
+		break;
+	case ENUM_WIDGET_CAPS:
+		for (int i = 0; i < afg->widgetsCount; i++)
+			ADD_COMMAND(afg->widgetsStart + i, VERB_GET_PARAMETER, PARAM_AUDIO_WIDGET_CAP);
+		break;
+	case ENUM_PIN_CAPS:
+		for (int i = 0; i < afg->widgetsCount; i++, widget++)
+		{
+			if (widget->type == WIDGET_TYPE_PIN_COMPLEX)
+				ADD_COMMAND(widget->nodeID, VERB_GET_PARAMETER, PARAM_PIN_CAP);
+			if (widget->caps & WIDGET_CAP_CONN_LIST)
+				ADD_COMMAND(widget->nodeID, VERB_GET_PARAMETER, PARAM_CONN_LIST_LENGTH);
+		}
+		break;
+	case ENUM_CONN_LISTS:
+		for (int i = 0; i < afg->widgetsCount; i++, widget++)
+		{
+			// For some reason, EAPD needs to be enabled if the widget
+			// supports it, or else we just get silence
+			if (afg->widgetCaches[i].pinCaps & PINCAP_EAPD)
+				ADD_COMMAND(widget->nodeID, VERB_SET_EAPD_ENABLE, (1 << 1));
+			int perCommand = conn_list_entries_per_command(codec, widget);
+			for (int index = 0; index < widget->connectionsCount; index += perCommand)
+				ADD_COMMAND(widget->nodeID, VERB_GET_CONNECTION_LIST_ENTRY, index);
+		}
+		break;
+	}
+#undef ADD_COMMAND
+	return count;
+}
+
+// Handles the responses to the current step and moves on to the next one.
+// Only the first count commands were answered; if that isn't all of them,
+// whatever they didn't cover is left out.
+static void codec_enum_responses(struct CodecEnum *e, unsigned int count)
+{
+	struct HDACodec *codec = e->codec;
+	struct HDAAudioFuncGroup *afg = &codec->afg;
+	struct HDAWidget *widget = afg->widgets;
+	uint32_t *responses = e->responses;
+	unsigned int r = 0;  // next response
+
+	switch (e->state)
+	{
+	case ENUM_ROOT:
+		if (count < 2)
+			break;
+		codec->childStart = GET_BITS(responses[1], 16, 8);
+		codec->childCount = GET_BITS(responses[1], 0, 8);
+		dprintf("Codec %i, vendor/device=0x%08X, childStart=%i, childCount=%i\n",
+			codec->addr, responses[0], codec->childStart, codec->childCount);
+		break;
+	case ENUM_FUNC_GROUPS:
+		for (nodeid_t nodeID = codec->childStart; r + 2 <= count; nodeID++, r += 2)
+		{
+			if (GET_BITS(responses[r], 0, 8) != FUNC_GRP_AUDIO)
+				continue;
+			afg->nodeID = nodeID;
+			afg->widgetsStart = GET_BITS(responses[r + 1], 16, 8);
+			afg->widgetsCount = GET_BITS(responses[r + 1], 0, 8);
+			dprintf(" Audio Function Group #%i, %i widgets, start %i\n", afg->nodeID, afg->widgetsCount, afg->widgetsStart);
+			if (!alloc_widgets(afg))
+			{
+				dprintf("memory allocation failed\n");
+				afg->widgetsCount = 0;
+			}
+			break;
+		}
+		break;
+	case ENUM_WIDGET_CAPS:
+		// Keep the widgets that were completely probed
+		if (count < afg->widgetsCount)
+			afg->widgetsCount = count;
+		for (int i = 0; i < afg->widgetsCount; i++, widget++)
+		{
+			widget->caps = responses[i];
+			widget->nodeID = afg->widgetsStart + i;
+			widget->type = GET_BITS(widget->caps, 20, 4);
+			dprintf("  Widget #%i, type = %i\n", widget->nodeID, widget->type);
+		}
+		break;
+	case ENUM_PIN_CAPS:
+		for (int i = 0; i < afg->widgetsCount && r < count; i++, widget++)
+		{
+			if (widget->type == WIDGET_TYPE_PIN_COMPLEX)
+				afg->widgetCaches[i].pinCaps = responses[r++];
+			if ((widget->caps & WIDGET_CAP_CONN_LIST) && r < count)
+			{
+				widget->connectionsStart = afg->connectionsCount;
+				widget->connectionsCount = CONN_LIST_LENGTH(responses[r++]);
+				afg->connectionsCount += widget->connectionsCount;
+			}
+		}
+		// Now that the lengths are known, make room for all of the lists
+		if (afg->connectionsCount > 0)
+			afg->connections = memory_alloc(afg->connectionsCount * sizeof(*afg->connections));
+		if (afg->connections == NULL)
+		{
+			widget = afg->widgets;
+			for (int i = 0; i < afg->widgetsCount; i++, widget++)
+				widget->connectionsCount = 0;
+			afg->connectionsCount = 0;
+		}
+		break;
+	case ENUM_CONN_LISTS:
+		for (int i = 0; i < afg->widgetsCount; i++, widget++)
+		{
+			nodeid_t *connections = get_widget_connections(codec, widget);
+			if ((afg->widgetCaches[i].pinCaps & PINCAP_EAPD) && r < count)
+				r++;
+			int perCommand = conn_list_entries_per_command(codec, widget);
+			int bits = (perCommand == 2) ? 16 : 8;
+			int connIndex = 0;
+			while (connIndex < widget->connectionsCount && r < count)
+			{
+				uint32_t entries = responses[r++];
+				for (int index = 0; index < perCommand && connIndex < widget->connectionsCount; index++)
+					connections[connIndex++] = (entries >> (index * bits)) & ((1 << bits) - 1);
+			}
+			widget->connectionsCount = connIndex;
+			if (widget->connectionsCount > 0)
+			{
+				dprintf("   Widget #%i connections (%i):\n    ", widget->nodeID, widget->connectionsCount);
+				for (int j = 0; j < widget->connectionsCount; j++)
+					dprintf("%i ", connections[j]);
+				dprintf("\n");
+			}
+		}
+		break;
+	}
+
+	// Keep the parameters and control values for later. This comes before
+	// moving on, since the next step reads the cached connection list lengths.
+	for (unsigned int i = 0; i < count; i++)
+	{
+		param_cache_store(e->commands[i], responses[i]);
+		shadow_store(e->commands[i], responses[i]);
+		topology_record(e->commands[i]);
+	}
+
+	if (e->state == ENUM_ROOT && codec->childCount == 0)
+		e->state = ENUM_DONE;
+	else if (e->state == ENUM_FUNC_GROUPS && afg->widgetsCount == 0)
+		e->state = ENUM_DONE;
+	else
+		e->state++;
+}
+
+static void codec_enum_batch_done(struct HDACommandBatch *batch)
+{
+	*(volatile BOOL *)batch->context = TRUE;
+}
+
+// Sends the commands for the codec's current step, skipping steps that have
+// nothing to send. Returns FALSE if there are no more steps.
+static BOOL codec_enum_submit(struct CodecEnum *e, int active)
+{
+	unsigned int count;
+
+	while ((count = codec_enum_commands(e, NULL)) == 0)
+	{
+		if (e->state == ENUM_DONE)
+			return FALSE;
+		e->state++;
+	}
+	if (count > e->capacity)
+	{
+		if (e->commands != NULL)
+			memory_free(e->commands);
+		e->commands = memory_alloc(count * 2 * sizeof(uint32_t));
+		if (e->commands == NULL)
+		{
+			dprintf("memory allocation failed\n");
+			e->capacity = 0;
+			e->state = ENUM_DONE;
+			return FALSE;
+		}
+		e->responses = e->commands + count;
+		e->capacity = count;
+	}
+	codec_enum_commands(e, e->commands);
+
+	e->batch.commands = e->commands;
+	e->batch.responses = e->responses;
+	e->batch.count = count;
+	e->batch.received = 0;
+	// With only one codec left, a single command is quicker to send on its own
+	if (active == 1 && count == 1)
+	{
+		e->batch.failed = !hda_run_commands(e->commands, e->responses, 1);
+		e->batch.received = e->batch.failed ? 0 : 1;
+		e->batch.done = TRUE;
+		codec_enum_batch_done(&e->batch);
+	}
+	else if (!hda_submit_commands(&e->batch))
+	{
+		e->batch.failed = TRUE;
+		e->batch.done = TRUE;
+		codec_enum_batch_done(&e->batch);
+	}
+	return TRUE;
+}
+
+// Discovers the widgets of all codecs and sets up their output paths. Codecs
+// with a topology cache are set up from that instead.
+static void hda_codecs_init(void)
+{
+	struct CodecEnum enums[MAX_CODECS];
+	BOOL cached[MAX_CODECS];
+	volatile BOOL progress = FALSE;
+	int active = 0;
+	// However many codecs there are and however they behave, enumeration
+	// ends after this
+	unsigned long long deadline = timer_read() + MICROSECS_TO_TICKS(ENUM_DEADLINE);
+
+	memset(enums, 0, sizeof(enums));
+	for (int i = 0; i < codecsCount; i++)
+	{
+		struct CodecEnum *e = &enums[i];
+		e->codec = &codecs[i];
+		e->state = ENUM_DONE;
+		e->batch.callback = codec_enum_batch_done;
+		e->batch.context = (void *)&progress;
+		cached[i] = topology_load(&codecs[i]);
+		if (!cached[i])
+		{
+			topology_record_start(&codecs[i]);
+			e->state = ENUM_ROOT;
+			active++;
+		}
+	}
+	for (int i = 0; i < codecsCount; i++)
+		if (!cached[i] && !codec_enum_submit(&enums[i], active))
+			active--;
+
+	while (active > 0)
+	{
+		hda_cmd_wait_flag(&progress);
+		progress = FALSE;
+		for (int i = 0; i < codecsCount; i++)
+		{
+			struct CodecEnum *e = &enums[i];
+			if (e->state == ENUM_DONE || !e->batch.done)
+				continue;
+			BOOL late = timer_read() > deadline;
+			if (e->batch.failed && !late && !(cmdDeadCodecs & (1 << e->codec->addr)))
+			{
+				// Try the step again. The command layer gives up on the
+				// codec after a few timeouts in a row.
+				dprintf("codec %i: retrying enumeration step %i\n", e->codec->addr, e->state);
+			}
+			else
+			{
+				codec_enum_responses(e, e->batch.received);
+				if (e->batch.failed)
+				{
+					dprintf("codec %i stopped responding during enumeration\n", e->codec->addr);
+					e->state = ENUM_DONE;
+					e->incomplete = TRUE;
+				}
+				else if (e->state != ENUM_DONE && late)
+				{
+					dprintf("codec %i: out of time for enumeration\n", e->codec->addr);
+					e->state = ENUM_DONE;
+					e->incomplete = TRUE;
 				}
 			}
+			if (!codec_enum_submit(e, active))
+				active--;
 		}
 	}
 
-	return TRUE;
-}
-
-static void hda_codec_init(struct HDACodec *codec)
-{
-	uint32_t commands[2], responses[2];
-	int childStart, childCount;
-
-	commands[0] = MAKE_COMMAND(codec->addr, 0, VERB_GET_PARAMETER, PARAM_VENDOR_ID);
-	commands[1] = MAKE_COMMAND(codec->addr, 0, VERB_GET_PARAMETER, PARAM_SUB_NODE_COUNT);
-	hda_run_commands(commands, responses, 2);
-	childStart = GET_BITS(responses[1], 16, 8);
-	childCount = GET_BITS(responses[1], 0, 8);
-	codec->childStart = childStart;
-	codec->childCount = childCount;
-	dprintf("Codec %i, vendor/device=0x%08X, childStart=%i, childCount=%i\n", codec->addr, responses[0], childStart, childCount);
-
-	BOOL gotAFG = FALSE;
-
-	// Enumerate function groups
-	for (nodeid_t fgID = childStart; fgID < childStart + childCount; fgID++)
-	{
-		commands[0] = MAKE_COMMAND(codec->addr, fgID, VERB_GET_PARAMETER, PARAM_FUNC_GRP_TYPE);
-		commands[1] = MAKE_COMMAND(codec->addr, fgID, VERB_GET_PARAMETER, PARAM_SUB_NODE_COUNT);
-		hda_run_commands(commands, responses, 2);
-		if (GET_BITS(responses[0], 0, 8) == FUNC_GRP_AUDIO)
+	for (int i = 0; i < codecsCount; i++)
+	{
+		if (enums[i].commands != NULL)
+			memory_free(enums[i].commands);
+		if (!cached[i] && codecs[i].afg.widgets != NULL)
 		{
-			codec->afg.nodeID = fgID;
-			codec->afg.widgetsStart = GET_BITS(responses[1], 16, 8);
-			codec->afg.widgetsCount = GET_BITS(responses[1], 0, 8);
-			hda_func_group_init(codec, &codec->afg);
-			gotAFG = TRUE;
-			break;
+			hda_func_group_init(&codecs[i], &codecs[i].afg);
+			// Don't keep what a codec that stopped responding left behind
+			if (!enums[i].incomplete)
+				topology_save(&codecs[i]);
 		}
+		topology_record_stop(&codecs[i]);
+		if (codecs[i].afg.widgets != NULL)
+			hda_jacks_init(&codecs[i]);
+		dprintf("end codec\n");
 	}
-	dprintf("end codec\n");
 }
 
 //------------------------------------------------------------------------------
@@ -683,33 +2411,41 @@ static void hda_stream_reset(struct HDAStream *stream)
 	//hda_debug_dump_regs();
 }
 
-static BOOL hda_output_stream_create(struct HDAStream *stream)
+// Adds a time to one of a stream's histograms
+static void stream_stats_add(uint32_t *hist, uint32_t *max, unsigned long long ticks)
 {
-	memset(stream, 0, sizeof(*stream));
+	uint32_t t = MIN(ticks, 0xFFFFFFFF);
 
-	int numInputStreams = GCAP_ISS(hdaRegs->GCAP);
-	stream->index = numInputStreams;  // Output streams immediately follow input streams
+	hist[stats_bucket(t)]++;
+	if (t > *max)
+		*max = t;
+}
 
-	stream->streamTag = OUTPUT_STREAM_TAG;
+// Clears a stream's playback statistics
+static void stream_stats_reset(struct HDAStream *stream)
+{
+	struct HDAStreamStats *stats = &stream->stats;
+
+	memset(stats, 0, sizeof(*stats));
+	stats->streamIndex = stream->index;
+	stats->timerRate = timerRate;
+	stats->bytesPerSec = stream->bytesPerSec;
+	stats->chunkSize = stream->chunkSize;
+	stats->iocInterval = stream->iocInterval;
+	stats->bufferSize = stream->waveBufSize;
+	stats->minHeadroom = stream->waveBufSize;
+}
 
-	// Create buffer
-	stream->numBDLEntries = 64;
-	stream->waveBufSize = stream->numBDLEntries * STREAM_CHUNK_SIZE;
-	stream->waveBuf = memory_alloc_phys(stream->waveBufSize, &stream->waveBufPhys);
+// Creates the largest buffer and Buffer Descriptor List (BDL) any format
+// needs. How much of them is used is decided when the format is set.
+static BOOL stream_alloc_buffers(struct HDAStream *stream)
+{
+	stream->waveBuf = memory_alloc_phys(STREAM_BUFFER_SIZE, &stream->waveBufPhys);
 	if (stream->waveBuf == NULL)
 		goto alloc_fail;
-	memset(stream->waveBuf, 0, stream->waveBufSize);
-
-	// Create Buffer Descriptor List (BDL)
-	stream->bdl = memory_alloc_phys(stream->numBDLEntries * sizeof(*stream->bdl), &stream->bdlPhys);
+	stream->bdl = memory_alloc_phys(STREAM_MAX_BDL_ENTRIES * sizeof(*stream->bdl), &stream->bdlPhys);
 	if (stream->bdl == NULL)
 		goto alloc_fail;
-	for (int i = 0; i < stream->numBDLEntries; i++)
-	{
-		stream->bdl[i].address = stream->bdlPhys + i * STREAM_CHUNK_SIZE;
-		stream->bdl[i].size = STREAM_CHUNK_SIZE;
-		stream->bdl[i].ioc = 1;
-	}
 
 	dprintf("waveBuf: phys=0x%08X, virt=0x%08X\n"
 	        "BDL:     phys=0x%08X, virt=0x%08X\n",
@@ -721,54 +2457,105 @@ static BOOL hda_output_stream_create(struct HDAStream *stream)
 	ASSERT((stream->bdlPhys & 0x7F) == 0);
 
 	hda_stream_reset(stream);
+	stream_stats_reset(stream);
 	return TRUE;
 
 alloc_fail:
 	dprintf("memory allocation failure\n");
+	if (stream->waveBuf != NULL)
+		memory_free_phys(stream->waveBuf);
+	stream->waveBuf = NULL;
 	return FALSE;
 }
 
-// Converts unsigned 8-bit mono to signed 8-bit stereo
-static void convert_1u8_2s8(void *dest, const void *src, size_t *destSize, size_t *srcSize)
+// Creates a stream for every output stream descriptor. Only the first gets
+// its buffers now; the others get them when they are first opened, since few
+// programs play at the same time.
+static BOOL hda_output_streams_create(void)
 {
-	int nSamples = MIN(*srcSize, *destSize / 2);
-	int8_t        *d = dest;
-	const uint8_t *s = src;
-	for (int i = 0; i < nSamples; i++)
+	unsigned int count = MIN(GCAP_OSS(hdaRegs->GCAP), 15);  // stream tags are 4 bits, and 0 is reserved
+
+	if (count == 0)
+	{
+		dprintf("controller has no output streams\n");
+		return FALSE;
+	}
+	outStreams = memory_alloc(count * sizeof(*outStreams));
+	if (outStreams == NULL)
+		goto alloc_fail;
+	memset(outStreams, 0, count * sizeof(*outStreams));
+	outStreamsCount = count;
+	for (unsigned int i = 0; i < count; i++)
 	{
-		int8_t sample = *s++ - 0x80;
-		*d++ = sample;
-		*d++ = sample;
-		ASSERT((uint8_t *)s - (uint8_t *)src <= *srcSize);
-		ASSERT((uint8_t *)d - (uint8_t *)dest <= *destSize);
+		struct HDAStream *stream = &outStreams[i];
+
+		// Output streams immediately follow input streams
+		stream->index = GCAP_ISS(hdaRegs->GCAP) + i;
+		stream->streamTag = OUTPUT_STREAM_TAG + i;
 	}
-	*srcSize = nSamples;
-	*destSize = nSamples * 2;
+	return stream_alloc_buffers(&outStreams[0]);
+
+alloc_fail:
+	dprintf("memory allocation failure\n");
+	return FALSE;
 }
 
-static void convert_1u8_2s16(void *dest, const void *src, size_t *destSize, size_t *srcSize)
+// Splits as much of the DMA buffer as the target latency calls for into BDL
+// entries. The stream must be stopped and its bytesPerSec known. Returns FALSE
+// if the frames are too big for two entries to fit in the buffer.
+static BOOL stream_set_geometry(struct HDAStream *stream, unsigned int frameSize)
 {
-	int nSamples = MIN(*srcSize, *destSize / 4);
-	int16_t       *d = dest;
-	const uint8_t *s = src;
-	for (int i = 0; i < nSamples; i++)
+	uint32_t align = STREAM_ALIGN;
+	uint32_t bufferSize, chunkSize;
+	unsigned int entries, iocInterval;
+
+	// Every entry holds whole frames, since the converters don't split them
+	while (align % frameSize != 0)
+		align += STREAM_ALIGN;
+	if (align > STREAM_BUFFER_SIZE / 2)
 	{
-		int16_t sample = (*s++ - 0x80) << 8;
-		*d++ = sample;
-		*d++ = sample;
-		ASSERT((uint8_t *)s - (uint8_t *)src <= *srcSize);
-		ASSERT((uint8_t *)d - (uint8_t *)dest <= *destSize);
+		dprintf("frames of %u bytes don't fit the DMA buffer\n", frameSize);
+		return FALSE;
+	}
+	bufferSize = (unsigned long long)stream->bytesPerSec * streamLatency / 1000;
+	chunkSize = MIN(bufferSize / STREAM_MIN_CHUNKS, (unsigned long long)stream->bytesPerSec * STREAM_MAX_CHUNK_TIME / 1000);
+	// At least two entries must fit in the buffer
+	chunkSize = MIN(chunkSize, STREAM_BUFFER_SIZE / 2);
+	chunkSize = MAX(chunkSize - chunkSize % align, align);
+	entries = MIN(bufferSize / chunkSize, STREAM_BUFFER_SIZE / chunkSize);
+	entries = MIN(MAX(entries, 2), STREAM_MAX_BDL_ENTRIES);
+	// A long buffer doesn't need an interrupt for every entry. Each
+	// interrupt still leaves three quarters of the buffer queued.
+	iocInterval = MIN(MAX(entries / STREAM_MIN_CHUNKS, 1), STREAM_MAX_IOC_INTERVAL);
+	entries -= entries % iocInterval;
+
+	stream->chunkSize = chunkSize;
+	stream->iocInterval = iocInterval;
+	stream->numBDLEntries = entries;
+	stream->waveBufSize = entries * chunkSize;
+	ASSERT(stream->waveBufSize <= STREAM_BUFFER_SIZE);
+	for (int i = 0; i < entries; i++)
+	{
+		stream->bdl[i].address = stream->waveBufPhys + i * chunkSize;
+		stream->bdl[i].size = chunkSize;
+		stream->bdl[i].ioc = ((i + 1) % iocInterval == 0);
 	}
-	*srcSize = nSamples;
-	*destSize = nSamples * 4;
+	// Don't play whatever the last stream left in the buffer
+	memset(stream->waveBuf, 0, stream->waveBufSize);
+	dprintf("stream %i: %u BDL entries of %u bytes, interrupt every %u\n", stream->index, entries, chunkSize, iocInterval);
+
+	stream->stats.chunkSize = stream->chunkSize;
+	stream->stats.iocInterval = stream->iocInterval;
+	stream->stats.bufferSize = stream->waveBufSize;
+	stream->stats.minHeadroom = stream->waveBufSize;
+	return TRUE;
 }
 
-// Simply copies stream data
-static void convert_identity(void *dest, const void *src, size_t *destSize, size_t *srcSize)
+// Only 16-bit stereo streams are mixed into, since every format a client may
+// play can be converted to that without losing anything
+static BOOL stream_can_mix(const struct HDAStream *stream)
 {
-	size_t size = MIN(*destSize, *srcSize);
-	*destSize = *srcSize = size;
-	memcpy(dest, src, size);
+	return stream->sampleBits == 16 && stream->chanCount == 2;
 }
 
 static BOOL hda_stream_set_format(struct HDAStream *stream, const PCMWAVEFORMAT *wavFmt)
@@ -827,6 +2614,7 @@ static BOOL hda_stream_set_format(struct HDAStream *stream, const PCMWAVEFORMAT
 		return FALSE;
 	}
 	stream->sampleBits = wavFmt->wBitsPerSample;
+	stream->sampleRate = wavFmt->wf.nSamplesPerSec;
 	//stream->sampleBits = 16;
 
 	int chanCount = wavFmt->wf.nChannels;
@@ -840,6 +2628,15 @@ static BOOL hda_stream_set_format(struct HDAStream *stream, const PCMWAVEFORMAT
 	stream->chanCount = chanCount;
 	fmt |= chanCount - 1;
 
+	// 20, 24 and 32-bit samples are all stored in 32-bit containers
+	int containerSize = (stream->sampleBits + 7) / 8;
+	if (containerSize > 2)
+		containerSize = 4;
+	stream->bytesPerSec = wavFmt->wf.nSamplesPerSec * chanCount * containerSize;
+	stream->stats.bytesPerSec = stream->bytesPerSec;
+	if (!stream_set_geometry(stream, chanCount * containerSize))
+		return FALSE;
+
 	stream->format = fmt;
 
 	/*
@@ -855,16 +2652,152 @@ static BOOL hda_stream_set_format(struct HDAStream *stream, const PCMWAVEFORMAT
 		if (stream->chanCount == 2 && stream->sampleBits == 16
 		 && wavFmt->wf.nChannels == 1 && wavFmt->wBitsPerSample == 8)
 			stream->converter = convert_1u8_2s16;
+		else if (stream->chanCount == 2 && stream->sampleBits == 16
+		 && wavFmt->wf.nChannels == 2 && wavFmt->wBitsPerSample == 8)
+			stream->converter = convert_2u8_2s16;
+		else if (stream->chanCount == 2 && stream->sampleBits == 16
+		 && wavFmt->wf.nChannels == 1 && wavFmt->wBitsPerSample == 16)
+			stream->converter = convert_1s16_2s16;
 		else if (stream->chanCount == 2 && stream->sampleBits == 8
 		 && wavFmt->wf.nChannels == 1 && wavFmt->wBitsPerSample == 8)
 			stream->converter = convert_1u8_2s8;
+		else if (stream_can_mix(stream))
+			stream->converter = NULL;  // the voice goes through the mixer
 		else
-			ASSERT(0);  // TODO
+		{
+			dprintf("no converter for %u channels\n", wavFmt->wf.nChannels);
+			stream->converter = NULL;
+			return FALSE;
+		}
 	}
 
 	return TRUE;
 }
 
+// Returns TRUE if the widget is an output pin with a path to a converter
+static BOOL is_output_pin(struct HDACodec *codec, struct HDAWidget *widget)
+{
+	return widget->type == WIDGET_TYPE_PIN_COMPLEX && widget->outPath != 0
+	    && (get_widget_cache(codec, widget)->pinCaps & PINCAP_OUTPUT);
+}
+
+// Returns the Audio Output at the end of a widget's output path
+static struct HDAWidget *path_converter(struct HDACodec *codec, struct HDAWidget *widget)
+{
+	while (widget->outPath != 0)
+		widget = get_widget_by_id(codec, widget->outPath);
+	return widget;
+}
+
+// Returns TRUE if the converter is at the end of an output pin's path
+static BOOL is_path_converter(struct HDACodec *codec, struct HDAWidget *converter)
+{
+	struct HDAWidget *pin = codec->afg.widgets;
+
+	for (int i = 0; i < codec->afg.widgetsCount; i++, pin++)
+	{
+		if (is_output_pin(codec, pin) && path_converter(codec, pin) == converter)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+// Returns TRUE if an open stream is playing through the converter
+static BOOL converter_busy(struct HDAWidget *converter)
+{
+	unsigned int i = converter->streamTag - OUTPUT_STREAM_TAG;
+
+	return converter->streamTag != 0 && i < outStreamsCount && outStreams[i].open;
+}
+
+// Tags the converters a stream will play through. Those at the end of the
+// output paths go to the first stream opened. A converter can only listen to
+// one stream, so one opened while they are busy needs a spare converter that
+// feeds a mixer on one of the paths, where the codec mixes the streams in
+// hardware. Returns FALSE if the stream would not be heard.
+static BOOL stream_claim_converters(struct HDAStream *stream)
+{
+	struct HDACodec *codec;
+	int claimed = 0;
+
+	codec = codecs;
+	for (int i = 0; i < codecsCount; i++, codec++)
+	{
+		struct HDAWidget *pin = codec->afg.widgets;
+		for (int j = 0; j < codec->afg.widgetsCount; j++, pin++)
+		{
+			if (!is_output_pin(codec, pin))
+				continue;
+			struct HDAWidget *converter = path_converter(codec, pin);
+			if (!converter_busy(converter))
+			{
+				converter->streamTag = stream->streamTag;
+				claimed++;
+			}
+		}
+	}
+	if (claimed > 0)
+		return TRUE;
+
+	codec = codecs;
+	for (int i = 0; i < codecsCount; i++, codec++)
+	{
+		struct HDAWidget *pin = codec->afg.widgets;
+		for (int j = 0; j < codec->afg.widgetsCount; j++, pin++)
+		{
+			if (!is_output_pin(codec, pin))
+				continue;
+			for (struct HDAWidget *w = pin; w->outPath != 0; w = get_widget_by_id(codec, w->outPath))
+			{
+				if (w->type != WIDGET_TYPE_AUDIO_MIXER)
+					continue;
+				nodeid_t *connections = get_widget_connections(codec, w);
+				// Inputs past what VERB_SET_AMP_GAIN_MUTE can address can't be unmuted
+				int inputsCount = MIN(w->connectionsCount, SET_AMP_GAIN_MUTE_MAX_INDEX + 1);
+				for (int k = 0; k < inputsCount; k++)
+				{
+					nodeid_t nodeID = connections[k];
+					if (nodeID < codec->afg.widgetsStart || nodeID >= codec->afg.widgetsStart + codec->afg.widgetsCount)
+						continue;
+					struct HDAWidget *spare = get_widget_by_id(codec, nodeID);
+					if (spare->type != WIDGET_TYPE_AUDIO_OUTPUT || converter_busy(spare) || is_path_converter(codec, spare))
+						continue;
+					dprintf("stream %i: mixing converter %i into widget %i\n", stream->streamTag, spare->nodeID, w->nodeID);
+					spare->streamTag = stream->streamTag;
+					unmute_widget(codec, spare);
+					unmute_mixer_input(codec, w, k);
+					claimed++;
+				}
+			}
+		}
+	}
+	return (claimed > 0);
+}
+
+// Stops the spare converters a stream was mixed in through, so they don't
+// play it again if it is next opened on the path converters. Those stay
+// tagged, since they are silent without a running stream.
+static void stream_release_converters(struct HDAStream *stream)
+{
+	struct HDACodec *codec = codecs;
+
+	for (int i = 0; i < codecsCount; i++, codec++)
+	{
+		struct HDAWidget *widget = codec->afg.widgets;
+		for (int j = 0; j < codec->afg.widgetsCount; j++, widget++)
+		{
+			if (widget->type == WIDGET_TYPE_AUDIO_OUTPUT && widget->streamTag == stream->streamTag
+			 && !is_path_converter(codec, widget))
+			{
+				uint32_t command = MAKE_COMMAND(codec->addr, widget->nodeID, VERB_SET_CONVERTER_STREAM_CHANNEL, 0);
+				uint32_t response;
+				hda_run_commands_cached(&command, &response, 1);
+				widget->streamTag = 0;
+			}
+		}
+	}
+}
+
 // Starts the stream
 static void hda_stream_open(struct HDAStream *stream)
 {
@@ -881,6 +2814,8 @@ static void hda_stream_open(struct HDAStream *stream)
 	sdesc->SDCTLb2 = SDCTLb2_STRM(stream->streamTag);
 	sdesc->SDFMT = stream->format;
 	sdesc->SDCTLb0 |= SDCTLb0_IOCE;  // enable interrupt on completion
+	stream->fifoSize = sdesc->SDFIFOS + 1;  // only valid once SDFMT is set
+	stream->lastIntTime = 0;
 
 	dprintf("hda_stream_start: SDSTS=0x%02X\n", sdesc->SDSTS);
 
@@ -898,12 +2833,12 @@ static void hda_stream_open(struct HDAStream *stream)
 				commands[0] = MAKE_COMMAND(codec->addr, widget->nodeID, VERB_SET_CONVERTER_FORMAT, stream->format);
 				commands[1] = MAKE_COMMAND(codec->addr, widget->nodeID, VERB_SET_CONVERTER_STREAM_CHANNEL, (stream->streamTag << 4) | 0);
 				commands[2] = MAKE_COMMAND(codec->addr, widget->nodeID, VERB_SET_CONV_CHAN_COUNT, stream->chanCount - 1);
-				hda_run_commands(commands, responses, 3);
+				hda_run_commands_cached(commands, responses, 3);
 			}
 		}
 	}
 
-	__asm wbinvd  // flush cache
+	FLUSH_CACHE  // flush cache
 
 	sdesc->SDCTLb0 |= SDCTLb0_RUN;  // start the stream
 
@@ -922,14 +2857,114 @@ static void hda_stream_close(struct HDAStream *stream)
 	dprintf("hda_stream_close\n");
 	hdaRegs->SDESC[stream->index].SDCTLb0 &= ~SDCTLb0_RUN;
 	hda_stream_reset(stream);
+	stream->open = FALSE;
+	stream_release_converters(stream);
+}
+
+// Returns the voice a client refers to by the handle it was given when opening
+// it, or NULL if the handle is invalid
+static struct HDAVoice *voice_by_handle(unsigned int handle)
+{
+	if (handle == 0 || handle > MAX_VOICES || voices[handle - 1].stream == NULL)
+		return NULL;
+	return &voices[handle - 1];
+}
+
+// Returns the converter from a client's format into the mixer's, or NULL if
+// it has none
+static ConverterFunc mix_converter(const PCMWAVEFORMAT *wavFmt)
+{
+	if (wavFmt->wf.wFormatTag != WAVE_FORMAT_PCM)
+		return NULL;
+	if (wavFmt->wBitsPerSample == 8 && wavFmt->wf.nChannels == 1)
+		return convert_1u8_2s16;
+	if (wavFmt->wBitsPerSample == 8 && wavFmt->wf.nChannels == 2)
+		return convert_2u8_2s16;
+	if (wavFmt->wBitsPerSample == 16 && wavFmt->wf.nChannels == 1)
+		return convert_1s16_2s16;
+	if (wavFmt->wBitsPerSample == 16 && wavFmt->wf.nChannels == 2)
+		return convert_identity;
+	return NULL;
+}
+
+// Returns the open stream with the fewest voices that a client with the given
+// format can be mixed into, or NULL if there is none
+static struct HDAStream *stream_find_mixable(const PCMWAVEFORMAT *wavFmt)
+{
+	struct HDAStream *best = NULL;
+
+	if (mix_converter(wavFmt) == NULL)
+		return NULL;
+	for (unsigned int i = 0; i < outStreamsCount; i++)
+	{
+		struct HDAStream *stream = &outStreams[i];
+
+		if (stream->open && stream_can_mix(stream)
+		 && stream->sampleRate == wavFmt->wf.nSamplesPerSec
+		 && stream->voicesCount < STREAM_MAX_VOICES
+		 && (best == NULL || stream->voicesCount < best->voicesCount))
+			best = stream;
+	}
+	return best;
+}
+
+// Takes a free voice and adds it to a stream. Returns NULL if every voice is
+// in use.
+static struct HDAVoice *voice_attach(struct HDAStream *stream, ConverterFunc converter, ConverterFunc mixConverter)
+{
+	struct HDAVoice *voice = NULL;
+
+	for (unsigned int i = 0; i < MAX_VOICES; i++)
+	{
+		if (voices[i].stream == NULL)
+		{
+			voice = &voices[i];
+			break;
+		}
+	}
+	if (voice == NULL)
+		return NULL;
+	voice->blockList = NULL;
+	voice->converter = converter;
+	voice->mixConverter = mixConverter;
+	voice->gain[0] = voice->gain[1] = MIX_GAIN_UNITY;
+	uint16_t iflag = disable_interrupts();  // the interrupt handler walks the list
+	voice->stream = stream;
+	voice->next = stream->voices;
+	stream->voices = voice;
+	stream->voicesCount++;
+	restore_interrupts(iflag);
+	return voice;
+}
+
+// Removes a voice from its stream, dropping any blocks it hasn't played.
+// Returns the number of voices left on the stream.
+static unsigned int voice_detach(struct HDAVoice *voice)
+{
+	struct HDAStream *stream = voice->stream;
+	struct HDAVoice **link = &stream->voices;
+
+	uint16_t iflag = disable_interrupts();
+	while (*link != voice)
+		link = &(*link)->next;
+	*link = voice->next;
+	stream->voicesCount--;
+	voice->stream = NULL;
+	restore_interrupts(iflag);
+	while (voice->blockList != NULL)
+	{
+		struct AudioBlock *next = voice->blockList->next;
+		memory_free(voice->blockList);
+		voice->blockList = next;
+	}
+	return stream->voicesCount;
 }
 
-static void hda_stream_add_block(struct HDAStream *stream, WAVEHDR *wavHdr, DWORD wavHdrSegOff, void *data)
+static void voice_add_block(struct HDAVoice *voice, WAVEHDR *wavHdr, DWORD wavHdrSegOff, void *data)
 {
-	dprintf("hda_stream_add_block(wavHdr=0x%08X, data=0x%08X), size=0x%X\n",
-		wavHdr, data, wavHdr->dwBufferLength);
 	// TODO: This allocated memory is used at interrupt time. Make sure it can't be paged out!
 	struct AudioBlock *block = memory_alloc(sizeof(*block));
+	TRACE(BLOCK_ADD, block, wavHdrSegOff, data, wavHdr->dwBufferLength);
 	block->wavHdr = wavHdr;
 	block->wavHdrSegOff = wavHdrSegOff;
 	block->data = data;
@@ -937,11 +2972,11 @@ static void hda_stream_add_block(struct HDAStream *stream, WAVEHDR *wavHdr, DWOR
 	block->next = NULL;
 	uint16_t iflag = disable_interrupts();  // don't let the interrupt handler mess with us
 	// Append to block list
-	if (stream->blockList == NULL)
-		stream->blockList = block;
+	if (voice->blockList == NULL)
+		voice->blockList = block;
 	else
 	{
-		struct AudioBlock *last = stream->blockList;
+		struct AudioBlock *last = voice->blockList;
 		while (last->next != NULL)
 			last = last->next;
 		last->next = block;
@@ -957,22 +2992,190 @@ static void __cdecl release_audio_block_appy_time(DWORD waveHdrSegOff)
 		dprintf("failed to call ring-3 driver\n");
 		BKPT
 	}
-	else
-		dprintf("dll result: %u\n", result);
+	TRACE(BLOCK_NOTIFY, waveHdrSegOff, result, 0, 0);
 }
 
-static void release_block(struct HDAStream *stream, struct AudioBlock *block)
+static void release_block(struct HDAVoice *voice, struct AudioBlock *block)
 {
-	dprintf("release_block 0x%08X\n", block);
+	TRACE(BLOCK_RELEASE, block, block->wavHdrSegOff, 0, 0);
 	// Ring-3 code can only be called at "appy-time", and certainly not in an
 	// interrupt handler, so we schedule an appy-time event to notify the ring-3
 	// driver that we are finished with the block.
 	_SHELL_CallAtAppyTime(release_audio_block_appy_time, block->wavHdrSegOff, CAAFL_RING0, 0);
-	ASSERT(block == stream->blockList);
-	stream->blockList = block->next;
+	ASSERT(block == voice->blockList);
+	voice->blockList = block->next;
 	memory_free(block);
 }
 
+// Converts as much of a voice's queued wave data as fits into dest, releasing
+// the blocks it finishes. Returns the number of bytes written.
+static size_t voice_fill(struct HDAVoice *voice, ConverterFunc converter, uint8_t *dest, size_t destBytes)
+{
+	struct AudioBlock *block = voice->blockList;
+	size_t written = 0;
+
+	while (block != NULL && written < destBytes)
+	{
+		size_t destSize = destBytes - written;
+		size_t srcSize = block->wavHdr->dwBufferLength - block->bytesWritten;
+		converter(
+			dest + written,  // dest
+			(uint8_t *)block->data + block->bytesWritten,  // src
+			&destSize,  // destSize
+			&srcSize);  // srcSize
+		block->bytesWritten += srcSize;
+		written += destSize;
+		ASSERT(block->bytesWritten <= block->wavHdr->dwBufferLength);
+		// A partial frame at the end of a block can't be converted
+		if (block->bytesWritten == block->wavHdr->dwBufferLength || (srcSize == 0 && destSize == 0 && written < destBytes))
+		{
+			// done with that block, move on to next
+			struct AudioBlock *next = block->next;
+			release_block(voice, block);
+			block = next;
+		}
+	}
+	return written;
+}
+
+// Returns TRUE if the stream plays a single voice that can be converted
+// straight into the DMA buffer
+static BOOL voice_is_direct(struct HDAVoice *voice)
+{
+	return voice->next == NULL && voice->converter != NULL
+	    && voice->gain[0] == MIX_GAIN_UNITY && voice->gain[1] == MIX_GAIN_UNITY;
+}
+
+// Only used by the interrupt handler, which doesn't nest
+static int16_t mixSamples[MIX_FRAMES * 2];
+static int32_t mixAccum[MIX_FRAMES * 2];
+
+// Fills part of the DMA buffer by mixing every voice of the stream, a few
+// frames at a time so that the intermediate buffers stay in the cache.
+// Returns the number of bytes written, which is all of them.
+static size_t stream_mix(struct HDAStream *stream, uint8_t *dest, size_t destBytes)
+{
+	size_t framesLeft = destBytes / 4;
+
+	ASSERT(stream_can_mix(stream));
+	while (framesLeft > 0)
+	{
+		size_t frames = MIN(framesLeft, MIX_FRAMES);
+		size_t mixed = 0;  // samples in mixAccum so far
+
+		for (struct HDAVoice *voice = stream->voices; voice != NULL; voice = voice->next)
+		{
+			size_t samples = voice_fill(voice, voice->mixConverter, (uint8_t *)mixSamples, frames * 4) / 2;
+			size_t common = MIN(samples, mixed);
+
+			mix_add_s16(mixAccum, mixSamples, common, voice->gain[0], voice->gain[1]);
+			if (samples > mixed)
+			{
+				mix_set_s16(mixAccum + mixed, mixSamples + mixed, samples - mixed, voice->gain[0], voice->gain[1]);
+				mixed = samples;
+			}
+		}
+		// Whatever no voice had data for is silent
+		if (mixed < frames * 2)
+			memset(mixAccum + mixed, 0, (frames * 2 - mixed) * sizeof(*mixAccum));
+		mix_output_s16((int16_t *)dest, mixAccum, frames * 2);
+		dest += frames * 4;
+		framesLeft -= frames;
+	}
+	return destBytes / 4 * 4;
+}
+
+// Returns the offset in the DMA buffer the stream's DMA engine has reached.
+// While the DMA position buffer is being validated, each position read from it
+// is compared with SDLPIB, and the first few disagreements switch every stream
+// back to SDLPIB for good.
+static uint32_t hda_stream_get_position(struct HDAStream *stream)
+{
+	struct HDAStreamDesc *sdesc = &hdaRegs->SDESC[stream->index];
+	struct HDAStreamStats *stats = &stream->stats;
+	uint32_t pos, lpib, delta;
+
+	if (positionSource == HDA_POSITION_LPIB)
+		return sdesc->SDLPIB;
+	pos = dmaPositions[stream->index * 2];
+	if (positionSource == HDA_POSITION_BUFFER)
+		return pos;
+
+	lpib = sdesc->SDLPIB;
+	delta = (pos + stream->waveBufSize - lpib) % stream->waveBufSize;
+	delta = MIN(delta, stream->waveBufSize - delta);
+	if (delta > stats->positionMaxDelta)
+		stats->positionMaxDelta = delta;
+	if (pos >= stream->waveBufSize || delta > stream->fifoSize + POSITION_SLACK)
+	{
+		stats->positionMismatches++;
+		if (++positionMismatches >= POSITION_MAX_MISMATCHES)
+		{
+			dprintf("DMA position buffer disagrees with SDLPIB (%u vs %u), using SDLPIB\n", pos, lpib);
+			positionSource = HDA_POSITION_LPIB;
+		}
+		return lpib;
+	}
+	if (++positionMatches >= POSITION_CHECKS)
+	{
+		dprintf("DMA position buffer agrees with SDLPIB, using it\n");
+		positionSource = HDA_POSITION_BUFFER;
+	}
+	return pos;
+}
+
+// Compares the DMA position with the software write position before the
+// entries of an IOC interval are refilled. Returns FALSE if the DMA engine has
+// overtaken the write position.
+static BOOL stream_check_position(struct HDAStream *stream, uint32_t lpib, unsigned long long now)
+{
+	struct HDAStreamStats *stats = &stream->stats;
+	uint32_t lead = (lpib + stream->waveBufSize - stream->currPos) % stream->waveBufSize;
+	uint32_t intervalSize = stream->chunkSize * stream->iocInterval;
+
+	stats->interrupts++;
+	if (stream->lastIntTime != 0)
+		stream_stats_add(stats->intervalHist, &stats->intervalMax, now - stream->lastIntTime);
+	stream->lastIntTime = now;
+
+	// The interval at currPos has just been played, so the DMA engine should
+	// be in the next one, give or take what is still sitting in the FIFO.
+	if (lead + stream->fifoSize < intervalSize)
+	{
+		stats->underruns++;
+		return FALSE;
+	}
+	// Once an interrupt is missed, the DMA engine stays an interval further
+	// ahead for good, so the latency can only be measured while we keep up.
+	if (lead >= 2 * intervalSize)
+	{
+		stats->lateInterrupts++;
+		return TRUE;
+	}
+
+	// Anything the DMA engine played past the end of the interval is how long
+	// it took us to get here
+	uint32_t pastEnd = (lead > intervalSize) ? lead - intervalSize : 0;
+	if (stream->bytesPerSec != 0)
+		stream_stats_add(stats->irqLatencyHist, &stats->irqLatencyMax,
+			(unsigned long long)pastEnd * timerRate / stream->bytesPerSec);
+	return TRUE;
+}
+
+// Returns the open output stream using a stream descriptor, or NULL if there
+// is none
+static struct HDAStream *stream_by_index(int streamIndex)
+{
+	unsigned int i;
+
+	if (outStreamsCount == 0)
+		return NULL;
+	i = streamIndex - outStreams[0].index;
+	if (i >= outStreamsCount || !outStreams[i].open)
+		return NULL;
+	return &outStreams[i];
+}
+
 static void stream_interrupt(int streamIndex)
 {
 	struct HDAStreamDesc *sdesc = &hdaRegs->SDESC[streamIndex];
@@ -992,45 +3195,51 @@ static void stream_interrupt(int streamIndex)
 	}
 	if (sdsts & SDSTS_BCIS)
 	{
-		dprintf("stream %i buffer complete\n", streamIndex);
-		if (streamIndex == outStream.index)
+		struct HDAStream *stream = stream_by_index(streamIndex);
+		if (stream != NULL)
 		{
-			struct HDAStream *stream = &outStream;
-			struct AudioBlock *block = stream->blockList;
-			size_t destBytesLeft = STREAM_CHUNK_SIZE;
-
-			ASSERT(stream->currPos % STREAM_CHUNK_SIZE == 0);
-			// Write a whole chunk's worth of data
-			while (block != NULL && destBytesLeft > 0)
-			{
-				size_t destSize = destBytesLeft;
-				size_t srcSize = block->wavHdr->dwBufferLength - block->bytesWritten;
-				stream->converter(
-					(uint8_t *)stream->waveBuf + stream->currPos,  // dest
-					(uint8_t *)block->data + block->bytesWritten,  // src
-					&destSize,  // destSize
-					&srcSize);  // srcSize
-				//dprintf("wrote %i bytes\n", destSize);
-				block->bytesWritten += srcSize;
-				stream->currPos += destSize;
-				destBytesLeft -= destSize;
-				ASSERT(block->bytesWritten <= block->wavHdr->dwBufferLength);
-				if (block->bytesWritten == block->wavHdr->dwBufferLength)
-				{
-					// done with that block, move on to next
-					struct AudioBlock *next = block->next;
-					release_block(stream, block);
-					block = next;
-				}
-			}
+			size_t destBytesLeft = stream->chunkSize * stream->iocInterval;
+			unsigned long long start = timer_read();
+			uint32_t lpib = hda_stream_get_position(stream);
+			BOOL inTime = stream_check_position(stream, lpib, start);
+			uint8_t *dest = (uint8_t *)stream->waveBuf + stream->currPos;
+			size_t written;
+
+			TRACE(STREAM_INTERRUPT, streamIndex, sdsts, lpib, stream->currPos);
+			if (!inTime)
+				TRACE(STREAM_UNDERRUN, streamIndex, lpib, stream->currPos, 0);
+
+			ASSERT(stream->currPos % (stream->chunkSize * stream->iocInterval) == 0);
+			// Refill every entry of the interval in one pass. They are next to
+			// each other, since the buffer holds a whole number of intervals.
+			if (stream->voices == NULL)
+				written = 0;
+			else if (voice_is_direct(stream->voices))
+				written = voice_fill(stream->voices, stream->voices->converter, dest, destBytesLeft);
+			else
+				written = stream_mix(stream, dest, destBytesLeft);
+			stream->currPos += written;
+			destBytesLeft -= written;
 			if (destBytesLeft > 0)  // pad with zeros
 			{
-				memset((uint8_t *)stream->waveBuf + stream->currPos, 0, destBytesLeft);
+				memset(dest + written, 0, destBytesLeft);
 				stream->currPos += destBytesLeft;
+				stream->stats.silenceBytes += destBytesLeft;
 			}
-			__asm wbinvd  // flush cache
+			FLUSH_CACHE  // flush cache
 			stream->currPos %= stream->waveBufSize;
-			ASSERT(stream->currPos % STREAM_CHUNK_SIZE == 0);
+			ASSERT(stream->currPos % (stream->chunkSize * stream->iocInterval) == 0);
+
+			TRACE(STREAM_REFILL, streamIndex, stream->currPos, destBytesLeft, 0);
+			if (inTime)
+			{
+				// Everything from the DMA position up to the chunk just written
+				uint32_t headroom = stream->waveBufSize - (lpib + stream->waveBufSize - stream->currPos) % stream->waveBufSize;
+				stream->stats.minHeadroom = MIN(stream->stats.minHeadroom, headroom);
+			}
+			unsigned long long refillTime = timer_read() - start;
+			stream_stats_add(stream->stats.refillHist, &stream->stats.refillMax, refillTime);
+			stream->stats.refillTotal += refillTime;
 		}
 	}
 
@@ -1039,32 +3248,45 @@ static void stream_interrupt(int streamIndex)
 
 static void interrupt_handler(HIRQ hIRQ, HVM hVM)
 {
-	//dprintf("interrupt_handler(0x%08X, 0x%08X)\n", hIRQ, hVM);
 	uint32_t intsts = hdaRegs->INTSTS;
-	//dprintf("intsts = 0x%08X\n", intsts);
 	BOOL handled = FALSE;
 
+	traceInInterrupt = TRUE;
 	if (intsts & INTSTS_GIS)  // Is the interrupt for us?
 	{
 		handled = TRUE;
+		TRACE(INTERRUPT, intsts, 0, 0, 0);
 		if (intsts & INTSTS_CIS)  // controller interrupt
 		{
-			dprintf("controller interrupt\n");
-			BKPT
+			uint8_t rirbsts = hdaRegs->RIRBSTS;
+
+			// Acknowledge first, so that responses arriving while we harvest
+			// raise a new interrupt
+			hdaRegs->RIRBSTS = rirbsts;
+			hda_cmd_harvest();
+			if (rirbsts & RIRBSTS_RIRBOIS)
+				dprintf("RIRB overrun\n");
+			if (hdaRegs->CORBSTS & CORBSTS_CMEI)
+			{
+				dprintf("CORB memory error\n");
+				hdaRegs->CORBSTS = CORBSTS_CMEI;
+				BKPT
+			}
 		}
 		if (intsts & INTSTS_SIS_MASK)  // stream interrupt
 			for (int i = 0; i <= 29; i++)
 				if (intsts & (1 << i))
 					stream_interrupt(i);
 	}
+	traceInInterrupt = FALSE;
 	VPICD_Phys_EOI(hIRQ);
 	if (handled)
 	{
-		__asm clc
+		CLEAR_CARRY
 	}
 	else  // probably for some other device sharing the same IRQ
 	{
-		__asm stc
+		SET_CARRY
 	}
 }
 #pragma aux interrupt_handler \
@@ -1088,6 +3310,57 @@ static BOOL install_interrupt_handler(void)
 	return TRUE;
 }
 
+//------------------------------------------------------------------------------
+// Deferred initialization
+//------------------------------------------------------------------------------
+
+// CONFIG_START holds up booting, so it only gets the controller running.
+// Enumerating the codecs and creating the streams is left to a global event,
+// unless a stream is opened before it has run.
+
+static unsigned long long configEnterTime;
+static unsigned long long configStartTime;  // when CONFIG_START returned
+
+// Finishes initialization if that hasn't been done yet. Returns TRUE if the
+// driver is ready to play.
+static BOOL hda_deferred_init(void)
+{
+	unsigned long long start, end;
+	BOOL success;
+
+	if (initTimes.state != HDA_INIT_PENDING)
+		return (initTimes.state == HDA_INIT_DONE);
+	initTimes.state = HDA_INIT_RUNNING;
+	start = timer_read();
+	initTimes.phases[HDA_INIT_PHASE_DEFERRED] = start - configStartTime;
+	cmdTimeout = CMD_PROBE_TIMEOUT;
+	success = hda_controller_enum_codecs();
+	cmdTimeout = CMD_TIMEOUT;
+	if (!success)
+		goto failed;
+	end = timer_read();
+	initTimes.phases[HDA_INIT_PHASE_CODECS] = end - start;
+	start = end;
+	if (!hda_output_streams_create())
+		goto failed;
+	initTimes.phases[HDA_INIT_PHASE_STREAMS] = timer_read() - start;
+	initTimes.state = HDA_INIT_DONE;
+	return TRUE;
+
+failed:
+	dprintf("initialization failed\n");
+	initTimes.state = HDA_INIT_FAILED;
+	BKPT
+	return FALSE;
+}
+
+static void deferred_init_event(HVM hVM, ULONG refData)
+{
+	hda_deferred_init();
+}
+#pragma aux deferred_init_event \
+	__parm [ebx] [edx]
+
 //------------------------------------------------------------------------------
 // VxD procedures
 //------------------------------------------------------------------------------
@@ -1100,12 +3373,14 @@ static CONFIGRET __cdecl driver_config_handler(CONFIGFUNC func, SUBCONFIGFUNC su
 
 	CMCONFIG conf;
 	CONFIGRET result;
+	unsigned long long start, end;
 
 	switch (func)
 	{
 	case CONFIG_FILTER:
 		return CR_SUCCESS;
 	case CONFIG_START:
+		configEnterTime = timer_read();
 		hdaQuirks |= HDA_QUIRK_FORCE_STEREO;
 		// Get the hardware resource configuration from Configuration Manager
 		result = CM_Get_Alloc_Log_Conf(&conf, devnode, CM_GET_ALLOC_LOG_CONF_ALLOC);
@@ -1165,14 +3440,24 @@ static CONFIGRET __cdecl driver_config_handler(CONFIGFUNC func, SUBCONFIGFUNC su
 		// Now, initialize the hardware
 		if (!install_interrupt_handler())
 			return CR_FAILURE;
+		start = timer_read();
 		if (!hda_controller_reset())
 			return CR_FAILURE;
+		end = timer_read();
+		initTimes.phases[HDA_INIT_PHASE_RESET] = end - start;
+		start = end;
 		if (!hda_controller_setup_corb_rirb())
+			dprintf("CORB/RIRB unavailable, using immediate commands only\n");
+		if (!hda_cmd_probe_immediate() && !corbRunning)
 			return CR_FAILURE;
-		if (!hda_controller_enum_codecs())
-			return CR_FAILURE;
-		if (!hda_output_stream_create(&outStream))
-			return CR_FAILURE;
+		hda_controller_setup_position_buffer();
+		end = timer_read();
+		initTimes.phases[HDA_INIT_PHASE_CORB_RIRB] = end - start;
+		// The codecs and streams are left for later
+		initTimes.state = HDA_INIT_PENDING;
+		configStartTime = end;
+		initTimes.configStart = end - configEnterTime;
+		Schedule_Global_Event(deferred_init_event, 0);
 		return CR_SUCCESS;
 	}
 	return CR_DEFAULT;
@@ -1200,7 +3485,7 @@ DWORD handle_win32_io(DIOCPARAMETERS *diocParams)
 		size_t retSize = count * sizeof(uint32_t);
 		if (diocParams->cbOutBuffer < retSize)
 			return ERROR_INSUFFICIENT_BUFFER;
-		if (!hda_run_commands((uint32_t *)diocParams->lpvInBuffer, (uint32_t *)diocParams->lpvOutBuffer, count))
+		if (!hda_run_commands_uncached((uint32_t *)diocParams->lpvInBuffer, (uint32_t *)diocParams->lpvOutBuffer, count))
 			return ERROR_GEN_FAILURE; 
 		if (pBytesReturned != NULL)
 			*pBytesReturned = retSize;
@@ -1223,10 +3508,11 @@ DWORD handle_win32_io(DIOCPARAMETERS *diocParams)
 		return ERROR_SUCCESS;
 	case HDA_VXD_GET_CODECS:
 		dprintf("HDA_VXD_GET_CODECS\n");
+		hda_deferred_init();
 		uint16_t codecBits = 0;
 		if (diocParams->cbOutBuffer < sizeof(codecBits))
 			return ERROR_INSUFFICIENT_BUFFER;
-		for (int i = 0; i < MAX_CODECS; i++)
+		for (int i = 0; i < codecsCount; i++)
 			codecBits |= (1 << codecs[i].addr);
 		*(uint16_t *)diocParams->lpvOutBuffer = codecBits;
 		if (pBytesReturned != NULL)
@@ -1240,6 +3526,91 @@ DWORD handle_win32_io(DIOCPARAMETERS *diocParams)
 		if (pBytesReturned != NULL)
 			*pBytesReturned = sizeof(struct HDARegs);
 		return ERROR_SUCCESS;
+	case HDA_VXD_GET_STATS:
+		dprintf("HDA_VXD_GET_STATS\n");
+		if (diocParams->cbOutBuffer < sizeof(verbStats))
+			return ERROR_INSUFFICIENT_BUFFER;
+		memcpy((void *)diocParams->lpvOutBuffer, &verbStats, sizeof(verbStats));
+		if (pBytesReturned != NULL)
+			*pBytesReturned = sizeof(verbStats);
+		if (diocParams->cbInBuffer >= sizeof(DWORD) && *(DWORD *)diocParams->lpvInBuffer != 0)
+			stats_reset();
+		return ERROR_SUCCESS;
+	case HDA_VXD_GET_STREAM_STATS:
+		dprintf("HDA_VXD_GET_STREAM_STATS\n");
+		{
+			struct HDAStreamStats *out = (struct HDAStreamStats *)diocParams->lpvOutBuffer;
+			unsigned int count = 0;
+			BOOL reset = (diocParams->cbInBuffer >= sizeof(DWORD) && *(DWORD *)diocParams->lpvInBuffer != 0);
+
+			// Streams that were never opened have nothing to report
+			for (unsigned int i = 0; i < outStreamsCount; i++)
+			{
+				if (outStreams[i].waveBuf == NULL)
+					continue;
+				if (diocParams->cbOutBuffer < (count + 1) * sizeof(*out))
+					return ERROR_INSUFFICIENT_BUFFER;
+				// Decided for all streams at once
+				outStreams[i].stats.positionSource = positionSource;
+				memcpy(&out[count++], &outStreams[i].stats, sizeof(*out));
+				if (reset)
+					stream_stats_reset(&outStreams[i]);
+			}
+			if (pBytesReturned != NULL)
+				*pBytesReturned = count * sizeof(*out);
+		}
+		return ERROR_SUCCESS;
+	case HDA_VXD_GET_INIT_TIMES:
+		dprintf("HDA_VXD_GET_INIT_TIMES\n");
+		if (diocParams->cbOutBuffer < sizeof(initTimes))
+			return ERROR_INSUFFICIENT_BUFFER;
+		memcpy((void *)diocParams->lpvOutBuffer, &initTimes, sizeof(initTimes));
+		if (pBytesReturned != NULL)
+			*pBytesReturned = sizeof(initTimes);
+		return ERROR_SUCCESS;
+	case HDA_VXD_SET_LATENCY:
+		dprintf("HDA_VXD_SET_LATENCY\n");
+		if (diocParams->cbInBuffer < sizeof(DWORD))
+			return ERROR_INVALID_PARAMETER;
+		DWORD latency = stream_set_latency(*(DWORD *)diocParams->lpvInBuffer);
+		if (diocParams->cbOutBuffer >= sizeof(DWORD))
+		{
+			*(DWORD *)diocParams->lpvOutBuffer = latency;
+			if (pBytesReturned != NULL)
+				*pBytesReturned = sizeof(DWORD);
+		}
+		return ERROR_SUCCESS;
+	case HDA_VXD_BENCH_COMMANDS:
+		;
+		const DWORD *benchArgs = (DWORD *)diocParams->lpvInBuffer;
+		struct HDACommandBench *bench = (struct HDACommandBench *)diocParams->lpvOutBuffer;
+		unsigned int iterations = 100;
+		uint32_t command;
+		if (diocParams->cbOutBuffer < sizeof(*bench))
+			return ERROR_INSUFFICIENT_BUFFER;
+		if (codecsCount == 0)
+			return ERROR_GEN_FAILURE;
+		command = MAKE_COMMAND(codecs[0].addr, 0, VERB_GET_PARAMETER, PARAM_VENDOR_ID);
+		if (diocParams->cbInBuffer >= sizeof(DWORD) && benchArgs[0] != 0)
+			iterations = MIN(benchArgs[0], 10000);
+		if (diocParams->cbInBuffer >= 2 * sizeof(DWORD))
+			command = benchArgs[1];
+		hda_cmd_benchmark(command, iterations, bench);
+		if (pBytesReturned != NULL)
+			*pBytesReturned = sizeof(*bench);
+		return ERROR_SUCCESS;
+	case HDA_VXD_GET_TRACE:
+		;
+		const struct HDATraceRequest *request = (struct HDATraceRequest *)diocParams->lpvInBuffer;
+		struct HDATraceHeader *header = (struct HDATraceHeader *)diocParams->lpvOutBuffer;
+		if (diocParams->cbInBuffer < sizeof(*request) || request->ring >= HDA_TRACE_RING_COUNT)
+			return ERROR_INVALID_PARAMETER;
+		if (diocParams->cbOutBuffer < sizeof(*header) + HDA_TRACE_RING_SIZE * sizeof(struct HDATraceEvent))
+			return ERROR_INSUFFICIENT_BUFFER;
+		hda_trace_read(request->ring, request->since, header, (struct HDATraceEvent *)(header + 1));
+		if (pBytesReturned != NULL)
+			*pBytesReturned = sizeof(*header) + header->count * sizeof(struct HDATraceEvent);
+		return ERROR_SUCCESS;
 	default:
 		if (diocParams->dwIoControlCode >= HDA_VXD_GET_STREAM_DESC(0)
 		 && diocParams->dwIoControlCode <  HDA_VXD_GET_STREAM_DESC(HDA_MAX_STREAMS))
@@ -1313,6 +3684,18 @@ DWORD hda_vxd_control_proc(DWORD msg, DWORD paramEBX, DWORD paramEDX, DWORD para
 		if (paramEDX == DLVXD_LOAD_DRIVER)
 		{
 			hdaDevNode = paramEBX;
+			// Everything that is timed is timed in the units chosen here
+			timer_init();
+			verbStats.timerRate = timerRate;
+			initTimes.timerRate = timerRate;
+			uint32_t latency;
+			ULONG size = sizeof(latency);
+			if (CM_Read_Registry_Value(hdaDevNode, NULL, "Latency", REG_DWORD, &latency, &size, CM_REGISTRY_SOFTWARE) == CR_SUCCESS
+			 && size == sizeof(latency))
+			{
+				stream_set_latency(latency);
+				dprintf("target latency from the registry: %u ms\n", streamLatency);
+			}
 			// Register ourselves as the driver
 			dprintf("registering driver\n");
 			MMDEVLDR_Register_Device_Driver(
@@ -1326,7 +3709,7 @@ DWORD hda_vxd_control_proc(DWORD msg, DWORD paramEBX, DWORD paramEDX, DWORD para
 		break;
 	}
 
-	__asm clc  // clear carry flag
+	CLEAR_CARRY  // clear carry flag
 	return retVal;
 }
 #pragma aux hda_vxd_control_proc \
@@ -1335,11 +3718,16 @@ DWORD hda_vxd_control_proc(DWORD msg, DWORD paramEBX, DWORD paramEDX, DWORD para
 
 void __cdecl hda_vxd_pm16_api_proc(HVM hVM, CLIENT_STRUCT *clientRegs)
 {
+	struct HDAStream *stream;
+	struct HDAVoice *voice;
+	unsigned int i;
+
+	if (clientRegs->CWRS.Client_AX != HDA_VXD_TRACE)
+		TRACE(PM_API, clientRegs->CWRS.Client_AX, 0, 0, 0);
 	switch (clientRegs->CWRS.Client_AX)
 	{
 	case HDA_VXD_GET_CAPABILITIES:
 		;
-		dprintf("HDA_VXD_GET_CAPABILITIES\n");
 		// WAVEOUTCAPS struct in es:si registers of client
 		WAVEOUTCAPS *wc = Map_Flat(
 			offsetof(struct Client_Reg_Struc, Client_ES),
@@ -1357,21 +3745,89 @@ void __cdecl hda_vxd_pm16_api_proc(HVM hVM, CLIENT_STRUCT *clientRegs)
 		wc->dwSupport = WAVECAPS_LRVOLUME|WAVECAPS_VOLUME/*|WAVECAPS_SAMPLEACCURATE*/;
 		break;
 	case HDA_VXD_OPEN_STREAM:
-		dprintf("HDA_VXD_OPEN_STREAM\n");
 		// PCMWAVEFORMAT struct in es:si registers of client
 		const PCMWAVEFORMAT *wavFmt = Map_Flat(
 			offsetof(struct Client_Reg_Struc, Client_ES),
 			offsetof(struct Client_Word_Reg_Struc, Client_SI));
-		if (!hda_stream_set_format(&outStream, wavFmt))
+		// Only waits if the stream is opened very early in boot
+		if (initTimes.state == HDA_INIT_PENDING)
+		{
+			unsigned long long waitStart = timer_read();
+			hda_deferred_init();
+			initTimes.openWait = timer_read() - waitStart;
+		}
+		if (initTimes.state != HDA_INIT_DONE)
 			goto failure;
-		hda_stream_open(&outStream);
+		stream = NULL;
+		for (i = 0; i < outStreamsCount; i++)
+		{
+			if (!outStreams[i].open)
+			{
+				stream = &outStreams[i];
+				break;
+			}
+		}
+		// Converters are claimed last, so that nothing has to be undone if
+		// the stream can't be set up
+		if (stream != NULL)
+		{
+			if (stream->waveBuf == NULL && !stream_alloc_buffers(stream))
+				goto failure;
+			if (!hda_stream_set_format(stream, wavFmt))
+				goto unavailable;  // a format the hardware can't play
+			if (!stream_claim_converters(stream))
+				stream = NULL;
+		}
+		if (stream != NULL)
+		{
+			voice = voice_attach(stream, stream->converter, stream_can_mix(stream) ? mix_converter(wavFmt) : NULL);
+			if (voice == NULL)
+			{
+				stream_release_converters(stream);
+				goto unavailable;
+			}
+			// Marked open first, so that the interrupt handler refills it
+			stream->open = TRUE;
+			hda_stream_open(stream);
+		}
+		else
+		{
+			// Share a stream that is already playing
+			stream = stream_find_mixable(wavFmt);
+			if (stream == NULL)
+			{
+				dprintf("no output stream left, and none to mix into\n");
+				goto unavailable;
+			}
+			voice = voice_attach(stream, NULL, mix_converter(wavFmt));
+			if (voice == NULL)
+				goto unavailable;
+		}
+		clientRegs->CWRS.Client_BX = voice - voices + 1;
 		break;
 	case HDA_VXD_CLOSE_STREAM:
-		dprintf("HDA_VXD_CLOSE_STREAM\n");
-		hda_stream_close(&outStream);
+		voice = voice_by_handle(clientRegs->CWRS.Client_BX);
+		if (voice == NULL)
+			goto failure;
+		stream = voice->stream;
+		if (voice_detach(voice) == 0)
+			hda_stream_close(stream);
+		break;
+	case HDA_VXD_SET_VOLUME:
+		voice = voice_by_handle(clientRegs->CWRS.Client_BX);
+		if (voice == NULL)
+			goto failure;
+		// Only voices that can go through the mixer can be attenuated
+		if (voice->mixConverter == NULL)
+			goto unavailable;
+		// Map 0xFFFF to unity
+		voice->gain[0] = clientRegs->CWRS.Client_CX + (clientRegs->CWRS.Client_CX >> 15);
+		voice->gain[1] = clientRegs->CWRS.Client_DX + (clientRegs->CWRS.Client_DX >> 15);
 		break;
 	case HDA_VXD_SUBMIT_WAVE_BLOCK:
-		dprintf("HDA_VXD_SUBMIT_WAVE_BLOCK\n");
+		voice = voice_by_handle(clientRegs->CWRS.Client_BX);
+		if (voice == NULL)
+			goto failure;
 		// WAVEHDR struct in es:si registers of client
 		DWORD wavHdrSegOff = (clientRegs->CRS.Client_ES << 16) | clientRegs->CWRS.Client_SI;
 		WAVEHDR *wavHdr = Map_Flat(
@@ -1387,7 +3843,17 @@ void __cdecl hda_vxd_pm16_api_proc(HVM hVM, CLIENT_STRUCT *clientRegs)
 			offsetof(struct Client_Word_Reg_Struc, Client_SI));
 		clientRegs->CRS.Client_ES = prevES;
 		clientRegs->CWRS.Client_SI = prevSI;
-		hda_stream_add_block(&outStream, wavHdr, wavHdrSegOff, lpData);
+		voice_add_block(voice, wavHdr, wavHdrSegOff, lpData);
+		break;
+	case HDA_VXD_TRACE:
+		// HDATraceRecord struct in es:si registers of client
+		;
+		const struct HDATraceRecord *record = Map_Flat(
+			offsetof(struct Client_Reg_Struc, Client_ES),
+			offsetof(struct Client_Word_Reg_Struc, Client_SI));
+		if (record->id >= HDA_TRACE_COUNT)
+			goto failure;
+		hda_trace(record->id, record->args[0], record->args[1], record->args[2], record->args[3]);
 		break;
 	default:
 		dprintf("hda_vxd_pm16_api_proc: bad function code %u\n", clientRegs->CWRS.Client_AX);
@@ -1397,6 +3863,11 @@ void __cdecl hda_vxd_pm16_api_proc(HVM hVM, CLIENT_STRUCT *clientRegs)
 	clientRegs->CBRS.Client_AL = 1;
 	return;
 
+unavailable:
+	// Another client has what is needed; not a bug
+	clientRegs->CBRS.Client_AL = 0;
+	return;
+
 failure:
 	clientRegs->CBRS.Client_AL = 0;
 	BKPT
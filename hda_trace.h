@@ -0,0 +1,89 @@
+#pragma once
+
+#include <stdint.h>
+
+// Binary event trace
+//
+// Hot paths record fixed-size events instead of calling dprintf. An event is
+// an ID, a timestamp and up to four arguments; nothing is formatted until
+// "hdactl -log" reads the events back and decodes them with the format
+// strings below.
+
+// X(name, format) - format is a printf format string for the four arguments
+#define HDA_TRACE_EVENTS \
+	X(INTERRUPT,           "interrupt: INTSTS=%08X") \
+	X(STREAM_INTERRUPT,    "stream %u: SDSTS=%02X SDLPIB=%u currPos=%u") \
+	X(STREAM_REFILL,       "stream %u: filled up to %u, %u bytes of silence") \
+	X(STREAM_UNDERRUN,     "stream %u: DMA engine at %u overtook write position %u") \
+	X(BLOCK_ADD,           "queue block %08X: wavHdr %08X, data %08X, %u bytes") \
+	X(BLOCK_RELEASE,       "release block %08X: wavHdr %08X") \
+	X(BLOCK_NOTIFY,        "wave_block_finished(%08X) returned %u") \
+	X(PM_API,              "16-bit API function %u") \
+	X(WOD_MESSAGE,         "wodMessage(msg %u, user %08X, param1 %08X, param2 %08X)") \
+	X(WAVE_BLOCK_FINISHED, "wave_block_finished: wavHdr %08X") \
+	X(DRIVER_CALLBACK,     "DriverCallback: msg %u, param1 %08X") \
+	X(JACK,                "codec %u node %u: jack presence %u")
+
+enum
+{
+#define X(name, format) HDA_TRACE_##name,
+	HDA_TRACE_EVENTS
+#undef X
+	HDA_TRACE_COUNT
+};
+
+// There is one ring for events recorded by the interrupt handler, and one for
+// everything else. Each ring only ever has one writer, so neither needs a lock.
+enum
+{
+	HDA_TRACE_RING_TASK,
+	HDA_TRACE_RING_ISR,
+	HDA_TRACE_RING_COUNT
+};
+
+#define HDA_TRACE_RING_SIZE 256  // events per ring; must be a power of 2
+
+struct HDATraceEvent
+{
+	uint64_t time;  // timer ticks
+	uint32_t seq;  // position of the event in its ring's history
+	uint32_t id;
+	uint32_t args[4];
+};
+
+// Input of HDA_VXD_GET_TRACE
+struct HDATraceRequest
+{
+	uint32_t ring;
+	uint32_t since;  // sequence number of the first event wanted
+};
+
+// Output of HDA_VXD_GET_TRACE, followed by up to HDA_TRACE_RING_SIZE events
+struct HDATraceHeader
+{
+	uint32_t timerRate;  // timer ticks per second
+	uint32_t count;  // number of events that follow
+	uint32_t next;  // pass as "since" to get only the events after these
+	uint32_t lost;  // events after "since" that were overwritten before being read
+};
+
+// Event recorded through HDA_VXD_TRACE by the ring-3 driver
+struct HDATraceRecord
+{
+	uint32_t id;
+	uint32_t args[4];
+};
+
+//------------------------------------------------------------------------------
+// VxD interface (trace.c)
+//------------------------------------------------------------------------------
+
+#ifdef __386__
+extern BOOL traceInInterrupt;  // set while the interrupt handler runs
+
+void hda_trace(unsigned int id, uint32_t arg0, uint32_t arg1, uint32_t arg2, uint32_t arg3);
+void hda_trace_read(unsigned int ringIndex, uint32_t since, struct HDATraceHeader *header, struct HDATraceEvent *events);
+
+#define TRACE(name, arg0, arg1, arg2, arg3) \
+	hda_trace(HDA_TRACE_##name, (uintptr_t)(arg0), (uintptr_t)(arg1), (uintptr_t)(arg2), (uintptr_t)(arg3))
+#endif
@@ -1,5 +1,9 @@
 #pragma once
 
+#include <stdint.h>
+
+#include "hda_trace.h"
+
 // 16-bit protected mode API
 // All of these function codes are passed in the AX register.
 // On return, the AL register contains 1 if succeeded or 0 on failure.
@@ -10,25 +14,198 @@
 //   ES:SI - pointer to WAVEOUTCAPS structure
 #define HDA_VXD_GET_CAPABILITIES  1
 
-// Opens an output stream
+// Opens an output stream. Each client gets a stream of its own, until every
+// output stream descriptor or codec converter is in use. After that, clients
+// are mixed into a 16-bit stereo stream already playing at the same rate.
 // Parameters:
 //   ES:SI - pointer to PCMWAVEFORMAT structure
+// Returns:
+//   BX - handle of the stream
 #define HDA_VXD_OPEN_STREAM       2
 
 // Closes an output stream
+// Parameters:
+//   BX - stream handle
 #define HDA_VXD_CLOSE_STREAM      3
 
 // Submits a sound block for playback
 // Parameters:
 //   ES:SI - pointer to WAVEHDR
+//   BX    - stream handle
 #define HDA_VXD_SUBMIT_WAVE_BLOCK 4
 
+// Records an event in the trace (see hda_trace.h)
+// Parameters:
+//   ES:SI - pointer to HDATraceRecord structure
+#define HDA_VXD_TRACE             5
+
+// Sets the volume of a stream. Fails if the stream plays in a format the
+// mixer can't handle.
+// Parameters:
+//   BX - stream handle
+//   CX - left volume, from 0 (silent) to 0xFFFF (full)
+//   DX - right volume
+#define HDA_VXD_SET_VOLUME        6
+
 // Win32 API
 #define HDA_VXD_GET_PCI_CONFIG      5
 #define HDA_VXD_EXEC_VERB           6
 #define HDA_VXD_GET_CODECS          7
 #define HDA_VXD_GET_BASE_REGS       8
 #define HDA_VXD_GET_STREAM_DESC(n)  (9 + (n))
+// Codes from here on are above the range used by HDA_VXD_GET_STREAM_DESC
+
+// Copies the codec verb statistics to a struct HDAVerbStats.
+// If the input buffer holds a nonzero DWORD, the statistics are cleared after
+// being copied.
+#define HDA_VXD_GET_STATS           0x100
+
+// Verbs are counted in one of these classes
+enum
+{
+	HDA_VERB_CLASS_GET_PARAMETER,
+	HDA_VERB_CLASS_GET,  // all other verbs that read a value
+	HDA_VERB_CLASS_SET,  // verbs that change codec state
+	HDA_VERB_CLASS_COUNT,
+};
+
+// Timing histograms: bucket 0 counts times of 0 timer ticks, bucket n counts
+// times of 2^(n-1) to 2^n - 1 ticks, and the last bucket counts everything longer.
+#define HDA_STATS_LATENCY_BUCKETS 32  // enough for seconds at a GHz time-stamp counter rate
+
+struct HDAVerbClassStats
+{
+	uint64_t latencyTotal;  // sum of all round trip times, in timer ticks
+	uint32_t count;  // verbs sent
+	uint32_t responses;  // responses received
+	uint32_t timeouts;  // responses that did not arrive in time
+	uint32_t latencyMin;  // time from the CORBWP write until the response was read
+	uint32_t latencyMax;
+	uint32_t latencyHist[HDA_STATS_LATENCY_BUCKETS];
+};
+
+struct HDAVerbStats
+{
+	uint32_t timerRate;  // timer ticks per second
+	uint32_t batches;  // calls to hda_run_commands
+	uint32_t sendTimeouts;  // the controller didn't fetch commands from the CORB in time
+	uint32_t unsolicited;  // unsolicited responses received
+	uint32_t unsolicitedSkipped;  // unsolicited responses dropped: no codec, or its queue was full
+	uint32_t excessSolicited;  // solicited responses that no command was waiting for
+	uint32_t lateResponses;  // responses to commands that had timed out, which were dropped
+	uint32_t immediate;  // commands sent through the Immediate Command interface
+	uint32_t paramCacheHits;  // parameter reads answered without asking the codec
+	uint32_t shadowHits;  // control writes skipped and reads answered from the shadow state
+	uint32_t codecTimeouts[16];  // commands that went unanswered, by codec address
+	struct HDAVerbClassStats classes[HDA_VERB_CLASS_COUNT];
+};
+
+// Copies the playback statistics of each stream opened so far to an array of
+// struct HDAStreamStats. The number of bytes returned tells how many streams
+// there are. A nonzero DWORD in the input buffer clears the statistics.
+#define HDA_VXD_GET_STREAM_STATS    0x101
+
+// Reads events from one of the trace rings. The input is a struct
+// HDATraceRequest, the output a struct HDATraceHeader followed by the events.
+// The output buffer must have room for a whole ring (see hda_trace.h).
+#define HDA_VXD_GET_TRACE           0x102
+
+// Measures the round trip time of a command through the CORB/RIRB and through
+// the Immediate Command interface. The input buffer may hold the number of
+// round trips per path (default 100) and the command to send (default: the
+// vendor ID of the first codec). The output is a struct HDACommandBench.
+#define HDA_VXD_BENCH_COMMANDS      0x104
+
+struct HDACommandPathStats
+{
+	uint64_t timeTotal;  // in timer ticks
+	uint32_t count;  // successful round trips
+	uint32_t failures;
+	uint32_t timeMin;
+	uint32_t timeMax;
+};
+
+struct HDACommandBench
+{
+	uint32_t timerRate;  // timer ticks per second
+	uint32_t command;
+	uint32_t response;  // the last response received
+	uint32_t immediateUsed;  // lone commands normally use the Immediate Command interface
+	struct HDACommandPathStats corb;
+	struct HDACommandPathStats immediate;
+};
+
+// Copies how long each phase of initialization took to a struct HDAInitTimes
+#define HDA_VXD_GET_INIT_TIMES      0x105
+
+// Codecs are enumerated and streams created after CONFIG_START returns
+enum
+{
+	HDA_INIT_PENDING,  // CONFIG_START is done, the rest hasn't started
+	HDA_INIT_RUNNING,
+	HDA_INIT_DONE,
+	HDA_INIT_FAILED,
+};
+
+enum
+{
+	HDA_INIT_PHASE_RESET,  // controller reset, until the first codec reported in
+	HDA_INIT_PHASE_CORB_RIRB,  // CORB/RIRB setup and probing the Immediate Command interface
+	HDA_INIT_PHASE_DEFERRED,  // from the end of CONFIG_START until the rest started
+	HDA_INIT_PHASE_CODECS,  // enumerating codecs and setting up their paths
+	HDA_INIT_PHASE_STREAMS,  // allocating stream buffers
+	HDA_INIT_PHASE_COUNT,
+};
+
+struct HDAInitTimes
+{
+	uint32_t timerRate;  // timer ticks per second
+	uint32_t state;  // HDA_INIT_*
+	uint32_t codecMask;  // STATESTS when the codecs were enumerated
+	uint32_t droppedCodecs;  // codecs that stopped responding during initialization
+	uint32_t configStart;  // time spent in CONFIG_START, in timer ticks
+	uint32_t openWait;  // time a stream opened before initialization finished waited for it
+	uint32_t phases[HDA_INIT_PHASE_COUNT];
+};
+
+// Sets the target latency, in milliseconds, of streams opened from now on to
+// the DWORD in the input buffer. The latency actually used, after it was
+// limited to what the driver supports, is returned in an output DWORD.
+#define HDA_VXD_SET_LATENCY         0x106
+
+// Where the driver reads a stream's DMA position from
+enum
+{
+	HDA_POSITION_VALIDATING,  // the DMA position buffer, checked against SDLPIB
+	HDA_POSITION_BUFFER,  // the DMA position buffer, which agreed with SDLPIB
+	HDA_POSITION_LPIB,  // SDLPIB, because the buffer is unavailable or wrong
+};
+
+// Stream histograms use the same buckets as the verb latency histogram
+struct HDAStreamStats
+{
+	uint64_t refillTotal;  // time spent refilling, in timer ticks
+	uint32_t streamIndex;  // stream descriptor index
+	uint32_t timerRate;  // timer ticks per second
+	uint32_t bytesPerSec;  // data rate of the DMA buffer
+	uint32_t chunkSize;  // size of a BDL entry
+	uint32_t iocInterval;  // BDL entries refilled per interrupt
+	uint32_t bufferSize;  // size of the DMA buffer
+	uint32_t interrupts;  // buffer completion interrupts
+	uint32_t lateInterrupts;  // the DMA engine had finished more than one chunk past the write position
+	uint32_t underruns;  // the DMA engine was inside the chunk about to be refilled
+	uint32_t silenceBytes;  // bytes padded with silence because no wave data was queued
+	uint32_t minHeadroom;  // least data queued ahead of the DMA engine after a refill, in bytes
+	uint32_t irqLatencyMax;  // time from the end of a chunk to the refill, estimated from the DMA position
+	uint32_t intervalMax;  // time between buffer completion interrupts
+	uint32_t refillMax;  // time spent refilling an IOC interval
+	uint32_t positionSource;  // HDA_POSITION_*
+	uint32_t positionMismatches;  // positions the buffer and SDLPIB disagreed on
+	uint32_t positionMaxDelta;  // largest difference seen between them, in bytes
+	uint32_t irqLatencyHist[HDA_STATS_LATENCY_BUCKETS];
+	uint32_t intervalHist[HDA_STATS_LATENCY_BUCKETS];
+	uint32_t refillHist[HDA_STATS_LATENCY_BUCKETS];
+};
 
 #ifndef __386__
 typedef void (FAR *VxDAPIEntry)(void);
@@ -58,29 +235,58 @@ static BYTE hda_vxd_get_capabilities(VxDAPIEntry entry, WAVEOUTCAPS FAR *wc)
 	}
 }
 
-static BYTE hda_vxd_open_stream(VxDAPIEntry entry, const PCMWAVEFORMAT FAR *wavFmt)
+static BYTE hda_vxd_open_stream(VxDAPIEntry entry, const PCMWAVEFORMAT FAR *wavFmt, WORD FAR *handle)
 {
+	BYTE success;
+	WORD h;
+
 	__asm {
 		les si, wavFmt
 		mov ax, HDA_VXD_OPEN_STREAM
 		call DWORD PTR entry
+		mov success, al
+		mov h, bx
 	}
+	*handle = h;
+	return success;
 }
 
-static BYTE hda_vxd_close_stream(VxDAPIEntry entry)
+static BYTE hda_vxd_close_stream(VxDAPIEntry entry, WORD handle)
 {
 	__asm {
+		mov bx, handle
 		mov ax, HDA_VXD_CLOSE_STREAM
 		call DWORD PTR entry
 	}
 }
 
-static BYTE hda_vxd_submit_wave_block(VxDAPIEntry entry, WAVEHDR FAR *wavHdr)
+static BYTE hda_vxd_submit_wave_block(VxDAPIEntry entry, WORD handle, WAVEHDR FAR *wavHdr)
 {
 	__asm {
 		les si, wavHdr
+		mov bx, handle
 		mov ax, HDA_VXD_SUBMIT_WAVE_BLOCK
 		call DWORD PTR entry
 	}
 }
+
+static BYTE hda_vxd_set_volume(VxDAPIEntry entry, WORD handle, WORD left, WORD right)
+{
+	__asm {
+		mov bx, handle
+		mov cx, left
+		mov dx, right
+		mov ax, HDA_VXD_SET_VOLUME
+		call DWORD PTR entry
+	}
+}
+
+static BYTE hda_vxd_trace(VxDAPIEntry entry, const struct HDATraceRecord FAR *record)
+{
+	__asm {
+		les si, record
+		mov ax, HDA_VXD_TRACE
+		call DWORD PTR entry
+	}
+}
 #endif
@@ -55,6 +55,7 @@ static const struct EnumItem verbs[] =
 	X(SET_CONFIG_DEFAULT1),
 	X(SET_CONFIG_DEFAULT2),
 	X(SET_CONFIG_DEFAULT3),
+	X(GET_SUBSYSTEM_ID),
 	X(GET_CONV_CHAN_COUNT),
 	X(SET_CONV_CHAN_COUNT),
 	X(GET_ASP_CHAN_MAP),
@@ -86,6 +87,41 @@ static const struct EnumItem params[] =
 	{ 0 },
 };
 
+// Messages sent to wodMessage, from mmddk.h
+static const struct EnumItem wodMessages[] =
+{
+	{   3, "WODM_GETNUMDEVS" },
+	{   4, "WODM_GETDEVCAPS" },
+	{   5, "WODM_OPEN" },
+	{   6, "WODM_CLOSE" },
+	{   7, "WODM_PREPARE" },
+	{   8, "WODM_UNPREPARE" },
+	{   9, "WODM_WRITE" },
+	{  10, "WODM_PAUSE" },
+	{  11, "WODM_RESTART" },
+	{  12, "WODM_RESET" },
+	{  13, "WODM_GETPOS" },
+	{  14, "WODM_GETPITCH" },
+	{  15, "WODM_SETPITCH" },
+	{  16, "WODM_GETVOLUME" },
+	{  17, "WODM_SETVOLUME" },
+	{  18, "WODM_GETPLAYBACKRATE" },
+	{  19, "WODM_SETPLAYBACKRATE" },
+	{  20, "WODM_BREAKLOOP" },
+	{ 100, "WODM_INIT" },
+	{ 101, "DRVM_EXIT" },
+	{ 102, "DRVM_DISABLE" },
+	{ 103, "DRVM_ENABLE" },
+	{ 0 },
+};
+
+static const char *traceFormats[HDA_TRACE_COUNT] =
+{
+#define X(name, format) format,
+	HDA_TRACE_EVENTS
+#undef X
+};
+
 static void usage(const char *exec)
 {
 	printf("usage: %s [options]\n"
@@ -93,11 +129,26 @@ static void usage(const char *exec)
 	       "options:\n"
 	       "  -c                              List codecs\n"
 	       "  -w                              Dump all widgets\n"
+	       "  -x                              Export codecs in the format of Linux's\n"
+	       "                                  /proc/asound/card*/codec#* files\n"
 	       "  -r                              Dump HDA controller registers\n"
 	       "  -v codec_id node_id verb param  Execute the specified verb\n"
 	       "                                  verb may either be the the name of a verb or\n"
 	       "                                  its value (see the -lv option)\n"
 	       "  -p                              Print the PCI configuration space\n"
+	       "  -s [reset]                      Show codec verb statistics, and clear them\n"
+	       "                                  afterwards if reset is given\n"
+	       "  -st [reset]                     Show output stream timing and underrun\n"
+	       "                                  statistics\n"
+	       "  -log [follow]                   Print the driver's event trace, and keep\n"
+	       "                                  printing new events if follow is given\n"
+	       "  -b [count]                      Compare command round trip times through\n"
+	       "                                  the CORB/RIRB and the Immediate Command\n"
+	       "                                  interface\n"
+	       "  -i                              Show how long each phase of the driver's\n"
+	       "                                  initialization took\n"
+	       "  -L ms                           Set the target latency of streams opened\n"
+	       "                                  from now on\n"
 	       "  -lv                             List available verbs\n"
 	       "  -lp                             List available parameters for the\n"
 	       "                                  GET_PARAMETER verb\n"
@@ -701,6 +752,380 @@ error:
 	return 1;
 }
 
+//------------------------------------------------------------------------------
+// Linux codec dump export
+//------------------------------------------------------------------------------
+
+// Writes codec information in the same format as /proc/asound/card*/codec#*
+// on Linux, so that codecs can be compared with Linux dumps and loaded into
+// the simulator (see sim/hdasim.c).
+
+static BOOL run_verb(HANDLE hDevice, int cAddr, int nodeID, uint32_t verb, uint32_t payload, uint32_t *response)
+{
+	uint32_t command = MAKE_COMMAND(cAddr, nodeID, verb, payload);
+	return run_verbs(hDevice, &command, response, 1);
+}
+
+static const char *alsa_widget_type_name(int n)
+{
+	switch (n)
+	{
+	case WIDGET_TYPE_VOLUME_KNOB:    return "Volume Knob Widget";
+	case WIDGET_TYPE_BEEP_GENERATOR: return "Beep Generator Widget";
+	case WIDGET_TYPE_VENDOR_DEFINED: return "Vendor Defined Widget";
+	default: return widget_type_name(n);
+	}
+}
+
+static void export_pcm_caps(const char *indent, uint32_t pcm, uint32_t formats)
+{
+	static const int rates[] = { 8000, 11025, 16000, 22050, 32000, 44100, 48000, 88200, 96000, 176400, 192000, 384000 };
+	static const int bits[] = { 8, 16, 20, 24, 32 };
+
+	printf("%s  rates [0x%x]:", indent, pcm & 0xFFF);
+	for (int i = 0; i < ARRAY_COUNT(rates); i++)
+		if (pcm & (1 << i))
+			printf(" %i", rates[i]);
+	printf("\n%s  bits [0x%x]:", indent, GET_BITS(pcm, 16, 8));
+	for (int i = 0; i < ARRAY_COUNT(bits); i++)
+		if (pcm & (1 << (16 + i)))
+			printf(" %i", bits[i]);
+	printf("\n%s  formats [0x%x]:%s%s%s\n", indent, formats & 0xF,
+		(formats & 1) ? " PCM" : "",
+		(formats & 2) ? " FLOAT" : "",
+		(formats & 4) ? " AC3" : "");
+}
+
+static void export_amp_caps(uint32_t caps)
+{
+	if (caps == 0)
+		puts("N/A");
+	else
+		printf("ofs=0x%02x, nsteps=0x%02x, stepsize=0x%02x, mute=%x\n",
+			AMP_CAP_OFFSET(caps), AMP_CAP_NUM_STEPS(caps), AMP_CAP_STEP_SIZE(caps), (caps & AMP_CAP_MUTE_CAPABLE) ? 1 : 0);
+}
+
+static void export_power_states(uint32_t states)
+{
+	static const struct Flag powerStateNames[] =
+	{
+		{  0, "D0" },
+		{  1, "D1" },
+		{  2, "D2" },
+		{  3, "D3" },
+		{  4, "D3cold" },
+		{ 29, "S3D3cold" },
+		{ 30, "CLKSTOP" },
+		{ 31, "EPSS" },
+	};
+
+	printf("  Power states: ");
+	for (int i = 0; i < ARRAY_COUNT(powerStateNames); i++)
+		if (states & (1u << powerStateNames[i].bit))
+			printf(" %s", powerStateNames[i].name);
+	printf("\n");
+}
+
+static BOOL export_amp_vals(HANDLE hDevice, int cAddr, int nodeID, BOOL output, BOOL stereo, int count)
+{
+	uint32_t commands[2], responses[2];
+
+	printf(output ? "  Amp-Out vals: " : "  Amp-In vals: ");
+	for (int i = 0; i < count; i++)
+	{
+		uint32_t dir = output ? GET_AMP_GAIN_MUTE_OUTPUT : GET_AMP_GAIN_MUTE_INPUT;
+		commands[0] = MAKE_COMMAND(cAddr, nodeID, VERB_GET_AMP_GAIN_MUTE, dir | GET_AMP_GAIN_MUTE_LEFT | i);
+		commands[1] = MAKE_COMMAND(cAddr, nodeID, VERB_GET_AMP_GAIN_MUTE, dir | GET_AMP_GAIN_MUTE_RIGHT | i);
+		if (!run_verbs(hDevice, commands, responses, stereo ? 2 : 1))
+			return FALSE;
+		if (stereo)
+			printf(" [0x%02x 0x%02x]", responses[0] & 0xFF, responses[1] & 0xFF);
+		else
+			printf(" [0x%02x]", responses[0] & 0xFF);
+	}
+	printf("\n");
+	return TRUE;
+}
+
+static BOOL export_widget(HANDLE hDevice, int cAddr, int nodeID, uint32_t afgInAmpCaps, uint32_t afgOutAmpCaps)
+{
+	uint32_t caps, resp, resp2;
+
+	if (!run_verb(hDevice, cAddr, nodeID, VERB_GET_PARAMETER, PARAM_AUDIO_WIDGET_CAP, &caps))
+		return FALSE;
+	int type = WIDGET_CAP_TYPE(caps);
+	int chans = WIDGET_CAP_CHAN_COUNT(caps);
+	BOOL stereo = (caps & 1) != 0;
+
+	printf("Node 0x%02x [%s] wcaps 0x%x:", nodeID, alsa_widget_type_name(type), caps);
+	if (chans == 1)
+		printf(" Mono");
+	else if (chans == 2)
+		printf(" Stereo");
+	else
+		printf(" %i-Channels", chans);
+	printf("%s%s%s%s\n",
+		(caps & WIDGET_CAP_DIGITAL) ? " Digital" : "",
+		(caps & WIDGET_CAP_INPUT_AMP) ? " Amp-In" : "",
+		(caps & WIDGET_CAP_OUTPUT_AMP) ? " Amp-Out" : "",
+		(caps & WIDGET_CAP_LR_SWAP) ? " R/L" : "");
+
+	int connCount = 0;
+	BOOL longForm = FALSE;
+	if (caps & WIDGET_CAP_CONN_LIST)
+	{
+		if (!run_verb(hDevice, cAddr, nodeID, VERB_GET_PARAMETER, PARAM_CONN_LIST_LENGTH, &resp))
+			return FALSE;
+		connCount = resp & 0x7F;
+		longForm = (resp & (1 << 7)) != 0;
+	}
+
+	if (caps & WIDGET_CAP_INPUT_AMP)
+	{
+		uint32_t ampCaps = afgInAmpCaps;
+		if ((caps & WIDGET_CAP_AMP_PARAM_OVERRIDE)
+		 && !run_verb(hDevice, cAddr, nodeID, VERB_GET_PARAMETER, PARAM_INPUT_AMP_CAP, &ampCaps))
+			return FALSE;
+		printf("  Amp-In caps: ");
+		export_amp_caps(ampCaps);
+		int count = (type == WIDGET_TYPE_PIN_COMPLEX || connCount == 0) ? 1 : MIN(connCount, 16);
+		if (!export_amp_vals(hDevice, cAddr, nodeID, FALSE, stereo, count))
+			return FALSE;
+	}
+	if (caps & WIDGET_CAP_OUTPUT_AMP)
+	{
+		uint32_t ampCaps = afgOutAmpCaps;
+		if ((caps & WIDGET_CAP_AMP_PARAM_OVERRIDE)
+		 && !run_verb(hDevice, cAddr, nodeID, VERB_GET_PARAMETER, PARAM_OUTPUT_AMP_CAP, &ampCaps))
+			return FALSE;
+		printf("  Amp-Out caps: ");
+		export_amp_caps(ampCaps);
+		if (!export_amp_vals(hDevice, cAddr, nodeID, TRUE, stereo, 1))
+			return FALSE;
+	}
+
+	if (type == WIDGET_TYPE_AUDIO_OUTPUT || type == WIDGET_TYPE_AUDIO_INPUT)
+	{
+		if (!run_verb(hDevice, cAddr, nodeID, VERB_GET_CONVERTER_STREAM_CHANNEL, 0, &resp))
+			return FALSE;
+		printf("  Converter: stream=%i, channel=%i\n",
+			CONVERTER_STREAM_CHANNEL_STREAM(resp), CONVERTER_STREAM_CHANNEL_CHANNEL(resp));
+		if (!run_verb(hDevice, cAddr, nodeID, VERB_GET_PARAMETER, PARAM_SUPP_PCM_SIZE_RATE, &resp)
+		 || !run_verb(hDevice, cAddr, nodeID, VERB_GET_PARAMETER, PARAM_SUPP_STREAM_FORMATS, &resp2))
+			return FALSE;
+		puts("  PCM:");
+		export_pcm_caps("  ", resp, resp2);
+	}
+
+	if (caps & WIDGET_CAP_DIGITAL)
+	{
+		if (!run_verb(hDevice, cAddr, nodeID, VERB_GET_DIGICONVERT, 0, &resp))
+			return FALSE;
+		printf("  Digital:%s\n", (resp & 1) ? " Enabled" : "");
+		printf("  Digital category: 0x%x\n", GET_BITS(resp, 8, 7));
+	}
+
+	if (type == WIDGET_TYPE_PIN_COMPLEX)
+	{
+		uint32_t pinCaps, config, pinCtl;
+		if (!run_verb(hDevice, cAddr, nodeID, VERB_GET_PARAMETER, PARAM_PIN_CAP, &pinCaps)
+		 || !run_verb(hDevice, cAddr, nodeID, VERB_GET_CONFIG_DEFAULT, 0, &config)
+		 || !run_verb(hDevice, cAddr, nodeID, VERB_GET_PIN_CONTROL, 0, &pinCtl))
+			return FALSE;
+		printf("  Pincap 0x%08x:%s%s%s%s%s%s%s%s%s\n", pinCaps,
+			(pinCaps & PINCAP_INPUT) ? " IN" : "",
+			(pinCaps & PINCAP_OUTPUT) ? " OUT" : "",
+			(pinCaps & (1 << 3)) ? " HP" : "",
+			(pinCaps & PINCAP_EAPD) ? " EAPD" : "",
+			(pinCaps & PINCAP_PRESENCEDETECT) ? " Detect" : "",
+			(pinCaps & (1 << 6)) ? " Balanced" : "",
+			(pinCaps & PINCAP_HDMI) ? ((pinCaps & (1 << 24)) ? " DP" : " HDMI") : "",
+			(pinCaps & (1 << 1)) ? " Trigger" : "",
+			(pinCaps & (1 << 0)) ? " ImpSense" : "");
+		if (pinCaps & PINCAP_EAPD)
+		{
+			if (!run_verb(hDevice, cAddr, nodeID, VERB_GET_EAPD_ENABLE, 0, &resp))
+				return FALSE;
+			printf("  EAPD 0x%x:%s%s%s\n", resp & 0xFF,
+				(resp & 1) ? " BALANCED" : "",
+				(resp & 2) ? " EAPD" : "",
+				(resp & 4) ? " R/L" : "");
+		}
+		printf("  Pin Default 0x%08x: [%s] %s\n", config,
+			port_connectivity_name(CONFIG_DEFAULT_PORT_CONNECTIVITY(config)),
+			default_device_name(CONFIG_DEFAULT_DEF_DEVICE(config)));
+		printf("    Conn = %s, Color = %s\n",
+			connection_type_name(CONFIG_DEFAULT_CONN_TYPE(config)),
+			color_name(CONFIG_DEFAULT_COLOR(config)));
+		printf("    DefAssociation = 0x%x, Sequence = 0x%x\n",
+			CONFIG_DEFAULT_DEF_ASSOC(config), CONFIG_DEFAULT_SEQUENCE(config));
+		printf("  Pin-ctls: 0x%02x:%s%s%s\n", pinCtl & 0xFF,
+			(pinCtl & PIN_CONTROL_INPUT_ENABLE) ? " IN" : "",
+			(pinCtl & PIN_CONTROL_OUTPUT_ENABLE) ? " OUT" : "",
+			(pinCtl & PIN_CONTROL_HEADPHONE_ENABLE) ? " HP" : "");
+	}
+
+	if (caps & WIDGET_CAP_UNSOLICITED)
+	{
+		if (!run_verb(hDevice, cAddr, nodeID, VERB_GET_UNSOLRESP, 0, &resp))
+			return FALSE;
+		printf("  Unsolicited: tag=%02x, enabled=%i\n", resp & 0x3F, (resp & (1 << 7)) ? 1 : 0);
+	}
+
+	if (caps & WIDGET_CAP_POWER_CNTRL)
+	{
+		if (!run_verb(hDevice, cAddr, nodeID, VERB_GET_PARAMETER, PARAM_SUPP_POWER_STATES, &resp)
+		 || !run_verb(hDevice, cAddr, nodeID, VERB_GET_POWER_STATE, 0, &resp2))
+			return FALSE;
+		export_power_states(resp);
+		printf("  Power: setting=D%i, actual=D%i\n", GET_BITS(resp2, 0, 4), GET_BITS(resp2, 4, 4));
+	}
+
+	if (caps & WIDGET_CAP_PROCESSOR)
+	{
+		if (!run_verb(hDevice, cAddr, nodeID, VERB_GET_PARAMETER, PARAM_PROCESSING_CAP, &resp))
+			return FALSE;
+		printf("  Processing caps: benign=%i, ncoeff=%i\n", resp & 1, GET_BITS(resp, 8, 8));
+	}
+
+	if (type == WIDGET_TYPE_VOLUME_KNOB)
+	{
+		if (!run_verb(hDevice, cAddr, nodeID, VERB_GET_PARAMETER, PARAM_VOLUME_KNOB_CAP, &resp)
+		 || !run_verb(hDevice, cAddr, nodeID, VERB_GET_VOLUME_KNOB, 0, &resp2))
+			return FALSE;
+		printf("  Volume-Knob: delta=%i, steps=%i, direct=%i, val=%i\n",
+			GET_BITS(resp, 7, 1), GET_BITS(resp, 0, 7), GET_BITS(resp2, 7, 1), GET_BITS(resp2, 0, 7));
+	}
+
+	if (connCount > 0)
+	{
+		uint32_t selected = 0;
+		if (type != WIDGET_TYPE_AUDIO_MIXER && connCount > 1
+		 && !run_verb(hDevice, cAddr, nodeID, VERB_GET_CONNECTION_SELECT_CTRL, 0, &selected))
+			return FALSE;
+		int perSet = longForm ? 2 : 4;
+		printf("  Connection: %i\n    ", connCount);
+		for (int i = 0; i < connCount; i++)
+		{
+			int index = i % perSet;
+			if (index == 0 && !run_verb(hDevice, cAddr, nodeID, VERB_GET_CONNECTION_LIST_ENTRY, i, &resp))
+				return FALSE;
+			int connID = longForm ? ((resp >> (index * 16)) & 0xFFFF)
+			                      : ((resp >> (index * 8)) & 0xFF);
+			printf(" 0x%02x%s", connID,
+				(type != WIDGET_TYPE_AUDIO_MIXER && connCount > 1 && i == (int)selected) ? "*" : "");
+		}
+		printf("\n");
+	}
+	return TRUE;
+}
+
+static BOOL export_codec(HANDLE hDevice, int cAddr)
+{
+	uint32_t commands[3], responses[3];
+	uint32_t vendorID, subNodes;
+
+	commands[0] = MAKE_COMMAND(cAddr, 0, VERB_GET_PARAMETER, PARAM_VENDOR_ID);
+	commands[1] = MAKE_COMMAND(cAddr, 0, VERB_GET_PARAMETER, PARAM_REVISION_ID);
+	commands[2] = MAKE_COMMAND(cAddr, 0, VERB_GET_PARAMETER, PARAM_SUB_NODE_COUNT);
+	if (!run_verbs(hDevice, commands, responses, 3))
+		return FALSE;
+	vendorID = responses[0];
+	subNodes = responses[2];
+
+	// Find the audio function group
+	int afgID = -1;
+	uint32_t fgType = 0;
+	for (int nodeID = SUB_NODE_COUNT_START_NODE(subNodes); nodeID < SUB_NODE_COUNT_START_NODE(subNodes) + SUB_NODE_COUNT_NUM_NODES(subNodes); nodeID++)
+	{
+		if (!run_verb(hDevice, cAddr, nodeID, VERB_GET_PARAMETER, PARAM_FUNC_GRP_TYPE, &fgType))
+			return FALSE;
+		if (FUNC_GRP_TYPE_NODE_TYPE(fgType) == FUNC_GRP_AUDIO)
+		{
+			afgID = nodeID;
+			break;
+		}
+	}
+
+	printf("Codec: %s ID %04x\n", vendor_name(VENDOR_ID_VEND_ID(vendorID)), VENDOR_ID_DEV_ID(vendorID));
+	printf("Address: %i\n", cAddr);
+	if (afgID < 0)
+	{
+		printf("Vendor Id: 0x%08x\n", vendorID);
+		printf("Revision Id: 0x%x\n", responses[1]);
+		puts("No Audio Function Group found");
+		return TRUE;
+	}
+	printf("AFG Function Id: 0x%x (unsol %i)\n", FUNC_GRP_TYPE_NODE_TYPE(fgType), (fgType & FUNC_GRP_TYPE_UNSOL_CAPABLE) ? 1 : 0);
+	printf("Vendor Id: 0x%08x\n", vendorID);
+	uint32_t subsystemID;
+	if (!run_verb(hDevice, cAddr, afgID, VERB_GET_SUBSYSTEM_ID, 0, &subsystemID))
+		return FALSE;
+	printf("Subsystem Id: 0x%08x\n", subsystemID);
+	printf("Revision Id: 0x%x\n", responses[1]);
+
+	uint32_t params[7];
+	static const uint8_t afgParams[] =
+	{
+		PARAM_SUPP_PCM_SIZE_RATE, PARAM_SUPP_STREAM_FORMATS, PARAM_INPUT_AMP_CAP, PARAM_OUTPUT_AMP_CAP,
+		PARAM_SUPP_POWER_STATES, PARAM_GPIO_COUNT, PARAM_SUB_NODE_COUNT,
+	};
+	for (int i = 0; i < ARRAY_COUNT(afgParams); i++)
+		if (!run_verb(hDevice, cAddr, afgID, VERB_GET_PARAMETER, afgParams[i], &params[i]))
+			return FALSE;
+	puts("Default PCM:");
+	export_pcm_caps("  ", params[0], params[1]);
+	printf("Default Amp-In caps: ");
+	export_amp_caps(params[2]);
+	printf("Default Amp-Out caps: ");
+	export_amp_caps(params[3]);
+	printf("State of AFG node 0x%02x:\n", afgID);
+	export_power_states(params[4]);
+	uint32_t power;
+	if (!run_verb(hDevice, cAddr, afgID, VERB_GET_POWER_STATE, 0, &power))
+		return FALSE;
+	printf("  Power: setting=D%i, actual=D%i\n", GET_BITS(power, 0, 4), GET_BITS(power, 4, 4));
+	printf("GPIO: io=%i, o=%i, i=%i, unsolicited=%i, wake=%i\n",
+		GET_BITS(params[5], 0, 8), GET_BITS(params[5], 8, 8), GET_BITS(params[5], 16, 8),
+		GET_BITS(params[5], 30, 1), GET_BITS(params[5], 31, 1));
+
+	int widStart = SUB_NODE_COUNT_START_NODE(params[6]);
+	int widCount = SUB_NODE_COUNT_NUM_NODES(params[6]);
+	for (int nodeID = widStart; nodeID < widStart + widCount; nodeID++)
+		if (!export_widget(hDevice, cAddr, nodeID, params[2], params[3]))
+			return FALSE;
+	return TRUE;
+}
+
+static int export_codecs(void)
+{
+	HANDLE hDevice = open_device();
+	if (hDevice == INVALID_HANDLE_VALUE)
+		return 1;
+	uint16_t codecBits;
+	BOOL success = DeviceIoControl(
+		hDevice,
+		HDA_VXD_GET_CODECS,
+		NULL, 0,
+		&codecBits, sizeof(codecBits),
+		NULL,
+		NULL);
+	if (!success)
+		goto error;
+	for (int i = 0; i < 16; i++)
+	{
+		if (codecBits & (1 << i))
+			if (!export_codec(hDevice, i))
+				goto error;
+	}
+	close_device(hDevice);
+	return 0;
+error:
+	printf("Command failed: %s\n", get_errmsg());
+	close_device(hDevice);
+	return 1;
+}
+
 static int exec_verb(unsigned int codec_id, unsigned int node_id, uint32_t verb, uint32_t param)
 {
 	HANDLE hDevice = open_device();
@@ -850,6 +1275,374 @@ static int dump_pci_config(void)
 	return success ? 0 : 1;
 }
 
+static double ticks_to_us(uint32_t timerRate, double ticks)
+{
+	return ticks * 1000000.0 / timerRate;
+}
+
+// Prints the nonzero buckets of a timing histogram
+static void print_histogram(const uint32_t *hist, uint32_t timerRate)
+{
+	for (int b = 0; b < HDA_STATS_LATENCY_BUCKETS; b++)
+	{
+		if (hist[b] == 0)
+			continue;
+		if (b == 0)
+			printf("    %9s   %-9s us: %lu\n", "", "0", (unsigned long)hist[b]);
+		else if (b == HDA_STATS_LATENCY_BUCKETS - 1)
+			printf("    %9.1f - %-9s us: %lu\n", ticks_to_us(timerRate, 1UL << (b - 1)), "", (unsigned long)hist[b]);
+		else
+			printf("    %9.1f - %-9.1f us: %lu\n", ticks_to_us(timerRate, 1UL << (b - 1)),
+			       ticks_to_us(timerRate, (1UL << b) - 1), (unsigned long)hist[b]);
+	}
+}
+
+static int show_stats(BOOL reset)
+{
+	static const char *classNames[HDA_VERB_CLASS_COUNT] =
+	{
+		[HDA_VERB_CLASS_GET_PARAMETER] = "GET_PARAMETER",
+		[HDA_VERB_CLASS_GET]           = "other get",
+		[HDA_VERB_CLASS_SET]           = "set",
+	};
+	HANDLE hDevice = open_device();
+	if (hDevice == INVALID_HANDLE_VALUE)
+		return 1;
+	struct HDAVerbStats stats;
+	DWORD resetFlag = reset;
+	BOOL success = DeviceIoControl(
+		hDevice,
+		HDA_VXD_GET_STATS,
+		&resetFlag, sizeof(resetFlag),
+		&stats, sizeof(stats),
+		NULL,
+		NULL);
+	if (success)
+	{
+		printf("Command batches:         %lu\n"
+		       "Immediate commands:      %lu\n"
+		       "Parameter cache hits:    %lu\n"
+		       "Shadow state hits:       %lu\n"
+		       "CORB send timeouts:      %lu\n"
+		       "Unsolicited responses:   %lu received, %lu dropped\n"
+		       "Excess solicited:        %lu\n"
+		       "Late responses dropped:  %lu\n",
+		       (unsigned long)stats.batches,
+		       (unsigned long)stats.immediate,
+		       (unsigned long)stats.paramCacheHits,
+		       (unsigned long)stats.shadowHits,
+		       (unsigned long)stats.sendTimeouts,
+		       (unsigned long)stats.unsolicited,
+		       (unsigned long)stats.unsolicitedSkipped,
+		       (unsigned long)stats.excessSolicited,
+		       (unsigned long)stats.lateResponses);
+		printf("\n%-14s %8s %8s %10s %10s %10s\n",
+		       "verb class", "sent", "timeouts", "min (us)", "avg (us)", "max (us)");
+		for (int i = 0; i < HDA_VERB_CLASS_COUNT; i++)
+		{
+			const struct HDAVerbClassStats *cls = &stats.classes[i];
+			printf("%-14s %8lu %8lu", classNames[i], (unsigned long)cls->count, (unsigned long)cls->timeouts);
+			if (cls->responses > 0)
+				printf(" %10.1f %10.1f %10.1f\n",
+				       ticks_to_us(stats.timerRate, cls->latencyMin),
+				       ticks_to_us(stats.timerRate, (double)cls->latencyTotal / cls->responses),
+				       ticks_to_us(stats.timerRate, cls->latencyMax));
+			else
+				printf(" %10s %10s %10s\n", "-", "-", "-");
+		}
+		for (int i = 0; i < 16; i++)
+		{
+			if (stats.codecTimeouts[i] > 0)
+				printf("Codec %i timeouts:        %lu\n", i, (unsigned long)stats.codecTimeouts[i]);
+		}
+		printf("\nRound trip histogram:\n");
+		for (int i = 0; i < HDA_VERB_CLASS_COUNT; i++)
+		{
+			const struct HDAVerbClassStats *cls = &stats.classes[i];
+			if (cls->responses == 0)
+				continue;
+			printf("  %s\n", classNames[i]);
+			print_histogram(cls->latencyHist, stats.timerRate);
+		}
+	}
+	else
+		printf("Command failed: %s\n", get_errmsg());
+	close_device(hDevice);
+	return success ? 0 : 1;
+}
+
+static void print_bench_path(const char *name, const struct HDACommandPathStats *path, uint32_t timerRate)
+{
+	printf("%-18s %8lu %8lu", name, (unsigned long)path->count, (unsigned long)path->failures);
+	if (path->count > 0)
+		printf(" %10.1f %10.1f %10.1f\n",
+		       ticks_to_us(timerRate, path->timeMin),
+		       ticks_to_us(timerRate, (double)path->timeTotal / path->count),
+		       ticks_to_us(timerRate, path->timeMax));
+	else
+		printf(" %10s %10s %10s\n", "-", "-", "-");
+}
+
+static int bench_commands(unsigned long count)
+{
+	HANDLE hDevice = open_device();
+	if (hDevice == INVALID_HANDLE_VALUE)
+		return 1;
+	struct HDACommandBench bench;
+	DWORD iterations = count;
+	BOOL success = DeviceIoControl(
+		hDevice,
+		HDA_VXD_BENCH_COMMANDS,
+		&iterations, sizeof(iterations),
+		&bench, sizeof(bench),
+		NULL,
+		NULL);
+	if (success)
+	{
+		printf("Command:  %08lX -> %08lX\n", (unsigned long)bench.command, (unsigned long)bench.response);
+		printf("Lone commands use the %s\n\n",
+		       bench.immediateUsed ? "Immediate Command interface" : "CORB/RIRB");
+		printf("%-18s %8s %8s %10s %10s %10s\n",
+		       "path", "count", "failures", "min (us)", "avg (us)", "max (us)");
+		print_bench_path("CORB/RIRB", &bench.corb, bench.timerRate);
+		print_bench_path("immediate", &bench.immediate, bench.timerRate);
+	}
+	else
+		printf("Command failed: %s\n", get_errmsg());
+	close_device(hDevice);
+	return success ? 0 : 1;
+}
+
+static int show_init_times(void)
+{
+	static const char *const stateNames[] = { "pending", "running", "done", "failed" };
+	static const char *const phaseNames[HDA_INIT_PHASE_COUNT] =
+	{
+		"controller reset",
+		"CORB/RIRB setup",
+		"deferred by",
+		"codecs",
+		"streams",
+	};
+	HANDLE hDevice = open_device();
+	if (hDevice == INVALID_HANDLE_VALUE)
+		return 1;
+	struct HDAInitTimes times;
+	BOOL success = DeviceIoControl(
+		hDevice,
+		HDA_VXD_GET_INIT_TIMES,
+		NULL, 0,
+		&times, sizeof(times),
+		NULL,
+		NULL);
+	if (success)
+	{
+		printf("State:             %s\n", (times.state < 4) ? stateNames[times.state] : "unknown");
+		printf("Codecs found:      0x%04lX\n", (unsigned long)times.codecMask);
+		printf("Codecs dropped:    0x%04lX\n", (unsigned long)times.droppedCodecs);
+		printf("CONFIG_START:      %10.1f us\n", ticks_to_us(times.timerRate, times.configStart));
+		for (int i = 0; i < HDA_INIT_PHASE_COUNT; i++)
+			printf("  %-16s %10.1f us\n", phaseNames[i], ticks_to_us(times.timerRate, times.phases[i]));
+		printf("Stream open waited %10.1f us\n", ticks_to_us(times.timerRate, times.openWait));
+	}
+	else
+		printf("Command failed: %s\n", get_errmsg());
+	close_device(hDevice);
+	return success ? 0 : 1;
+}
+
+static int set_latency(unsigned long ms)
+{
+	HANDLE hDevice = open_device();
+	if (hDevice == INVALID_HANDLE_VALUE)
+		return 1;
+	DWORD latency = ms;
+	DWORD used;
+	BOOL success = DeviceIoControl(
+		hDevice,
+		HDA_VXD_SET_LATENCY,
+		&latency, sizeof(latency),
+		&used, sizeof(used),
+		NULL,
+		NULL);
+	if (success)
+		printf("Target latency: %lu ms\n", (unsigned long)used);
+	else
+		printf("Command failed: %s\n", get_errmsg());
+	close_device(hDevice);
+	return success ? 0 : 1;
+}
+
+static const char *position_source_name(int n)
+{
+	switch (n)
+	{
+	case HDA_POSITION_VALIDATING: return "position buffer (validating)";
+	case HDA_POSITION_BUFFER:     return "position buffer";
+	case HDA_POSITION_LPIB:       return "SDLPIB";
+	default: return "Unknown";
+	}
+}
+
+static int show_stream_stats(BOOL reset)
+{
+	HANDLE hDevice = open_device();
+	if (hDevice == INVALID_HANDLE_VALUE)
+		return 1;
+	struct HDAStreamStats stats[HDA_MAX_STREAMS];
+	DWORD resetFlag = reset;
+	DWORD size = 0;
+	BOOL success = DeviceIoControl(
+		hDevice,
+		HDA_VXD_GET_STREAM_STATS,
+		&resetFlag, sizeof(resetFlag),
+		stats, sizeof(stats),
+		&size,
+		NULL);
+	if (success)
+	{
+		for (int i = 0; i < size / sizeof(stats[0]); i++)
+		{
+			const struct HDAStreamStats *st = &stats[i];
+			double usPerByte = st->bytesPerSec ? 1000000.0 / st->bytesPerSec : 0;
+
+			printf("Stream %lu: %lu byte buffer, %lu byte chunks, %lu bytes/s\n",
+			       (unsigned long)st->streamIndex, (unsigned long)st->bufferSize,
+			       (unsigned long)st->chunkSize, (unsigned long)st->bytesPerSec);
+			printf("  interrupt every:   %lu chunks (%.1f us)\n",
+			       (unsigned long)st->iocInterval, st->chunkSize * st->iocInterval * usPerByte);
+			printf("  position source:   %s, %lu mismatches, max %lu bytes apart\n",
+			       position_source_name(st->positionSource),
+			       (unsigned long)st->positionMismatches, (unsigned long)st->positionMaxDelta);
+			if (st->interrupts > 0)
+				printf("  avg refill time:   %.1f us\n",
+				       ticks_to_us(st->timerRate, (double)st->refillTotal / st->interrupts));
+			printf("  interrupts:        %lu\n"
+			       "  late interrupts:   %lu\n"
+			       "  underruns:         %lu\n"
+			       "  silence padded:    %lu bytes\n"
+			       "  min headroom:      %lu bytes (%.1f us)\n"
+			       "  max irq latency:   %.1f us\n"
+			       "  max irq interval:  %.1f us\n"
+			       "  max refill time:   %.1f us\n",
+			       (unsigned long)st->interrupts,
+			       (unsigned long)st->lateInterrupts,
+			       (unsigned long)st->underruns,
+			       (unsigned long)st->silenceBytes,
+			       (unsigned long)st->minHeadroom, st->minHeadroom * usPerByte,
+			       ticks_to_us(st->timerRate, st->irqLatencyMax),
+			       ticks_to_us(st->timerRate, st->intervalMax),
+			       ticks_to_us(st->timerRate, st->refillMax));
+			printf("  Interrupt latency (end of chunk to refill, from the DMA position):\n");
+			print_histogram(st->irqLatencyHist, st->timerRate);
+			printf("  Interrupt interval:\n");
+			print_histogram(st->intervalHist, st->timerRate);
+			printf("  Refill time:\n");
+			print_histogram(st->refillHist, st->timerRate);
+		}
+	}
+	else
+		printf("Command failed: %s\n", get_errmsg());
+	close_device(hDevice);
+	return success ? 0 : 1;
+}
+
+struct TraceBuffer
+{
+	struct HDATraceHeader header;
+	struct HDATraceEvent events[HDA_TRACE_RING_SIZE];
+};
+
+static const char *enum_name(int value, const struct EnumItem *list)
+{
+	for (; list->name != NULL; list++)
+		if (list->value == value)
+			return list->name;
+	return NULL;
+}
+
+static void print_trace_event(const struct HDATraceEvent *event, int ring, uint32_t timerRate, uint64_t startTime)
+{
+	const uint32_t *args = event->args;
+
+	printf("%12.6f %-4s ", (double)(event->time - startTime) / timerRate, ring == HDA_TRACE_RING_ISR ? "isr" : "");
+	if (event->id >= HDA_TRACE_COUNT)
+	{
+		printf("unknown event %u\n", event->id);
+		return;
+	}
+	printf(traceFormats[event->id], args[0], args[1], args[2], args[3]);
+	if (event->id == HDA_TRACE_WOD_MESSAGE && enum_name(args[0], wodMessages) != NULL)
+		printf(" %s", enum_name(args[0], wodMessages));
+	putchar('\n');
+}
+
+static int show_trace(BOOL follow)
+{
+	static struct TraceBuffer buffers[HDA_TRACE_RING_COUNT];
+	uint32_t since[HDA_TRACE_RING_COUNT] = { 0 };
+	uint64_t startTime = 0;
+	BOOL haveStartTime = FALSE;
+	BOOL success = TRUE;
+
+	HANDLE hDevice = open_device();
+	if (hDevice == INVALID_HANDLE_VALUE)
+		return 1;
+	do
+	{
+		int next[HDA_TRACE_RING_COUNT] = { 0 };
+
+		for (int ring = 0; ring < HDA_TRACE_RING_COUNT; ring++)
+		{
+			struct HDATraceRequest request = { ring, since[ring] };
+			success = DeviceIoControl(
+				hDevice,
+				HDA_VXD_GET_TRACE,
+				&request, sizeof(request),
+				&buffers[ring], sizeof(buffers[ring]),
+				NULL,
+				NULL);
+			if (!success)
+				goto fail;
+			since[ring] = buffers[ring].header.next;
+			if (buffers[ring].header.lost > 0)
+				printf("(%lu events lost from the %s ring)\n", (unsigned long)buffers[ring].header.lost,
+				       ring == HDA_TRACE_RING_ISR ? "interrupt" : "task");
+		}
+
+		// Each ring is in time order, so merge them
+		for (;;)
+		{
+			int best = -1;
+			for (int ring = 0; ring < HDA_TRACE_RING_COUNT; ring++)
+			{
+				if (next[ring] < buffers[ring].header.count
+				 && (best < 0 || buffers[ring].events[next[ring]].time < buffers[best].events[next[best]].time))
+					best = ring;
+			}
+			if (best < 0)
+				break;
+			const struct HDATraceEvent *event = &buffers[best].events[next[best]++];
+			if (!haveStartTime)
+			{
+				startTime = event->time;
+				haveStartTime = TRUE;
+			}
+			print_trace_event(event, best, buffers[best].header.timerRate, startTime);
+		}
+		if (follow)
+			Sleep(100);
+	} while (follow);
+
+	close_device(hDevice);
+	return 0;
+
+fail:
+	printf("Command failed: %s\n", get_errmsg());
+	close_device(hDevice);
+	return 1;
+}
+
 static void list_verbs(void)
 {
 	const struct EnumItem *item;
@@ -919,12 +1712,66 @@ int main(int argc, char **argv)
 			goto bad_args;
 		return dump_widgets();
 	}
+	else if (strcmp("-x", opt) == 0)
+	{
+		if (argc != 2)
+			goto bad_args;
+		return export_codecs();
+	}
 	if (strcmp("-r", opt) == 0)
 	{
 		if (argc != 2)
 			goto bad_args;
 		return dump_regs();
 	}
+	else if (strcmp("-s", opt) == 0)
+	{
+		if (argc == 3 && strcmp("reset", argv[2]) == 0)
+			return show_stats(TRUE);
+		if (argc != 2)
+			goto bad_args;
+		return show_stats(FALSE);
+	}
+	else if (strcmp("-st", opt) == 0)
+	{
+		if (argc == 3 && strcmp("reset", argv[2]) == 0)
+			return show_stream_stats(TRUE);
+		if (argc != 2)
+			goto bad_args;
+		return show_stream_stats(FALSE);
+	}
+	else if (strcmp("-log", opt) == 0)
+	{
+		if (argc == 3 && strcmp("follow", argv[2]) == 0)
+			return show_trace(TRUE);
+		if (argc != 2)
+			goto bad_args;
+		return show_trace(FALSE);
+	}
+	else if (strcmp("-b", opt) == 0)
+	{
+		unsigned long int count = 100;
+
+		if (argc == 3 && !parse_int("count", argv[2], &count))
+			goto bad_args;
+		if (argc > 3)
+			goto bad_args;
+		return bench_commands(count);
+	}
+	else if (strcmp("-i", opt) == 0)
+	{
+		if (argc != 2)
+			goto bad_args;
+		return show_init_times();
+	}
+	else if (strcmp("-L", opt) == 0)
+	{
+		unsigned long int ms;
+
+		if (argc != 3 || !parse_int("ms", argv[2], &ms))
+			goto bad_args;
+		return set_latency(ms);
+	}
 	else if (strcmp("-p", opt) == 0)
 	{
 		if (argc != 2)
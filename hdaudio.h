@@ -14,6 +14,8 @@
 // Extracts numBits bits starting at startBit
 #define GET_BITS(reg, startBit, numBits) (((reg) >> startBit) & ((1 << numBits) - 1))
 
+#define TIMER_CLOCK_RATE 1193182  // Frequency of the Programmable Interrupt Timer
+
 //------------------------------------------------------------------------------
 // HDA Commands
 //------------------------------------------------------------------------------
@@ -32,6 +34,7 @@ enum
 #define GET_AMP_GAIN_MUTE_INPUT  (0 << 15)
 #define GET_AMP_GAIN_MUTE_OUTPUT (1 << 15) 
 	VERB_SET_AMP_GAIN_MUTE   = 0x300,
+#define SET_AMP_GAIN_MUTE_MAX_INDEX 15  // the input amp Index field is 4 bits
 #define AMP_GAIN_MUTE_GAIN(resp) GET_BITS(resp, 0, 7)
 #define AMP_GAIN_MUTE_MUTE       (1 << 7)
 
@@ -74,6 +77,9 @@ enum
 	VERB_SET_DIGICONVERT2  = 0x73E,  // sets bits 16-23
 	VERB_SET_DIGICONVERT3  = 0x73F,  // sets bits 24-31
 
+	VERB_GET_VOLUME_KNOB   = 0xF0F,
+	VERB_SET_VOLUME_KNOB   = 0x70F,
+
 	VERB_GET_GPI_DATA      = 0xF10,
 	VERB_SET_GPI_DATA      = 0x710,
 
@@ -95,11 +101,15 @@ enum
 #define CONFIG_DEFAULT_DEF_LOCATION(resp)      GET_BITS(resp, 24, 6)
 #define CONFIG_DEFAULT_PORT_CONNECTIVITY(resp) GET_BITS(resp, 30, 2)
 
+	VERB_GET_SUBSYSTEM_ID    = 0xF20,  // set one byte at a time with 0x720-0x723
+
 	VERB_GET_CONV_CHAN_COUNT = 0xF2D,
 	VERB_SET_CONV_CHAN_COUNT = 0x72D,
 
 	VERB_GET_ASP_CHAN_MAP    = 0xF34,
 	VERB_SET_ASP_CHAN_MAP    = 0x734,
+
+	VERB_FUNCTION_RESET      = 0x7FF,  // resets a function group and its widgets to their defaults
 };
 
 // Parameters for VERB_GET_PARAMETER
@@ -141,6 +151,7 @@ enum
 #define AMP_CAP_MUTE_CAPABLE    (1 << 31)
 
 	PARAM_CONN_LIST_LENGTH    = 14,
+#define CONN_LIST_LENGTH(resp)  GET_BITS(resp, 0, 7)
 	PARAM_SUPP_POWER_STATES   = 15,
 	PARAM_PROCESSING_CAP      = 16,
 	PARAM_GPIO_COUNT          = 17,
@@ -373,6 +384,8 @@ struct HDARegs
 #define CORBCTL_CMEIE   (1 << 0)  // CORB memory error interrupt enable
 
 	volatile uint8_t  CORBSTS;      // CORB Status
+// CORBSTS fields
+#define CORBSTS_CMEI (1 << 0)  // CORB memory error indication
 
 	volatile uint8_t  CORBSIZE;     // CORB Size
 // CORBSIZE fields
@@ -404,6 +417,9 @@ struct HDARegs
 #define RIRBCTL_RINTCTL   (1 << 0)  // response interrupt control
 
 	volatile uint8_t  RIRBSTS;      // RIRB Status
+// RIRBSTS fields
+#define RIRBSTS_RIRBOIS (1 << 2)  // response overrun interrupt status
+#define RIRBSTS_RINTFL  (1 << 0)  // response interrupt
 
 	volatile uint8_t  RIRBSIZE;     // RIRB Size
 // RIRBSIZE fields
@@ -429,6 +445,8 @@ struct HDARegs
 
 	uint8_t reserved6A[0x6F-0x6A];  // Reserved
 	volatile uint32_t DPLBASE;      // DMA Position Buffer Lower Base
+// DPLBASE fields
+#define DPLBASE_DPBE     (1 << 0)  // DMA position buffer enable; the base must be 128-byte aligned
 	volatile uint32_t DPUBASE;      // DMA Position Buffer Upper Base
 	uint8_t reserved78[0x80-0x78];
 
@@ -480,28 +498,98 @@ extern struct HDARegs *hdaRegs;
 
 typedef uint16_t nodeid_t;
 
-#define MAX_CONNECTIONS 16
+// Longest connection list a widget can have (a 7-bit length)
+#define MAX_CONNECTIONS 127
+
+// Parameters never change, so each node keeps the values already read
+#define HDA_PARAM_CACHE_COUNT (PARAM_VOLUME_KNOB_CAP + 1)
+
+struct HDAParamCache
+{
+	uint32_t valid;  // bit n is set if values[n] holds parameter n
+	uint32_t values[HDA_PARAM_CACHE_COUNT];
+};
+
+// Controls of a widget that are set with a single 8-bit value
+enum
+{
+	SHADOW_CONN_SELECT,
+	SHADOW_POWER_STATE,
+	SHADOW_STREAM_CHANNEL,
+	SHADOW_PIN_CONTROL,
+	SHADOW_EAPD,
+	SHADOW_DIGICONV0,
+	SHADOW_DIGICONV1,
+	SHADOW_CHAN_COUNT,
+	SHADOW_CONTROLS_COUNT,
+};
 
+#define SHADOW_FORMAT_VALID (1 << SHADOW_CONTROLS_COUNT)
+#define SHADOW_INPUT_AMPS   16  // input amps past these aren't shadowed
+
+// The values last written to or read from a widget's controls. Writing the
+// same value again can be skipped, and most reads answered from here.
+struct HDAWidgetShadow
+{
+	uint16_t valid;  // bit n is set if controls[n] is known, SHADOW_FORMAT_VALID if format is
+	uint8_t controls[SHADOW_CONTROLS_COUNT];
+	uint16_t format;
+	uint32_t ampValid[2];  // bit n is set if amp[n][side] is known
+	uint8_t amp[1 + SHADOW_INPUT_AMPS][2];  // gain/mute of the output amp, then each input amp, by [right, left]
+};
+
+// What is needed to find and set up paths. Everything else about a widget is
+// in its struct HDAWidgetCache, and its connection list in the function
+// group's packed list.
 struct HDAWidget
 {
 	nodeid_t nodeID;
 	uint8_t type;
 	uint8_t connectionsCount;
-	nodeid_t connections[MAX_CONNECTIONS];  // list of possible inputs to this widget
+	uint16_t connectionsStart;  // index of the first of its connections in afg->connections
 	nodeid_t outPath;  // next node in path to "Audio Output" widget, or 0 if none
 	uint32_t caps;
-	// specific to Pin Complex
-	uint32_t pinCaps;
 	// specific to Audio Output / Audio Input
 	uint8_t streamTag;
 };
 
+// The rest of a widget, which is only needed when sending commands to it
+struct HDAWidgetCache
+{
+	// specific to Pin Complex
+	uint32_t pinCaps;
+	struct HDAParamCache params;
+	struct HDAWidgetShadow shadow;
+};
+
 struct HDAAudioFuncGroup
 {
 	nodeid_t nodeID;
 	uint8_t widgetsStart;  // starting node ID of child widgets
 	uint8_t widgetsCount;  // number of child widgets
+	// Both indexed by node ID - widgetsStart. They are a single allocation,
+	// freed with widgets.
 	struct HDAWidget *widgets;
+	struct HDAWidgetCache *widgetCaches;
+	nodeid_t *connections;  // the connection lists of all widgets, one after the other
+	unsigned int connectionsCount;
+	struct HDAParamCache params;
+};
+
+struct HDACodec;
+
+// Called at event time with an unsolicited response from a node. The tag is
+// in bits 31:26 of the response, the rest is defined by the node.
+typedef void (*HDAUnsolHandler)(struct HDACodec *codec, nodeid_t nodeID, uint32_t response, void *context);
+
+#define HDA_UNSOL_TAGS       16  // tag 0 is never handed out
+#define HDA_UNSOL_QUEUE_SIZE 16  // must be a power of 2
+
+struct HDAUnsolEntry
+{
+	HDAUnsolHandler handler;  // NULL if the tag is free
+	void *context;
+	nodeid_t nodeID;
 };
 
 struct HDACodec
@@ -509,11 +597,45 @@ struct HDACodec
 	uint8_t addr;
 	uint8_t childStart;
 	uint8_t childCount;
+	struct HDAParamCache params;  // of the root node
 	// We only support a single audio function group. While the standard doesn't
 	// forbid there being multiple, this would be unusual.
 	struct HDAAudioFuncGroup afg;
+	// Unsolicited responses, indexed by tag. The interrupt handler queues
+	// them, and they are dispatched later at event time.
+	struct HDAUnsolEntry unsol[HDA_UNSOL_TAGS];
+	uint32_t unsolQueue[HDA_UNSOL_QUEUE_SIZE];
+	volatile unsigned int unsolHead;  // written by the interrupt handler
+	volatile unsigned int unsolTail;  // written by the event
+	// SET verbs sent while the codec is being set up, to be saved in the
+	// topology cache. NULL when they aren't being recorded.
+	uint32_t *initVerbs;
+	unsigned int initVerbsCount;
+};
+
+BOOL hda_get_parameter(struct HDACodec *codec, nodeid_t nodeID, unsigned int param, uint32_t *value);
+BOOL hda_get_amp_caps(struct HDACodec *codec, struct HDAWidget *widget, BOOL output, uint32_t *caps);
+
+int hda_unsol_register(struct HDACodec *codec, nodeid_t nodeID, HDAUnsolHandler handler, void *context);
+void hda_unsol_unregister(struct HDACodec *codec, int tag);
+
+// A batch of commands sent to the controller with hda_submit_commands
+struct HDACommandBatch
+{
+	const uint32_t *commands;
+	uint32_t *responses;  // receives one response per command
+	unsigned int count;
+	void (*callback)(struct HDACommandBatch *batch);  // called when done, may be NULL
+	void *context;  // for use by the submitter
+	// set by hda_submit_commands
+	unsigned int sent;  // number of commands placed in the CORB so far
+	unsigned int received;  // number of responses so far
+	volatile BOOL done;
+	BOOL failed;  // the controller or codec did not respond in time
+	struct HDACommandBatch *next;
 };
 
+BOOL hda_submit_commands(struct HDACommandBatch *batch);
 BOOL hda_run_commands(const uint32_t *commands, uint32_t *responses, unsigned int count);
 BOOL hda_run_command(uint32_t command, uint32_t *response);
 
@@ -0,0 +1,44 @@
+#include "mix.h"
+
+// gcc only vectorizes loops like these at -O2 with the dynamic cost model
+#ifdef __GNUC__
+#pragma GCC optimize("tree-vectorize", "vect-cost-model=dynamic")
+#endif
+
+// Multiplying by a gain of at most MIX_GAIN_UNITY keeps a 16-bit sample within
+// 32 bits. The right shift of a negative product rounds toward minus infinity
+// on every compiler this is built with.
+#define WEIGHT(sample, gain) (((int32_t)(sample) * (int32_t)(gain)) >> 16)
+
+void mix_set_s16(int32_t *restrict accum, const int16_t *restrict src, size_t samples, uint32_t gainLeft, uint32_t gainRight)
+{
+	size_t frames = samples / 2;
+
+	for (size_t i = 0; i < frames; i++)
+	{
+		accum[2 * i]     = WEIGHT(src[2 * i], gainLeft);
+		accum[2 * i + 1] = WEIGHT(src[2 * i + 1], gainRight);
+	}
+}
+
+void mix_add_s16(int32_t *restrict accum, const int16_t *restrict src, size_t samples, uint32_t gainLeft, uint32_t gainRight)
+{
+	size_t frames = samples / 2;
+
+	for (size_t i = 0; i < frames; i++)
+	{
+		accum[2 * i]     += WEIGHT(src[2 * i], gainLeft);
+		accum[2 * i + 1] += WEIGHT(src[2 * i + 1], gainRight);
+	}
+}
+
+void mix_output_s16(int16_t *restrict dest, const int32_t *restrict accum, size_t samples)
+{
+	for (size_t i = 0; i < samples; i++)
+	{
+		int32_t s = accum[i];
+		s = (s < -0x8000) ? -0x8000 : s;
+		s = (s > 0x7FFF) ? 0x7FFF : s;
+		dest[i] = s;
+	}
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Software mixing, for when more clients play at once than there are output
+// streams. Each client's wave data is first converted to signed 16-bit stereo
+// (see convert.h), then weighted by the client's gain and summed into 32-bit
+// accumulators. The sums are written to the DMA buffer with saturation, so the
+// buffer is written only once however many clients there are.
+//
+// The loops have no branches and their pointers don't alias, so that a
+// vectorizing compiler can turn them into SIMD code. Counts are in samples,
+// and the samples are interleaved left/right.
+
+#define MIX_GAIN_UNITY 0x10000  // gains are unsigned 16.16 fixed point, at most unity
+
+// Stores the weighted samples in accum, replacing what was there
+void mix_set_s16(int32_t *restrict accum, const int16_t *restrict src, size_t samples, uint32_t gainLeft, uint32_t gainRight);
+// Adds the weighted samples to accum
+void mix_add_s16(int32_t *restrict accum, const int16_t *restrict src, size_t samples, uint32_t gainLeft, uint32_t gainRight);
+// Writes the sums to a 16-bit stream, clipping them to its range
+void mix_output_s16(int16_t *restrict dest, const int32_t *restrict accum, size_t samples);
@@ -0,0 +1,531 @@
+// Micro-benchmark and golden-vector check for the sample format converters
+// and the software mixer
+//
+// Runs the converters from convert.c on the host over every source/destination
+// format pair the driver uses, across a range of block sizes and buffer
+// misalignments, and reports the cost per sample. Before timing anything, the
+// output of each converter is checked against stored golden vectors so that an
+// optimized converter that changes the result is caught immediately. The mix
+// kernels from mix.c are checked against a plain reference implementation and
+// timed mixing the most voices a stream takes.
+//
+// Build with "wmake convbench"; it only needs a host C compiler.
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__i386__) || defined(__x86_64__)
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#else
+#define HAVE_TSC 0
+#endif
+
+#include <vmm.h>
+
+#include "hdaudio.h"
+#include "convert.h"
+#include "mix.h"
+
+struct Converter
+{
+	const char *name;
+	ConverterFunc func;
+	unsigned int srcFrameSize;  // bytes per source frame
+	unsigned int destFrameSize;  // bytes per destination frame
+	uint32_t goldenHash;  // FNV-1a hash of the output for GOLDEN_INPUT_SIZE bytes of test_input()
+	const uint8_t *goldenShort;  // expected output for shortInput
+};
+
+//------------------------------------------------------------------------------
+// Golden vectors
+//------------------------------------------------------------------------------
+
+// One of each interesting unsigned 8-bit value: the extremes, zero crossing
+// and the quarter points
+static const uint8_t shortInput[8] = { 0x00, 0x01, 0x40, 0x7F, 0x80, 0x81, 0xC0, 0xFF };
+
+static const uint8_t golden_1u8_2s8[16] =
+{
+	0x80, 0x80, 0x81, 0x81, 0xC0, 0xC0, 0xFF, 0xFF,
+	0x00, 0x00, 0x01, 0x01, 0x40, 0x40, 0x7F, 0x7F,
+};
+
+static const uint8_t golden_1u8_2s16[32] =
+{
+	0x00, 0x80, 0x00, 0x80, 0x00, 0x81, 0x00, 0x81,
+	0x00, 0xC0, 0x00, 0xC0, 0x00, 0xFF, 0x00, 0xFF,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 0x01,
+	0x00, 0x40, 0x00, 0x40, 0x00, 0x7F, 0x00, 0x7F,
+};
+
+static const uint8_t golden_2u8_2s16[16] =
+{
+	0x00, 0x80, 0x00, 0x81, 0x00, 0xC0, 0x00, 0xFF,
+	0x00, 0x00, 0x00, 0x01, 0x00, 0x40, 0x00, 0x7F,
+};
+
+static const uint8_t golden_1s16_2s16[16] =
+{
+	0x00, 0x01, 0x00, 0x01, 0x40, 0x7F, 0x40, 0x7F,
+	0x80, 0x81, 0x80, 0x81, 0xC0, 0xFF, 0xC0, 0xFF,
+};
+
+#define GOLDEN_INPUT_SIZE 65536
+
+static const struct Converter converters[] =
+{
+	{ "u8 mono -> s8 stereo",    convert_1u8_2s8,  1, 2, 0x2A45D819, golden_1u8_2s8 },
+	{ "u8 mono -> s16 stereo",   convert_1u8_2s16, 1, 4, 0xABB74345, golden_1u8_2s16 },
+	{ "u8 stereo -> s16 stereo", convert_2u8_2s16, 2, 4, 0xA9130E3B, golden_2u8_2s16 },
+	{ "s16 mono -> s16 stereo",  convert_1s16_2s16, 2, 4, 0xA9263EC9, golden_1s16_2s16 },
+	{ "8-bit stereo (copy)",     convert_identity, 2, 2, 0x63D814F9, shortInput },
+	{ "16-bit stereo (copy)",    convert_identity, 4, 4, 0x63D814F9, shortInput },
+};
+
+// Deterministic pseudo-random test signal (xorshift32)
+static void test_input(uint8_t *buf, size_t size)
+{
+	uint32_t x = 0x12345678;
+	for (size_t i = 0; i < size; i++)
+	{
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		buf[i] = x >> 24;
+	}
+}
+
+static uint32_t fnv1a(const uint8_t *buf, size_t size)
+{
+	uint32_t hash = 0x811C9DC5;
+	for (size_t i = 0; i < size; i++)
+		hash = (hash ^ buf[i]) * 0x01000193;
+	return hash;
+}
+
+static int check_sizes(const struct Converter *conv, size_t destIn, size_t srcIn, size_t destOut, size_t srcOut)
+{
+	size_t frames = MIN(srcIn / conv->srcFrameSize, destIn / conv->destFrameSize);
+	size_t expSrc = frames * conv->srcFrameSize;
+	size_t expDest = frames * conv->destFrameSize;
+
+	// The identity converter copies bytes, not frames
+	if (conv->func == convert_identity)
+		expSrc = expDest = MIN(srcIn, destIn);
+	if (srcOut == expSrc && destOut == expDest)
+		return 1;
+	printf("  FAIL %s: dest=%zu src=%zu gave dest=%zu src=%zu, expected dest=%zu src=%zu\n",
+		conv->name, destIn, srcIn, destOut, srcOut, expDest, expSrc);
+	return 0;
+}
+
+// Runs the converter over the whole input in pieces of the given sizes, the
+// way the ISR does when a chunk boundary falls in the middle of a wave block
+static void convert_pieces(const struct Converter *conv, uint8_t *dest, const uint8_t *src,
+	size_t size, size_t srcPiece, size_t destPiece)
+{
+	size_t srcPos = 0;
+	size_t destPos = 0;
+
+	while (srcPos < size)
+	{
+		size_t srcSize = MIN(srcPiece, size - srcPos);
+		size_t destSize = destPiece;
+		conv->func(dest + destPos, src + srcPos, &destSize, &srcSize);
+		if (srcSize == 0)
+			break;
+		srcPos += srcSize;
+		destPos += destSize;
+	}
+}
+
+static int check_golden(const struct Converter *conv)
+{
+	int ok = 1;
+	size_t outSize = GOLDEN_INPUT_SIZE / conv->srcFrameSize * conv->destFrameSize;
+	uint8_t *src = malloc(GOLDEN_INPUT_SIZE + 16);
+	uint8_t *dest = malloc(outSize + 16);
+	uint8_t *ref = malloc(outSize);
+	uint8_t shortOut[32];
+	size_t destSize;
+	size_t srcSize;
+
+	// Short vector covering the value range
+	destSize = sizeof(shortOut);
+	srcSize = sizeof(shortInput);
+	conv->func(shortOut, shortInput, &destSize, &srcSize);
+	ok &= check_sizes(conv, sizeof(shortOut), sizeof(shortInput), destSize, srcSize);
+	if (memcmp(shortOut, conv->goldenShort, destSize) != 0)
+	{
+		printf("  FAIL %s: short vector mismatch\n", conv->name);
+		ok = 0;
+	}
+
+	// Buffer size handling: the converter must stop at whichever buffer runs
+	// out first and never write past the destination size it was given
+	static const size_t sizes[][2] =
+	{
+		{ 0, 8 }, { 8, 0 }, { 1, 8 }, { 3, 8 }, { 7, 8 }, { 32, 3 }, { 32, 5 }, { 6, 1 },
+	};
+	for (int i = 0; i < ARRAY_COUNT(sizes); i++)
+	{
+		memset(shortOut, 0xA5, sizeof(shortOut));
+		destSize = sizes[i][0];
+		srcSize = sizes[i][1];
+		conv->func(shortOut, shortInput, &destSize, &srcSize);
+		ok &= check_sizes(conv, sizes[i][0], sizes[i][1], destSize, srcSize);
+		for (size_t j = destSize; j < sizeof(shortOut); j++)
+		{
+			if (shortOut[j] != 0xA5)
+			{
+				printf("  FAIL %s: dest=%zu src=%zu wrote byte %zu\n", conv->name, sizes[i][0], sizes[i][1], j);
+				ok = 0;
+				break;
+			}
+		}
+	}
+
+	// Long pseudo-random vector, converted in one call
+	test_input(src, GOLDEN_INPUT_SIZE);
+	destSize = outSize;
+	srcSize = GOLDEN_INPUT_SIZE;
+	conv->func(ref, src, &destSize, &srcSize);
+	ok &= check_sizes(conv, outSize, GOLDEN_INPUT_SIZE, destSize, srcSize);
+	uint32_t hash = fnv1a(ref, outSize);
+	if (hash != conv->goldenHash)
+	{
+		printf("  FAIL %s: golden hash 0x%08X, expected 0x%08X\n", conv->name, hash, conv->goldenHash);
+		ok = 0;
+	}
+
+	// The same vector converted in pieces and at every misalignment must give
+	// the same result
+	static const size_t pieces[][2] =
+	{
+		{ 1, 4096 }, { 4096, 4 }, { 333, 4096 }, { 4096, 1000 }, { 777, 555 },
+	};
+	for (int align = 0; align < 4; align++)
+	{
+		test_input(src + align, GOLDEN_INPUT_SIZE);
+		for (int i = 0; i < ARRAY_COUNT(pieces); i++)
+		{
+			// Pieces are rounded to whole frames like the driver's buffers are
+			size_t srcPiece = MAX(pieces[i][0] / conv->srcFrameSize, 1) * conv->srcFrameSize;
+			size_t destPiece = MAX(pieces[i][1] / conv->destFrameSize, 1) * conv->destFrameSize;
+			int destAlign = (align * 3) & 3;
+
+			memset(dest, 0, outSize + 16);
+			convert_pieces(conv, dest + destAlign, src + align, GOLDEN_INPUT_SIZE, srcPiece, destPiece);
+			if (memcmp(dest + destAlign, ref, outSize) != 0)
+			{
+				printf("  FAIL %s: src+%i dest+%i in pieces of %zu/%zu differs from one-shot conversion\n",
+					conv->name, align, destAlign, srcPiece, destPiece);
+				ok = 0;
+			}
+		}
+	}
+
+	free(src);
+	free(dest);
+	free(ref);
+	return ok;
+}
+
+//------------------------------------------------------------------------------
+// Mixer
+//------------------------------------------------------------------------------
+
+#define MIX_TEST_FRAMES 256  // same as the driver's MIX_FRAMES
+#define MIX_TEST_VOICES 8  // same as the driver's STREAM_MAX_VOICES
+
+// Mixes the voices the way the driver does, with the kernels from mix.c
+static void mix_voices(int16_t *dest, int32_t *accum, const int16_t *const *src, const uint32_t (*gains)[2],
+	int voices, size_t samples)
+{
+	mix_set_s16(accum, src[0], samples, gains[0][0], gains[0][1]);
+	for (int v = 1; v < voices; v++)
+		mix_add_s16(accum, src[v], samples, gains[v][0], gains[v][1]);
+	mix_output_s16(dest, accum, samples);
+}
+
+// Straightforward version of the same, to check the kernels against
+static void mix_reference(int16_t *dest, const int16_t *const *src, const uint32_t (*gains)[2],
+	int voices, size_t samples)
+{
+	for (size_t i = 0; i < samples; i++)
+	{
+		long long sum = 0;
+		for (int v = 0; v < voices; v++)
+			sum += ((long long)src[v][i] * gains[v][i & 1]) >> 16;
+		if (sum > 32767)
+			sum = 32767;
+		if (sum < -32768)
+			sum = -32768;
+		dest[i] = sum;
+	}
+}
+
+static int check_mixer(void)
+{
+	static int16_t src[MIX_TEST_VOICES][MIX_TEST_FRAMES * 2];
+	static int32_t accum[MIX_TEST_FRAMES * 2];
+	static int16_t out[MIX_TEST_FRAMES * 2];
+	static int16_t ref[MIX_TEST_FRAMES * 2];
+	const int16_t *srcs[MIX_TEST_VOICES];
+	uint32_t gains[MIX_TEST_VOICES][2];
+	int ok = 1;
+
+	for (int v = 0; v < MIX_TEST_VOICES; v++)
+		srcs[v] = src[v];
+
+	// Extremes: full scale voices must saturate instead of wrapping, and
+	// attenuating rounds toward minus infinity
+	static const struct
+	{
+		int16_t a, b;
+		uint32_t gain;
+		int16_t expected;
+	} edges[] =
+	{
+		{ 0x7FFF,  0x7FFF,  MIX_GAIN_UNITY, 0x7FFF },
+		{ -0x8000, -0x8000, MIX_GAIN_UNITY, -0x8000 },
+		{ 0x7FFF,  -0x8000, MIX_GAIN_UNITY, -1 },
+		{ 0x4000,  0x4000,  0x8000,         0x4000 },
+		{ -1,      0,       0x8000,         -1 },
+		{ 0x7FFF,  0x7FFF,  0,              0 },
+	};
+	for (int i = 0; i < ARRAY_COUNT(edges); i++)
+	{
+		for (int j = 0; j < 2; j++)
+		{
+			src[0][j] = edges[i].a;
+			src[1][j] = edges[i].b;
+			gains[0][j] = gains[1][j] = edges[i].gain;
+		}
+		mix_voices(out, accum, srcs, gains, 2, 2);
+		if (out[0] != edges[i].expected || out[1] != edges[i].expected)
+		{
+			printf("  FAIL mixer: %i + %i at gain 0x%X gave %i/%i, expected %i\n",
+				edges[i].a, edges[i].b, edges[i].gain, out[0], out[1], edges[i].expected);
+			ok = 0;
+		}
+	}
+
+	// Pseudo-random signals, at every voice count and a spread of gains
+	for (int v = 0; v < MIX_TEST_VOICES; v++)
+		test_input((uint8_t *)src[v] + v, sizeof(src[v]) - v);
+	for (int voices = 1; voices <= MIX_TEST_VOICES; voices++)
+	{
+		for (int v = 0; v < voices; v++)
+		{
+			gains[v][0] = (v & 1) ? MIX_GAIN_UNITY : 0x2000 * v;
+			gains[v][1] = MIX_GAIN_UNITY - 0x1234 * v;
+		}
+		// Lengths that aren't a multiple of any vector width, which must not
+		// write past the end
+		for (size_t samples = 2; samples <= MIX_TEST_FRAMES * 2; samples += 2 * 37)
+		{
+			memset(out, 0x5A, sizeof(out));
+			mix_voices(out, accum, srcs, gains, voices, samples);
+			mix_reference(ref, srcs, gains, voices, samples);
+			if (memcmp(out, ref, samples * 2) != 0 || out[samples] != 0x5A5A)
+			{
+				printf("  FAIL mixer: %i voices, %zu samples differ from the reference\n", voices, samples);
+				ok = 0;
+			}
+		}
+	}
+	return ok;
+}
+
+//------------------------------------------------------------------------------
+// Timing
+//------------------------------------------------------------------------------
+
+static uint64_t host_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t host_cycles(void)
+{
+#if HAVE_TSC
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+static const size_t blockSizes[] = { 16, 64, 256, 1024, 4096, 16384, 65536 };
+
+// Source/destination byte offsets from a 64-byte boundary
+static const int alignments[][2] = { { 0, 0 }, { 1, 0 }, { 0, 2 }, { 3, 1 } };
+
+static size_t bytesPerRun = 32 << 20;
+
+static void bench_converter(const struct Converter *conv)
+{
+	size_t maxSrc = blockSizes[ARRAY_COUNT(blockSizes) - 1];
+	size_t maxDest = maxSrc / conv->srcFrameSize * conv->destFrameSize;
+	uint8_t *src = aligned_alloc(64, maxSrc + 64);
+	uint8_t *dest = aligned_alloc(64, maxDest + 64);
+
+	test_input(src, maxSrc + 64);
+	printf("%s\n", conv->name);
+	printf("  %8s %9s %10s %10s\n", "block", "src/dest", "ns/sample", "bytes/cyc");
+	for (int i = 0; i < ARRAY_COUNT(blockSizes); i++)
+	{
+		size_t srcBlock = blockSizes[i] / conv->srcFrameSize * conv->srcFrameSize;
+		size_t destBlock = srcBlock / conv->srcFrameSize * conv->destFrameSize;
+		size_t reps = MAX(bytesPerRun / srcBlock, 1);
+
+		for (int a = 0; a < ARRAY_COUNT(alignments); a++)
+		{
+			const uint8_t *s = src + alignments[a][0];
+			uint8_t *d = dest + alignments[a][1];
+
+			// Warm up the caches and branch predictors first
+			for (size_t r = 0; r < MIN(reps, 16); r++)
+			{
+				size_t destSize = destBlock;
+				size_t srcSize = srcBlock;
+				conv->func(d, s, &destSize, &srcSize);
+			}
+
+			uint64_t startNs = host_ns();
+			uint64_t startCycles = host_cycles();
+			for (size_t r = 0; r < reps; r++)
+			{
+				size_t destSize = destBlock;
+				size_t srcSize = srcBlock;
+				conv->func(d, s, &destSize, &srcSize);
+			}
+			uint64_t cycles = host_cycles() - startCycles;
+			uint64_t ns = host_ns() - startNs;
+
+			double samples = (double)reps * (srcBlock / conv->srcFrameSize);
+			printf("  %8zu %4i/%-4i %10.3f", srcBlock, alignments[a][0], alignments[a][1], ns / samples);
+			if (HAVE_TSC && cycles > 0)
+				printf(" %10.3f\n", (double)reps * destBlock / cycles);
+			else
+				printf(" %10s\n", "n/a");
+		}
+	}
+	free(src);
+	free(dest);
+}
+
+// Mixes pieces of MIX_TEST_FRAMES, like the interrupt handler does
+static void bench_mixer(void)
+{
+	static int16_t src[MIX_TEST_VOICES][MIX_TEST_FRAMES * 2];
+	static int32_t accum[MIX_TEST_FRAMES * 2];
+	static int16_t out[MIX_TEST_FRAMES * 2];
+	const int16_t *srcs[MIX_TEST_VOICES];
+	uint32_t gains[MIX_TEST_VOICES][2];
+	size_t reps = MAX(bytesPerRun / sizeof(out), 1);
+
+	for (int v = 0; v < MIX_TEST_VOICES; v++)
+	{
+		test_input((uint8_t *)src[v], sizeof(src[v]));
+		srcs[v] = src[v];
+		gains[v][0] = gains[v][1] = 0xC000;
+	}
+	printf("mixer, %u frames at a time\n", MIX_TEST_FRAMES);
+	printf("  %8s %10s %10s\n", "voices", "ns/frame", "bytes/cyc");
+	for (int voices = 1; voices <= MIX_TEST_VOICES; voices *= 2)
+	{
+		for (size_t r = 0; r < MIN(reps, 16); r++)
+			mix_voices(out, accum, srcs, gains, voices, MIX_TEST_FRAMES * 2);
+
+		uint64_t startNs = host_ns();
+		uint64_t startCycles = host_cycles();
+		for (size_t r = 0; r < reps; r++)
+			mix_voices(out, accum, srcs, gains, voices, MIX_TEST_FRAMES * 2);
+		uint64_t cycles = host_cycles() - startCycles;
+		uint64_t ns = host_ns() - startNs;
+
+		printf("  %8i %10.3f", voices, ns / ((double)reps * MIX_TEST_FRAMES));
+		if (HAVE_TSC && cycles > 0)
+			printf(" %10.3f\n", (double)reps * sizeof(out) / cycles);
+		else
+			printf(" %10s\n", "n/a");
+	}
+}
+
+//------------------------------------------------------------------------------
+// Main
+//------------------------------------------------------------------------------
+
+static void usage(const char *progName)
+{
+	printf(
+		"usage: %s [options]\n"
+		"Checks the sample format converters against golden vectors and the mixer\n"
+		"against a reference, and measures their speed. Block sizes are in source\n"
+		"bytes; samples are source frames; bytes/cyc is destination bytes written\n"
+		"per TSC cycle.\n"
+		"Options:\n"
+		"  -n BYTES  source bytes converted per measurement (default: %zu)\n"
+		"  -g        only check the golden vectors\n"
+		"  -h        display this help message\n",
+		progName, bytesPerRun);
+}
+
+int main(int argc, char **argv)
+{
+	int goldenOnly = 0;
+	int failed = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:gh")) != -1)
+	{
+		switch (opt)
+		{
+		case 'n':
+			bytesPerRun = strtoul(optarg, NULL, 0);
+			break;
+		case 'g':
+			goldenOnly = 1;
+			break;
+		case 'h':
+			usage(argv[0]);
+			return 0;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	printf("Golden vectors:\n");
+	for (int i = 0; i < ARRAY_COUNT(converters); i++)
+	{
+		if (check_golden(&converters[i]))
+			printf("  ok   %s\n", converters[i].name);
+		else
+			failed++;
+	}
+	if (check_mixer())
+		printf("  ok   mixer\n");
+	else
+		failed++;
+	if (failed)
+	{
+		printf("%i check(s) failed\n", failed);
+		return 1;
+	}
+	if (goldenOnly)
+		return 0;
+
+	printf("\n");
+	for (int i = 0; i < ARRAY_COUNT(converters); i++)
+		bench_converter(&converters[i]);
+	bench_mixer();
+	return 0;
+}
@@ -0,0 +1,550 @@
+// Host-side simulator for the HDA VxD
+//
+// Runs the real controller initialization, codec enumeration and interrupt
+// handling code from hda_main.c against a software model of an HDA controller
+// and codec, and plays a test tone through it the same way the ring-3 driver
+// would. This makes it possible to measure the cost of initialization and
+// interrupt handling without a Windows 9x machine.
+//
+// Build with "wmake hdasim"; it only needs a host C compiler.
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <vmm.h>
+#include <configmg.h>
+#include <mmsystem.h>
+
+#include "hdaudio.h"
+#include "hda_vxd_api.h"
+#include "hdasim.h"
+
+// Entry points of the VxD
+DWORD hda_vxd_control_proc(DWORD msg, DWORD paramEBX, DWORD paramEDX, DWORD paramESI);
+void __cdecl hda_vxd_pm16_api_proc(HVM hVM, CLIENT_STRUCT *clientRegs);
+
+typedef CONFIGRET (*ConfigHandler)(CONFIGFUNC func, SUBCONFIGFUNC subfunc, DEVNODE devnode, DWORD dwRefData, ULONG ulFlags);
+
+#define SIM_DEVNODE 0x1234
+#define MAX_SIM_CODECS 15
+
+static struct SimCodec *simCodecs[MAX_SIM_CODECS];
+static int simCodecsCount;
+
+static struct
+{
+	unsigned int rate;
+	unsigned int bits;
+	unsigned int channels;
+	double seconds;
+	unsigned int blockSize;
+	unsigned int queueDepth;
+	int jackNode;
+	unsigned int repeat;
+	unsigned int clients;
+	unsigned int volume;
+} options =
+{
+	.rate = 22050,
+	.bits = 16,
+	.channels = 2,
+	.seconds = 2.0,
+	.blockSize = 8192,
+	.queueDepth = 4,
+	.jackNode = -1,
+	.repeat = 1,
+	.clients = 1,
+	.volume = 0xFFFF,
+};
+
+static uint64_t host_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * SIM_NS_PER_SEC + ts.tv_nsec;
+}
+
+//------------------------------------------------------------------------------
+// Simulated ring-3 driver
+//------------------------------------------------------------------------------
+
+struct ClientBlock
+{
+	WAVEHDR wavHdr;
+	uint32_t wavHdrSegOff;
+	uint8_t *data;
+	uint32_t dataSegOff;
+};
+
+// A program playing through the VxD, on a stream of its own or mixed into
+// another client's
+struct SimClient
+{
+	WORD hStream;
+	struct ClientBlock *blocks;
+	unsigned long framesGenerated;
+	unsigned int blocksInQueue;
+};
+
+static struct SimClient *clients;
+static unsigned long framesTotal;
+static unsigned long blocksSubmitted;
+static unsigned long blocksCompleted;
+
+// Calls the VxD's 16-bit protected mode API. BX is passed in and returned
+// through bx, if it isn't NULL. Returns the value of AL.
+static int call_pm16_api(WORD function, uint32_t esSi, WORD *bx)
+{
+	CLIENT_STRUCT regs;
+
+	memset(&regs, 0, sizeof(regs));
+	regs.CWRS.Client_AX = function;
+	regs.CRS.Client_ES = esSi >> 16;
+	regs.CWRS.Client_SI = esSi & 0xFFFF;
+	if (bx != NULL)
+		regs.CWRS.Client_BX = *bx;
+	sim_set_client_regs(&regs);
+	hda_vxd_pm16_api_proc(0, &regs);
+	sim_set_client_regs(NULL);
+	if (bx != NULL)
+		*bx = regs.CWRS.Client_BX;
+	return regs.CBRS.Client_AL;
+}
+
+static int set_volume(WORD hStream, WORD volume)
+{
+	CLIENT_STRUCT regs;
+
+	memset(&regs, 0, sizeof(regs));
+	regs.CWRS.Client_AX = HDA_VXD_SET_VOLUME;
+	regs.CWRS.Client_BX = hStream;
+	regs.CWRS.Client_CX = volume;
+	regs.CWRS.Client_DX = volume;
+	sim_set_client_regs(&regs);
+	hda_vxd_pm16_api_proc(0, &regs);
+	sim_set_client_regs(NULL);
+	return regs.CBRS.Client_AL;
+}
+
+// Fills a block with a square wave, 1 kHz for the first client and an octave
+// higher for each one after it
+static unsigned int fill_block(struct SimClient *client, uint8_t *data)
+{
+	unsigned int frameBytes = options.channels * options.bits / 8;
+	unsigned int frames = MIN(options.blockSize / frameBytes, framesTotal - client->framesGenerated);
+	unsigned int halfPeriod = MAX(options.rate / (2000 << (client - clients)), 1);
+
+	for (unsigned int i = 0; i < frames; i++)
+	{
+		int high = ((client->framesGenerated + i) / halfPeriod) & 1;
+		for (unsigned int c = 0; c < options.channels; c++)
+		{
+			if (options.bits == 8)
+				*data++ = high ? 0xC0 : 0x40;
+			else
+			{
+				int16_t s = high ? 0x4000 : -0x4000;
+				memcpy(data, &s, 2);
+				data += 2;
+			}
+		}
+	}
+	client->framesGenerated += frames;
+	return frames * frameBytes;
+}
+
+static BOOL submit_block(struct SimClient *client, struct ClientBlock *block)
+{
+	if (client->framesGenerated == framesTotal)
+		return TRUE;
+	block->wavHdr.dwBufferLength = fill_block(client, block->data);
+	block->wavHdr.dwFlags = WHDR_PREPARED | WHDR_INQUEUE;
+	if (!call_pm16_api(HDA_VXD_SUBMIT_WAVE_BLOCK, block->wavHdrSegOff, &client->hStream))
+		return FALSE;
+	client->blocksInQueue++;
+	blocksSubmitted++;
+	return TRUE;
+}
+
+static void wave_block_finished(uint32_t wavHdrSegOff)
+{
+	for (unsigned int c = 0; c < options.clients; c++)
+	{
+		struct SimClient *client = &clients[c];
+		for (unsigned int i = 0; i < options.queueDepth; i++)
+		{
+			struct ClientBlock *block = &client->blocks[i];
+			if (block->wavHdrSegOff == wavHdrSegOff)
+			{
+				block->wavHdr.dwFlags |= WHDR_DONE;
+				block->wavHdr.dwFlags &= ~WHDR_INQUEUE;
+				client->blocksInQueue--;
+				blocksCompleted++;
+				submit_block(client, block);
+				return;
+			}
+		}
+	}
+	fprintf(stderr, "hdasim: VxD released unknown block %04X:%04X\n", wavHdrSegOff >> 16, wavHdrSegOff & 0xFFFF);
+}
+
+static unsigned int blocks_in_queue(void)
+{
+	unsigned int count = 0;
+
+	for (unsigned int c = 0; c < options.clients; c++)
+		count += clients[c].blocksInQueue;
+	return count;
+}
+
+// Opens a stream for each client and plays until all of them are done
+static BOOL play(void)
+{
+	PCMWAVEFORMAT wavFmt;
+	BOOL ok = TRUE;
+
+	wavFmt.wf.wFormatTag = WAVE_FORMAT_PCM;
+	wavFmt.wf.nChannels = options.channels;
+	wavFmt.wf.nSamplesPerSec = options.rate;
+	wavFmt.wf.nBlockAlign = options.channels * options.bits / 8;
+	wavFmt.wf.nAvgBytesPerSec = options.rate * wavFmt.wf.nBlockAlign;
+	wavFmt.wBitsPerSample = options.bits;
+
+	framesTotal = (unsigned long)(options.seconds * options.rate);
+	clients = calloc(options.clients, sizeof(*clients));
+	sim_wave_block_finished = wave_block_finished;
+	for (unsigned int c = 0; c < options.clients && ok; c++)
+	{
+		struct SimClient *client = &clients[c];
+		client->blocks = calloc(options.queueDepth, sizeof(*client->blocks));
+		for (unsigned int i = 0; i < options.queueDepth; i++)
+		{
+			struct ClientBlock *block = &client->blocks[i];
+			block->data = malloc(options.blockSize);
+			block->dataSegOff = sim_far_alloc(block->data);
+			block->wavHdr.lpData = (LPSTR)(uintptr_t)block->dataSegOff;
+			block->wavHdrSegOff = sim_far_alloc(&block->wavHdr);
+		}
+		if (!call_pm16_api(HDA_VXD_OPEN_STREAM, sim_far_alloc(&wavFmt), &client->hStream))
+		{
+			fprintf(stderr, "hdasim: HDA_VXD_OPEN_STREAM failed for client %u\n", c);
+			client->hStream = 0;
+			ok = FALSE;
+			break;
+		}
+		if (options.volume != 0xFFFF && !set_volume(client->hStream, options.volume))
+			fprintf(stderr, "hdasim: HDA_VXD_SET_VOLUME failed for client %u\n", c);
+		for (unsigned int i = 0; i < options.queueDepth; i++)
+		{
+			if (!submit_block(client, &client->blocks[i]))
+			{
+				fprintf(stderr, "hdasim: HDA_VXD_SUBMIT_WAVE_BLOCK failed\n");
+				ok = FALSE;
+				break;
+			}
+		}
+	}
+
+	// Let the streams play until every block has been returned, allowing for
+	// the data still buffered in the DMA ring
+	uint64_t deadline = sim_now() + (uint64_t)((options.seconds * 2 + 1) * SIM_NS_PER_SEC);
+	uint64_t jackTime = sim_now() + (uint64_t)(options.seconds / 2 * SIM_NS_PER_SEC);
+	BOOL jackToggled = (options.jackNode < 0);
+	while (blocks_in_queue() > 0 && sim_now() < deadline)
+	{
+		sim_idle(SIM_NS_PER_SEC / 1000);
+		sim_run_global_events();
+		sim_run_appy_events();
+		if (!jackToggled && sim_now() >= jackTime)
+		{
+			const struct SimNode *node = &simCodecs[0]->nodes[options.jackNode];
+			sim_model_set_pin_sense(simCodecs[0]->addr, options.jackNode, !(node->pinSense & (1u << 31)));
+			jackToggled = TRUE;
+		}
+	}
+	if (blocks_in_queue() > 0)
+		fprintf(stderr, "hdasim: playback timed out with %u blocks still queued\n", blocks_in_queue());
+
+	for (unsigned int c = 0; c < options.clients; c++)
+	{
+		if (clients[c].hStream != 0)
+			call_pm16_api(HDA_VXD_CLOSE_STREAM, 0, &clients[c].hStream);
+	}
+	sim_run_global_events();
+	sim_run_appy_events();
+	sim_wave_block_finished = NULL;
+	for (unsigned int c = 0; c < options.clients; c++)
+	{
+		if (clients[c].blocks == NULL)
+			continue;
+		for (unsigned int i = 0; i < options.queueDepth; i++)
+			free(clients[c].blocks[i].data);
+		free(clients[c].blocks);
+	}
+	free(clients);
+	clients = NULL;
+	return ok;
+}
+
+//------------------------------------------------------------------------------
+// Main
+//------------------------------------------------------------------------------
+
+static void usage(const char *progName)
+{
+	printf(
+		"usage: %s [options]\n"
+		"Options:\n"
+		"  -r RATE      sample rate of the test tone (default: %u)\n"
+		"  -b BITS      bits per sample, 8 or 16 (default: %u)\n"
+		"  -c CHANNELS  number of channels, 1 or 2 (default: %u)\n"
+		"  -t SECONDS   length of the test tone (default: %g)\n"
+		"  -B BYTES     size of each wave block (default: %u)\n"
+		"  -q COUNT     number of wave blocks kept queued (default: %u)\n"
+		"  -k SCALE     stream sample clock relative to nominal (default: %g)\n"
+		"  -l MICROSEC  interrupt latency (default: %g)\n"
+		"  -j MICROSEC  maximum additional random interrupt latency (default: %g)\n"
+		"  -p NANOSEC   cost of reading the timer (default: %llu)\n"
+		"  -T MHZ       time-stamp counter frequency, 0 for a CPU without one\n"
+		"               (default: %g)\n"
+		"  -s SCALE     simulated CPU time per host CPU time in the ISR (default: %g)\n"
+		"  -o FILE      write the audio played by the first output DMA engine\n"
+		"               to FILE\n"
+		"  -C FILE      attach a codec described by a Linux codec dump\n"
+		"               (/proc/asound/card*/codec#* or hdactl -x output).\n"
+		"               May be given more than once. Without it, a built-in\n"
+		"               codec is used.\n"
+		"  -n COUNT     play the tone COUNT times, reopening the stream each time\n"
+		"  -S COUNT     play COUNT clients at once, at 1 kHz and up an octave\n"
+		"               per client. Clients that find no output stream free\n"
+		"               are mixed into one.\n"
+		"  -v VOLUME    volume of every client, from 0 to 0xFFFF (default:\n"
+		"               0xFFFF)\n"
+		"  -J NID       plug or unplug the jack at pin NID of the first codec\n"
+		"               halfway through playback\n"
+		"  -D ADDR      the codec at ADDR shows up in STATESTS but never answers\n"
+		"               a command. May be given more than once.\n"
+		"  -W ADDR:MS   the codec at ADDR stops answering after its tenth\n"
+		"               command, then sends all of the responses it held back\n"
+		"               MS milliseconds later\n"
+		"  -P BYTES     the DMA position buffer reports positions BYTES ahead of\n"
+		"               SDLPIB (negative: behind)\n"
+		"  -L MS        set the devnode's Latency registry value\n"
+		"  -R FILE      load the devnode's registry values from FILE, if it\n"
+		"               exists, and save them back to it on exit\n"
+		"  -e           only initialize the driver; don't play anything\n"
+		"  -h           display this help message\n",
+		progName, options.rate, options.bits, options.channels, options.seconds,
+		options.blockSize, options.queueDepth, simConfig.clockScale,
+		simConfig.irqLatencyNs / 1000.0, simConfig.irqJitterNs / 1000.0,
+		(unsigned long long)simConfig.pitReadNs, simConfig.tscRate / 1e6, simConfig.cpuScale);
+}
+
+static unsigned long initVerbs;  // verbs sent before playback started
+
+static unsigned long total_verbs(void)
+{
+	return simStats.getParamVerbs + simStats.getVerbs + simStats.setVerbs;
+}
+
+static uint64_t configStartNs;  // simulated time spent in CONFIG_START
+
+static void print_report(uint64_t initSimNs, uint64_t initHostNs)
+{
+	unsigned long verbs = total_verbs();
+
+	printf("=== Initialization ===\n");
+	printf("simulated time:   %.3f ms\n", initSimNs / 1e6);
+	printf("  CONFIG_START:   %.3f ms\n", configStartNs / 1e6);
+	printf("host time:        %.3f ms\n", initHostNs / 1e6);
+	printf("=== Commands ===\n");
+	printf("verbs:            %lu\n", verbs);
+	printf("  GET_PARAMETER:  %lu\n", simStats.getParamVerbs);
+	printf("  other GET:      %lu\n", simStats.getVerbs);
+	printf("  SET:            %lu\n", simStats.setVerbs);
+	printf("CORB doorbells:   %lu\n", simStats.corbDoorbells);
+	printf("immediate verbs:  %lu\n", simStats.immediateVerbs);
+	printf("unanswered:       %lu\n", simStats.unanswered);
+	if (simConfig.lateCodec >= 0)
+		printf("late responses:   %lu\n", simStats.lateResponses);
+	printf("unsolicited:      %lu\n", simStats.unsolicited);
+	printf("timer reads:      %lu\n", simStats.timerReads);
+	printf("TSC reads:        %lu\n", simStats.tscReads);
+	printf("CPU halts:        %lu (%.3f ms halted)\n", simStats.halts, simStats.haltNs / 1e6);
+	for (int i = 0; i < simCodecsCount; i++)
+	{
+		printf("codec %i (%s): %lu verbs\n", simCodecs[i]->addr, simCodecs[i]->name, simCodecs[i]->verbCount);
+		sim_codec_print_paths(simCodecs[i]);
+	}
+	printf("=== Playback ===\n");
+	printf("blocks:           %lu submitted, %lu completed\n", blocksSubmitted, blocksCompleted);
+	printf("verbs:            %lu\n", verbs - initVerbs);
+	printf("bytes played:     %llu\n", simStats.bytesPlayed);
+	printf("interrupts:       %lu (%lu not ours), %lu EOIs\n", simStats.interrupts, simStats.spuriousInterrupts, simStats.eois);
+	printf("chunks:           %lu\n", simStats.chunks);
+	if (simStats.interrupts > 0)
+		printf("ISR cycles:       %.0f avg/interrupt, %llu max\n",
+			(double)simStats.isrCycles / simStats.interrupts, simStats.isrMaxCycles);
+	if (simStats.chunks > 0)
+		printf("ISR cycles/chunk: %.0f\n", (double)simStats.isrCycles / simStats.chunks);
+	printf("underruns:        %lu\n", simStats.underruns);
+	printf("DMA errors:       %lu\n", simStats.dmaErrors);
+	printf("=== Memory ===\n");
+	printf("heap:             %lu bytes in use, %lu peak\n", sim_heap_bytes(), sim_heap_peak());
+	printf("pages:            %lu bytes\n", sim_page_bytes());
+	printf("breakpoints hit:  %lu\n", simStats.breakpoints);
+}
+
+int main(int argc, char **argv)
+{
+	int opt;
+	char *end;
+	const char *captureName = NULL;
+	const char *registryName = NULL;
+	long latency = -1;
+	BOOL enumOnly = FALSE;
+
+	while ((opt = getopt(argc, argv, "r:b:c:t:B:q:k:l:j:p:T:s:o:C:J:n:S:v:D:W:P:L:R:eh")) != -1)
+	{
+		switch (opt)
+		{
+		case 'r': options.rate = strtoul(optarg, NULL, 0); break;
+		case 'b': options.bits = strtoul(optarg, NULL, 0); break;
+		case 'c': options.channels = strtoul(optarg, NULL, 0); break;
+		case 't': options.seconds = strtod(optarg, NULL); break;
+		case 'B': options.blockSize = strtoul(optarg, NULL, 0); break;
+		case 'q': options.queueDepth = strtoul(optarg, NULL, 0); break;
+		case 'k': simConfig.clockScale = strtod(optarg, NULL); break;
+		case 'l': simConfig.irqLatencyNs = strtod(optarg, NULL) * 1000; break;
+		case 'j': simConfig.irqJitterNs = strtod(optarg, NULL) * 1000; break;
+		case 'p': simConfig.pitReadNs = strtoull(optarg, NULL, 0); break;
+		case 'T': simConfig.tscRate = strtod(optarg, NULL) * 1e6; break;
+		case 's': simConfig.cpuScale = strtod(optarg, NULL); break;
+		case 'o': captureName = optarg; break;
+		case 'C':
+			if (simCodecsCount == MAX_SIM_CODECS)
+			{
+				fprintf(stderr, "hdasim: too many codecs\n");
+				return 1;
+			}
+			if ((simCodecs[simCodecsCount] = sim_codec_load_alsa(optarg)) == NULL)
+				return 1;
+			simCodecsCount++;
+			break;
+		case 'n': options.repeat = strtoul(optarg, NULL, 0); break;
+		case 'S': options.clients = strtoul(optarg, NULL, 0); break;
+		case 'v': options.volume = strtoul(optarg, NULL, 0); break;
+		case 'J': options.jackNode = strtoul(optarg, NULL, 0); break;
+		case 'D': simConfig.deadCodecs |= 1 << strtoul(optarg, NULL, 0); break;
+		case 'W':
+			simConfig.lateCodec = strtoul(optarg, &end, 0);
+			if (*end != ':' || simConfig.lateCodec >= 15)
+			{
+				usage(argv[0]);
+				return 1;
+			}
+			simConfig.lateNs = strtod(end + 1, NULL) * 1e6;
+			break;
+		case 'P': simConfig.positionSkew = strtol(optarg, NULL, 0); break;
+		case 'L': latency = strtol(optarg, NULL, 0); break;
+		case 'R': registryName = optarg; break;
+		case 'e': enumOnly = TRUE; break;
+		case 'h':
+			usage(argv[0]);
+			return 0;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if ((options.bits != 8 && options.bits != 16) || (options.channels != 1 && options.channels != 2)
+	 || options.rate < 2000 || options.queueDepth == 0 || options.blockSize < 4
+	 || options.jackNode >= SIM_MAX_NODES || options.repeat == 0
+	 || options.clients == 0 || options.clients > 15 || options.volume > 0xFFFF)
+	{
+		fprintf(stderr, "hdasim: unsupported playback parameters\n");
+		return 1;
+	}
+	if (captureName != NULL)
+	{
+		simConfig.captureFile = fopen(captureName, "wb");
+		if (simConfig.captureFile == NULL)
+		{
+			perror(captureName);
+			return 1;
+		}
+	}
+
+	if (simCodecsCount == 0)
+		simCodecs[simCodecsCount++] = sim_codec_create_builtin();
+	for (int i = 0; i < simCodecsCount; i++)
+	{
+		if (simCodecs[i]->addr < 0 || simCodecs[i]->addr >= MAX_SIM_CODECS)
+		{
+			fprintf(stderr, "hdasim: invalid codec address %i\n", simCodecs[i]->addr);
+			return 1;
+		}
+		for (int j = 0; j < i; j++)
+		{
+			if (simCodecs[j]->addr == simCodecs[i]->addr)
+			{
+				fprintf(stderr, "hdasim: more than one codec at address %i\n", simCodecs[i]->addr);
+				return 1;
+			}
+		}
+		sim_model_attach_codec(simCodecs[i]->addr, simCodecs[i]);
+	}
+	sim_model_init();
+	if (registryName != NULL)
+		sim_registry_load(registryName);
+	if (latency >= 0)
+	{
+		uint32_t value = latency;  // REG_DWORD is 32 bits wide
+		CM_Write_Registry_Value(SIM_DEVNODE, NULL, "Latency", REG_DWORD, &value, sizeof(value), CM_REGISTRY_SOFTWARE);
+	}
+
+	// Load the driver the way MMDEVLDR does and start the device
+	hda_vxd_control_proc(PNP_NEW_DEVNODE, SIM_DEVNODE, DLVXD_LOAD_DRIVER, 0);
+	if (simConfigHandler == 0)
+	{
+		fprintf(stderr, "hdasim: driver did not register a config handler\n");
+		return 1;
+	}
+	uint64_t simStart = sim_now();
+	uint64_t hostStart = host_ns();
+	CONFIGRET result = ((ConfigHandler)simConfigHandler)(CONFIG_START, CONFIG_START_FIRST_START, SIM_DEVNODE, 0, 0);
+	configStartNs = sim_now() - simStart;
+	// The driver finishes initializing from a global event
+	if (result == CR_SUCCESS)
+		sim_run_global_events();
+	uint64_t initHostNs = host_ns() - hostStart;
+	uint64_t initSimNs = sim_now() - simStart;
+	if (result != CR_SUCCESS)
+	{
+		fprintf(stderr, "hdasim: CONFIG_START failed with %lu\n", (unsigned long)result);
+		print_report(initSimNs, initHostNs);
+		return 1;
+	}
+
+	sim_run_global_events();
+	initVerbs = total_verbs();
+	BOOL ok = TRUE;
+	for (unsigned int i = 0; i < options.repeat && ok && !enumOnly; i++)
+		ok = play();
+	print_report(initSimNs, initHostNs);
+
+	if (registryName != NULL && !sim_registry_save(registryName))
+	{
+		perror(registryName);
+		ok = FALSE;
+	}
+	if (simConfig.captureFile != NULL)
+		fclose(simConfig.captureFile);
+	for (int i = 0; i < simCodecsCount; i++)
+		sim_codec_free(simCodecs[i]);
+	// A breakpoint is a bug in the driver, even if it carried on
+	return (ok && simStats.breakpoints == 0) ? 0 : 1;
+}
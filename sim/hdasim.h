@@ -0,0 +1,150 @@
+// Internal interfaces of the host-side HDA simulator
+
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+//------------------------------------------------------------------------------
+// Simulated time
+//------------------------------------------------------------------------------
+
+#define SIM_NS_PER_SEC   1000000000ULL
+#define SIM_LINK_RATE    48000  // HDA link frame rate
+#define SIM_PIT_RATE     1193182
+#define SIM_WALCLK_RATE  24000000
+#define SIM_TIMER_TICK_NS 1000000  // system timer interrupt period; wakes a halted CPU
+
+uint64_t sim_now(void);
+void sim_advance(uint64_t ns);
+void sim_idle(uint64_t ns);
+
+//------------------------------------------------------------------------------
+// Codec models
+//------------------------------------------------------------------------------
+
+#define SIM_MAX_NODES 256
+#define SIM_MAX_CONNS 128
+
+struct SimNode
+{
+	uint8_t present;
+	uint32_t params[0x20];  // VERB_GET_PARAMETER responses
+	uint16_t conns[SIM_MAX_CONNS];
+	int connsCount;
+	uint32_t state[256];  // value last set with a 12-bit verb, indexed by its low byte
+	uint16_t format;  // converter format (4-bit verb 0x2/0xA)
+	uint8_t amp[2][2][16];  // gain/mute indexed by [output][left][index]
+	uint32_t pinSense;
+	uint8_t written[256];  // set verbs received, indexed like state[]
+};
+
+struct SimCodec
+{
+	char name[64];
+	int addr;  // codec address the model was captured from
+	struct SimNode nodes[SIM_MAX_NODES];
+	unsigned long verbCount;
+};
+
+struct SimCodec *sim_codec_create_builtin(void);
+struct SimCodec *sim_codec_load_alsa(const char *fileName);
+void sim_codec_free(struct SimCodec *codec);
+uint32_t sim_codec_verb(struct SimCodec *codec, uint32_t command);
+void sim_codec_print_paths(const struct SimCodec *codec);
+
+//------------------------------------------------------------------------------
+// Controller model
+//------------------------------------------------------------------------------
+
+#define SIM_MMIO_BASE 0xFEBF0000
+#define SIM_MMIO_SIZE 0x4000
+#define SIM_IRQ       11
+
+struct SimConfig
+{
+	int numInputStreams;
+	int numOutputStreams;
+	uint64_t codecWakeNs;  // time from leaving reset until codecs report in STATESTS
+	uint16_t deadCodecs;  // codecs that report in STATESTS but never answer a command
+	int lateCodec;  // codec that holds back its responses for a while, or -1
+	uint64_t lateNs;  // how long it holds them
+	uint64_t pitReadNs;  // cost of one VTD_Get_Real_Time call
+	uint64_t tscRate;  // time-stamp counter frequency, or 0 for a CPU without one
+	uint64_t tscReadNs;  // cost of one RDTSC
+	int32_t positionSkew;  // bytes the DMA position buffer reports ahead of SDLPIB
+	uint64_t irqLatencyNs;  // delay from interrupt assertion to ISR entry
+	uint64_t irqJitterNs;  // additional random delay
+	double clockScale;  // stream sample clock relative to nominal
+	double cpuScale;  // simulated ISR time per host ISR time
+	FILE *captureFile;  // receives everything the output DMA engine plays
+};
+
+struct SimStats
+{
+	unsigned long corbVerbs;  // commands fetched from the CORB
+	unsigned long corbDoorbells;  // CORBWP updates
+	unsigned long immediateVerbs;  // commands sent through the Immediate Command interface
+	unsigned long getParamVerbs;
+	unsigned long getVerbs;
+	unsigned long setVerbs;
+	unsigned long unanswered;  // commands sent to an address with no codec
+	unsigned long lateResponses;  // responses the late codec held back
+	unsigned long unsolicited;  // unsolicited responses written to the RIRB
+	unsigned long interrupts;
+	unsigned long spuriousInterrupts;
+	unsigned long eois;
+	unsigned long chunks;  // BDL entries completed with IOC set
+	unsigned long underruns;  // DMA entered an entry that was not refilled
+	unsigned long dmaErrors;
+	unsigned long long isrCycles;
+	unsigned long long isrMaxCycles;
+	unsigned long long bytesPlayed;
+	unsigned long breakpoints;
+	unsigned long timerReads;  // VTD_Get_Real_Time calls
+	unsigned long tscReads;  // RDTSC instructions
+	unsigned long halts;  // times the driver halted the CPU to wait for an interrupt
+	unsigned long long haltNs;  // simulated time spent halted
+};
+
+extern struct SimConfig simConfig;
+extern struct SimStats simStats;
+
+void sim_model_init(void);
+void *sim_model_regs(void);
+void sim_model_attach_codec(int addr, struct SimCodec *codec);
+void sim_model_set_irq_handler(void (*handler)(unsigned long, unsigned long), unsigned long hIRQ);
+void sim_model_set_irq_masked(int masked);
+void sim_model_check_irq(void);
+void sim_model_set_pin_sense(int addr, int nid, int present);
+
+//------------------------------------------------------------------------------
+// VMM environment
+//------------------------------------------------------------------------------
+
+// Fake physical memory
+void *sim_phys_to_virt(uint32_t phys, uint32_t size);
+unsigned long sim_heap_bytes(void);
+unsigned long sim_heap_peak(void);
+unsigned long sim_page_bytes(void);
+
+// 16:16 far pointers handed to the driver by the simulated ring-3 driver
+uint32_t sim_far_alloc(void *ptr);
+void *sim_far_to_flat(uint32_t segOff);
+void sim_set_client_regs(void *clientRegs);
+
+// CPU state
+int sim_cpu_interrupts_enabled(void);
+extern int simCarryFlag;
+
+// Global events, appy-time events and ring-3 callbacks
+void sim_run_global_events(void);
+void sim_run_appy_events(void);
+extern void (*sim_wave_block_finished)(uint32_t wavHdrSegOff);
+
+// Devnode registry values, kept in a file between runs
+int sim_registry_load(const char *fileName);
+int sim_registry_save(const char *fileName);
+
+// Registered by the VxD through MMDEVLDR
+extern unsigned long simConfigHandler;
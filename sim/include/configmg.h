@@ -0,0 +1,76 @@
+// Replacement for ddk/configmg.h used by the host simulator build
+
+#pragma once
+
+#include <vmm.h>
+
+#define DLVXD_LOAD_DRIVER 2
+
+typedef VOID *PFARVOID;
+typedef char *PFARCHAR;
+typedef ULONG *PFARULONG;
+
+typedef DWORD CONFIGRET;
+
+#define CR_SUCCESS       0x00000000
+#define CR_DEFAULT       0x00000001
+#define CR_OUT_OF_MEMORY 0x00000002
+#define CR_FAILURE       0x00000013
+#define CR_BUFFER_SMALL  0x0000001A
+#define CR_NO_SUCH_VALUE 0x00000025
+
+typedef ULONG CONFIGFUNC;
+
+#define CONFIG_FILTER 0x00000000
+#define CONFIG_START  0x00000001
+#define CONFIG_STOP   0x00000002
+#define CONFIG_REMOVE 0x00000005
+
+typedef ULONG SUBCONFIGFUNC;
+
+#define CONFIG_START_DYNAMIC_START 0x00000000
+#define CONFIG_START_FIRST_START   0x00000001
+
+typedef DWORD DEVNODE;
+
+#define MAX_MEM_REGISTERS  9
+#define MAX_IO_PORTS      20
+#define MAX_IRQS           7
+#define MAX_DMA_CHANNELS   7
+
+typedef struct Config_Buff_s
+{
+	WORD  wNumMemWindows;
+	DWORD dMemBase[MAX_MEM_REGISTERS];
+	DWORD dMemLength[MAX_MEM_REGISTERS];
+	WORD  wMemAttrib[MAX_MEM_REGISTERS];
+	WORD  wNumIOPorts;
+	WORD  wIOPortBase[MAX_IO_PORTS];
+	WORD  wIOPortLength[MAX_IO_PORTS];
+	WORD  wNumIRQs;
+	BYTE  bIRQRegisters[MAX_IRQS];
+	BYTE  bIRQAttrib[MAX_IRQS];
+	WORD  wNumDMAs;
+	BYTE  bDMALst[MAX_DMA_CHANNELS];
+	WORD  wDMAAttrib[MAX_DMA_CHANNELS];
+	BYTE  bReserved1[3];
+} CMCONFIG, *PCMCONFIG;
+
+typedef ULONG ENUMFUNC;
+
+#define CM_GET_ALLOC_LOG_CONF_ALLOC 0x00000000
+
+#define CM_REGISTRY_HARDWARE 0x00000000
+#define CM_REGISTRY_SOFTWARE 0x00000001
+
+#ifndef REG_BINARY
+#define REG_BINARY 3
+#endif
+#ifndef REG_DWORD
+#define REG_DWORD 4
+#endif
+
+CONFIGRET CM_Get_Alloc_Log_Conf(PCMCONFIG pccBuffer, DEVNODE dnDevNode, ULONG ulFlags);
+CONFIGRET CM_Call_Enumerator_Function(DEVNODE dnDevNode, ENUMFUNC efFunc, ULONG ulRefData, PFARVOID pBuffer, ULONG ulBufferSize, ULONG ulFlags);
+CONFIGRET CM_Read_Registry_Value(DEVNODE dnDevNode, PFARCHAR pszSubKey, PFARCHAR pszValueName, ULONG ulExpectedType, PFARVOID pBuffer, PFARULONG pulLength, ULONG ulFlags);
+CONFIGRET CM_Write_Registry_Value(DEVNODE dnDevNode, PFARCHAR pszSubKey, PFARCHAR pszValueName, ULONG ulType, PFARVOID pBuffer, ULONG ulLength, ULONG ulFlags);
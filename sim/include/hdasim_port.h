@@ -0,0 +1,27 @@
+// Replacements for the privileged instructions used by hda_main.c when it is
+// built into the host simulator. Interrupt masking and the carry flag returned
+// to VPICD are tracked by the simulator instead of the CPU.
+
+#pragma once
+
+#include <stdint.h>
+
+void hdasim_breakpoint(const char *file, int line);
+void hdasim_flush_cache(void);
+void hdasim_set_carry(int carry);
+uint16_t hdasim_disable_interrupts(void);
+void hdasim_restore_interrupts(uint16_t iflag);
+void hdasim_wait_for_interrupt(void);
+int hdasim_cpu_has_tsc(void);
+unsigned long long hdasim_read_tsc(void);
+
+#define BKPT        hdasim_breakpoint(__FILE__, __LINE__);
+#define FLUSH_CACHE hdasim_flush_cache();
+#define SET_CARRY   hdasim_set_carry(1);
+#define CLEAR_CARRY hdasim_set_carry(0);
+
+#define disable_interrupts hdasim_disable_interrupts
+#define restore_interrupts hdasim_restore_interrupts
+#define wait_for_interrupt hdasim_wait_for_interrupt
+#define cpu_has_tsc        hdasim_cpu_has_tsc
+#define read_tsc           hdasim_read_tsc
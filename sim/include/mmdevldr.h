@@ -0,0 +1,7 @@
+// Replacement for ddk/mmdevldr.h used by the host simulator build
+
+#pragma once
+
+#include <configmg.h>
+
+void MMDEVLDR_Register_Device_Driver(DEVNODE dnDevNode, DWORD fnConfigHandler, DWORD dwUserData);
@@ -0,0 +1,73 @@
+// Minimal <mmsystem.h> replacement for the host simulator build
+
+#pragma once
+
+#include <windows.h>
+
+#define MAXPNAMELEN 32
+
+typedef struct wavehdr_tag
+{
+	LPSTR lpData;  // 16:16 far pointer, as passed down from the ring-3 driver
+	DWORD dwBufferLength;
+	DWORD dwBytesRecorded;
+	DWORD dwUser;
+	DWORD dwFlags;
+	DWORD dwLoops;
+	struct wavehdr_tag *lpNext;
+	DWORD reserved;
+} WAVEHDR;
+
+#define WHDR_DONE      0x00000001
+#define WHDR_PREPARED  0x00000002
+#define WHDR_BEGINLOOP 0x00000004
+#define WHDR_ENDLOOP   0x00000008
+#define WHDR_INQUEUE   0x00000010
+
+typedef struct waveformat_tag
+{
+	WORD  wFormatTag;
+	WORD  nChannels;
+	DWORD nSamplesPerSec;
+	DWORD nAvgBytesPerSec;
+	WORD  nBlockAlign;
+} WAVEFORMAT;
+
+typedef struct pcmwaveformat_tag
+{
+	WAVEFORMAT wf;
+	WORD wBitsPerSample;
+} PCMWAVEFORMAT;
+
+#define WAVE_FORMAT_PCM 1
+
+typedef struct waveoutcaps_tag
+{
+	WORD wMid;
+	WORD wPid;
+	UINT vDriverVersion;
+	char szPname[MAXPNAMELEN];
+	DWORD dwFormats;
+	WORD wChannels;
+	DWORD dwSupport;
+} WAVEOUTCAPS;
+
+#define WAVE_FORMAT_1M08 0x00000001
+#define WAVE_FORMAT_1S08 0x00000002
+#define WAVE_FORMAT_1M16 0x00000004
+#define WAVE_FORMAT_1S16 0x00000008
+#define WAVE_FORMAT_2M08 0x00000010
+#define WAVE_FORMAT_2S08 0x00000020
+#define WAVE_FORMAT_2M16 0x00000040
+#define WAVE_FORMAT_2S16 0x00000080
+#define WAVE_FORMAT_4M08 0x00000100
+#define WAVE_FORMAT_4S08 0x00000200
+#define WAVE_FORMAT_4M16 0x00000400
+#define WAVE_FORMAT_4S16 0x00000800
+
+#define WAVECAPS_PITCH          0x0001
+#define WAVECAPS_PLAYBACKRATE   0x0002
+#define WAVECAPS_VOLUME         0x0004
+#define WAVECAPS_LRVOLUME       0x0008
+#define WAVECAPS_SYNC           0x0010
+#define WAVECAPS_SAMPLEACCURATE 0x0020
@@ -0,0 +1,11 @@
+// Minimal <nt/winerror.h> replacement for the host simulator build
+
+#pragma once
+
+#define ERROR_SUCCESS             0
+#define ERROR_NOT_READY           21
+#define ERROR_GEN_FAILURE         31
+#define ERROR_NOT_SUPPORTED       50
+#define ERROR_INVALID_PARAMETER   87
+#define ERROR_INSUFFICIENT_BUFFER 122
+#define ERROR_BUSY                170
@@ -0,0 +1,14 @@
+// Replacement for ddk/shell.h used by the host simulator build
+
+#pragma once
+
+#include <vmm.h>
+
+typedef DWORD APPY_HANDLE;
+typedef VOID (__cdecl *APPY_CALLBACK)(DWORD dwRefData);
+
+#define CAAFL_RING0   0x00000001
+#define CAAFL_TIMEOUT 0x00000002
+
+APPY_HANDLE _SHELL_CallAtAppyTime(APPY_CALLBACK pfnAppyCallBack, DWORD dwRefData, DWORD dwFlags, DWORD dwTimeout);
+DWORD _SHELL_CallDll(PCHAR lpszDll, PCHAR lpszProcName, DWORD cbArgs, PVOID lpvArgs);
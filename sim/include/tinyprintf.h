@@ -0,0 +1,7 @@
+// The host simulator uses the C library's printf family instead of tinyprintf
+
+#pragma once
+
+#include <stdio.h>
+
+#define init_printf(putp, putf) ((void)(putp), (void)(putf))
@@ -0,0 +1,133 @@
+// Replacement for ddk/vmm.h used by the host simulator build. The real header
+// implements the VMM services as int 20h trampolines; here they are ordinary
+// functions implemented by sim/sim_vmm.c.
+
+#pragma once
+
+#include <windows.h>
+
+typedef unsigned char  UCHAR;
+typedef unsigned short USHORT;
+typedef unsigned long  ULONG;
+typedef void *PVOID;
+typedef char *PCHAR;
+
+typedef ULONG HVM;
+
+// Client register structures. These use fixed 32-bit fields rather than ULONG
+// so that the three views of CLIENT_STRUCT overlay the same way they do on the
+// real system.
+
+struct Client_Reg_Struc
+{
+	uint32_t Client_EDI;
+	uint32_t Client_ESI;
+	uint32_t Client_EBP;
+	uint32_t Client_res0;
+	uint32_t Client_EBX;
+	uint32_t Client_EDX;
+	uint32_t Client_ECX;
+	uint32_t Client_EAX;
+	uint32_t Client_Error;
+	uint32_t Client_EIP;
+	USHORT   Client_CS;
+	USHORT   Client_res1;
+	uint32_t Client_EFlags;
+	uint32_t Client_ESP;
+	USHORT   Client_SS;
+	USHORT   Client_res2;
+	USHORT   Client_ES;
+	USHORT   Client_res3;
+	USHORT   Client_DS;
+	USHORT   Client_res4;
+	USHORT   Client_FS;
+	USHORT   Client_res5;
+	USHORT   Client_GS;
+	USHORT   Client_res6;
+};
+
+struct Client_Word_Reg_Struc
+{
+	USHORT   Client_DI;
+	USHORT   Client_res13;
+	USHORT   Client_SI;
+	USHORT   Client_res14;
+	USHORT   Client_BP;
+	USHORT   Client_res15;
+	uint32_t Client_res16;
+	USHORT   Client_BX;
+	USHORT   Client_res17;
+	USHORT   Client_DX;
+	USHORT   Client_res18;
+	USHORT   Client_CX;
+	USHORT   Client_res19;
+	USHORT   Client_AX;
+	USHORT   Client_res20;
+};
+
+struct Client_Byte_Reg_Struc
+{
+	uint32_t Client_res30[4];
+	UCHAR    Client_BL;
+	UCHAR    Client_BH;
+	USHORT   Client_res31;
+	UCHAR    Client_DL;
+	UCHAR    Client_DH;
+	USHORT   Client_res32;
+	UCHAR    Client_CL;
+	UCHAR    Client_CH;
+	USHORT   Client_res33;
+	UCHAR    Client_AL;
+	UCHAR    Client_AH;
+};
+
+typedef union tagCLIENT_STRUC
+{
+	struct Client_Reg_Struc      CRS;
+	struct Client_Word_Reg_Struc CWRS;
+	struct Client_Byte_Reg_Struc CBRS;
+} CLIENT_STRUCT;
+
+// Page types and flags for _PageAllocate
+#define PG_SYS       1
+#define PAGEUSEALIGN 0x00000002
+#define PAGECONTIG   0x00000004
+#define PAGEFIXED    0x00000008
+
+// VxD system control messages
+#define SYS_CRITICAL_INIT       0x0000
+#define DEVICE_INIT             0x0001
+#define INIT_COMPLETE           0x0002
+#define SYS_VM_INIT             0x0003
+#define SET_DEVICE_FOCUS        0x000F
+#define BEGIN_PM_APP            0x0015
+#define POWER_EVENT             0x001A
+#define SYS_DYNAMIC_DEVICE_INIT 0x001B
+#define SYS_DYNAMIC_DEVICE_EXIT 0x001C
+#define CREATE_THREAD           0x001D
+#define THREAD_INIT             0x001E
+#define TERMINATE_THREAD        0x001F
+#define THREAD_Not_Executeable  0x0020
+#define DESTROY_THREAD          0x0021
+#define PNP_NEW_DEVNODE         0x0022
+#define W32_DEVICEIOCONTROL     0x0023
+#define KERNEL32_INITIALIZED    0x0031
+#define CREATE_PROCESS          0x0033
+#define DESTROY_PROCESS         0x0034
+
+// I/O control codes for the dwIoControlCode field of DIOCPARAMETERS
+#define DIOC_GETVERSION   0x0
+#define DIOC_OPEN         DIOC_GETVERSION
+#define DIOC_CLOSEHANDLE  ((DWORD)-1)
+
+typedef ULONG EVENTHANDLE;
+
+PVOID Map_Flat(unsigned char segOffset, unsigned char offOffset);
+EVENTHANDLE Schedule_Global_Event(PVOID callback, ULONG refData);
+PVOID _HeapAllocate(ULONG nBytes, ULONG flags);
+ULONG _HeapFree(PVOID hAddress, ULONG flags);
+PVOID _PageAllocate(DWORD nPages, DWORD pType, HVM hvm, DWORD AlignMask, DWORD minPhys, DWORD maxPhys, PVOID *PhysAddr, DWORD flags);
+PVOID _MapPhysToLinear(ULONG PhysAddr, ULONG nBytes, ULONG flags);
+VOID Fatal_Error_Handler(PCHAR pszMessage, DWORD dwExitFlag);
+VOID Out_Debug_String(const char *s);
+VOID Out_Debug_Chr(char c);
@@ -0,0 +1,27 @@
+// Replacement for ddk/vpicd.h used by the host simulator build
+
+#pragma once
+
+#include <vmm.h>
+
+#define VPICD_OPT_CAN_SHARE 0x02
+
+typedef struct VPICD_IRQ_Descriptor
+{
+	USHORT VID_IRQ_Number;
+	USHORT VID_Options;
+	ULONG VID_Hw_Int_Proc;
+	ULONG VID_Virt_Int_Proc;
+	ULONG VID_EOI_Proc;
+	ULONG VID_Mask_Change_Proc;
+	ULONG VID_IRET_Proc;
+	ULONG VID_IRET_Time_Out;
+	ULONG VID_Hw_Int_Ref;
+} VID, *PVID;
+
+typedef ULONG HIRQ;
+
+HIRQ VPICD_Virtualize_IRQ(PVID pvid);
+void VPICD_Phys_EOI(HIRQ hirq);
+void VPICD_Physically_Mask(HIRQ hirq);
+void VPICD_Physically_Unmask(HIRQ hirq);
@@ -0,0 +1,9 @@
+// Replacement for ddk/vtd.h used by the host simulator build
+
+#pragma once
+
+#include <vmm.h>
+
+// Returns the simulated time in 1.193182 MHz PIT ticks. Every call also lets
+// the controller model run, since the driver polls this in its wait loops.
+unsigned long long VTD_Get_Real_Time(void);
@@ -0,0 +1,21 @@
+// Replacement for ddk/vwin32.h used by the host simulator build
+
+#pragma once
+
+#include <vmm.h>
+
+typedef struct DIOCParams
+{
+	DWORD Internal1;
+	DWORD VMHandle;
+	DWORD Internal2;
+	DWORD dwIoControlCode;
+	DWORD lpvInBuffer;
+	DWORD cbInBuffer;
+	DWORD lpvOutBuffer;
+	DWORD cbOutBuffer;
+	DWORD lpcbBytesReturned;
+	DWORD lpoOverlapped;
+	DWORD hDevice;
+	DWORD tagProcess;
+} DIOCPARAMETERS;
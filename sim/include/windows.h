@@ -0,0 +1,34 @@
+// Minimal <windows.h> replacement used when building the driver sources into
+// the host simulator (see sim/hdasim.c). Only what the driver uses is defined.
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define __cdecl
+#define FAR
+#define NEAR
+#define PASCAL
+#define WINAPI
+#define VOID void
+
+typedef int            BOOL;
+typedef unsigned char  BYTE;
+typedef unsigned short WORD;
+typedef unsigned int   UINT;
+typedef long           LONG;
+typedef char          *LPSTR;
+typedef void          *HANDLE;
+
+// These are 32 bits on Win32, but the driver freely casts pointers to and from
+// them (DIOCPARAMETERS, VID, config handler addresses), so on the 64-bit host
+// they need to be pointer-sized.
+typedef unsigned long  DWORD;
+
+#define TRUE  1
+#define FALSE 0
+
+#define LOWORD(l) ((WORD)((uintptr_t)(l) & 0xFFFF))
+#define HIWORD(l) ((WORD)(((uintptr_t)(l) >> 16) & 0xFFFF))
+#define MAKELONG(lo, hi) ((DWORD)(((WORD)(lo)) | ((DWORD)((WORD)(hi))) << 16))
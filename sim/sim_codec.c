@@ -0,0 +1,512 @@
+// Table-driven codec model that answers HDA verbs
+//
+// Parameters and connection lists are fixed when the model is built. Settable
+// controls remember the value written to them so that the matching GET verb
+// reads it back, like a real codec does.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <windows.h>
+
+#include "hdaudio.h"
+#include "hdasim.h"
+
+void sim_codec_free(struct SimCodec *codec)
+{
+	free(codec);
+}
+
+static uint32_t get_connection_list_entry(const struct SimNode *node, unsigned int index)
+{
+	BOOL longForm = (node->params[PARAM_CONN_LIST_LENGTH] & (1 << 7)) != 0;
+	int perResp = longForm ? 2 : 4;
+	int bits = longForm ? 16 : 8;
+	uint32_t resp = 0;
+
+	// The codec returns the set of entries that contains the requested index
+	index -= index % perResp;
+	for (int i = 0; i < perResp; i++)
+		if (index + i < node->connsCount)
+			resp |= (uint32_t)node->conns[index + i] << (i * bits);
+	return resp;
+}
+
+uint32_t sim_codec_verb(struct SimCodec *codec, uint32_t command)
+{
+	struct SimNode *node = &codec->nodes[(command >> 20) & 0xFF];
+	uint32_t verb = (command >> 8) & 0xFFF;
+	uint32_t payload = command & 0xFF;
+
+	codec->verbCount++;
+	if (!node->present)
+		return 0;
+
+	// Verbs with a 4-bit identifier and a 16-bit payload
+	switch (verb >> 8)
+	{
+	case VERB_SET_CONVERTER_FORMAT >> 8:
+		node->format = command & 0xFFFF;
+		node->written[0x02] = 1;
+		return 0;
+	case VERB_GET_CONVERTER_FORMAT >> 8:
+		return node->format;
+	case VERB_SET_AMP_GAIN_MUTE >> 8:
+		payload = command & 0xFFFF;
+		for (int out = 0; out < 2; out++)
+		{
+			if (!(payload & (1 << (14 + out))))
+				continue;
+			for (int left = 0; left < 2; left++)
+				if (payload & (1 << (12 + left)))
+					node->amp[out][left][GET_BITS(payload, 8, 4)] = payload & 0xFF;
+		}
+		node->written[0x03] = 1;
+		return 0;
+	case VERB_GET_AMP_GAIN_MUTE >> 8:
+		payload = command & 0xFFFF;
+		return node->amp[(payload >> 15) & 1][(payload >> 13) & 1][payload & 0xF];
+	}
+
+	switch (verb)
+	{
+	case VERB_GET_PARAMETER:
+		return payload < ARRAY_COUNT(node->params) ? node->params[payload] : 0;
+	case VERB_GET_CONNECTION_LIST_ENTRY:
+		return get_connection_list_entry(node, payload);
+	case VERB_GET_PIN_SENSE:
+		return node->pinSense;
+	case VERB_EXEC_PIN_SENSE:
+		return 0;
+	case VERB_GET_POWER_STATE:
+		// actual state follows the requested one immediately
+		return (node->state[0x05] << 4) | node->state[0x05];
+	case VERB_GET_DIGICONVERT:
+		return node->state[0x0D] | (node->state[0x0E] << 8) | (node->state[0x3E] << 16) | (node->state[0x3F] << 24);
+	case VERB_GET_CONFIG_DEFAULT:
+		return node->state[0x1C] | (node->state[0x1D] << 8) | (node->state[0x1E] << 16) | (node->state[0x1F] << 24);
+	case VERB_GET_SUBSYSTEM_ID:
+		return node->state[0x20] | (node->state[0x21] << 8) | (node->state[0x22] << 16) | (node->state[0x23] << 24);
+	}
+
+	// Any other control: 0x7xx writes it and 0xFxx reads it back
+	if ((verb >> 8) == 0x7)
+	{
+		node->state[verb & 0xFF] = payload;
+		node->written[verb & 0xFF] = 1;
+		return 0;
+	}
+	if ((verb >> 8) == 0xF)
+		return node->state[verb & 0xFF];
+	return 0;
+}
+
+//------------------------------------------------------------------------------
+// Built-in codec
+//------------------------------------------------------------------------------
+
+static struct SimNode *add_node(struct SimCodec *codec, int nid, uint32_t caps)
+{
+	struct SimNode *node = &codec->nodes[nid];
+	node->present = TRUE;
+	node->params[PARAM_AUDIO_WIDGET_CAP] = caps;
+	return node;
+}
+
+static void set_connections(struct SimNode *node, const uint16_t *conns, int count)
+{
+	memcpy(node->conns, conns, count * sizeof(*conns));
+	node->connsCount = count;
+	node->params[PARAM_CONN_LIST_LENGTH] = count;
+}
+
+static void set_config_default(struct SimNode *node, uint32_t config)
+{
+	node->state[0x1C] = config & 0xFF;
+	node->state[0x1D] = (config >> 8) & 0xFF;
+	node->state[0x1E] = (config >> 16) & 0xFF;
+	node->state[0x1F] = config >> 24;
+}
+
+// A small analog codec modeled after QEMU's hda-duplex: one DAC feeding a
+// mixer, a line out pin that can select either of them, a headphone pin behind
+// the mixer, and a mic pin feeding the mixer.
+struct SimCodec *sim_codec_create_builtin(void)
+{
+	struct SimCodec *codec = calloc(1, sizeof(*codec));
+	struct SimNode *node;
+
+	strcpy(codec->name, "builtin");
+
+	node = add_node(codec, 0, 0);
+	node->params[PARAM_VENDOR_ID] = 0x1AF40022;
+	node->params[PARAM_REVISION_ID] = 0x00100101;
+	node->params[PARAM_SUB_NODE_COUNT] = (1 << 16) | 1;
+
+	node = add_node(codec, 1, 0);
+	node->params[PARAM_FUNC_GRP_TYPE] = FUNC_GRP_TYPE_UNSOL_CAPABLE | FUNC_GRP_AUDIO;
+	node->params[PARAM_SUB_NODE_COUNT] = (2 << 16) | 6;
+	node->params[PARAM_SUPP_PCM_SIZE_RATE] = PCM_SUPP_16BIT | PCM_SUPP_24BIT | 0x7F;
+	node->params[PARAM_SUPP_STREAM_FORMATS] = 1;
+	node->params[PARAM_OUTPUT_AMP_CAP] = AMP_CAP_MUTE_CAPABLE | (3 << 16) | (0x4A << 8) | 0x4A;
+	node->params[PARAM_SUPP_POWER_STATES] = 0xF;
+
+	// DAC
+	node = add_node(codec, 2, (WIDGET_TYPE_AUDIO_OUTPUT << 20) | WIDGET_CAP_POWER_CNTRL | WIDGET_CAP_AMP_PARAM_OVERRIDE | WIDGET_CAP_OUTPUT_AMP | 1);
+	node->params[PARAM_SUPP_POWER_STATES] = 0xF;
+	node->params[PARAM_SUPP_PCM_SIZE_RATE] = PCM_SUPP_16BIT | PCM_SUPP_24BIT | 0x7F;
+	node->params[PARAM_SUPP_STREAM_FORMATS] = 1;
+	node->params[PARAM_OUTPUT_AMP_CAP] = AMP_CAP_MUTE_CAPABLE | (3 << 16) | (0x4A << 8) | 0x4A;
+
+	// Mixer
+	node = add_node(codec, 3, (WIDGET_TYPE_AUDIO_MIXER << 20) | WIDGET_CAP_CONN_LIST | WIDGET_CAP_AMP_PARAM_OVERRIDE | WIDGET_CAP_OUTPUT_AMP | WIDGET_CAP_INPUT_AMP | 1);
+	set_connections(node, (const uint16_t[]){ 2, 7, 6 }, 3);
+	node->params[PARAM_OUTPUT_AMP_CAP] = AMP_CAP_MUTE_CAPABLE | (3 << 16) | (0x1F << 8) | 0x17;
+	node->params[PARAM_INPUT_AMP_CAP] = AMP_CAP_MUTE_CAPABLE;
+
+	// Line out
+	node = add_node(codec, 4, (WIDGET_TYPE_PIN_COMPLEX << 20) | WIDGET_CAP_CONN_LIST | WIDGET_CAP_UNSOLICITED | WIDGET_CAP_AMP_PARAM_OVERRIDE | WIDGET_CAP_OUTPUT_AMP | 1);
+	set_connections(node, (const uint16_t[]){ 3, 2 }, 2);
+	node->params[PARAM_PIN_CAP] = PINCAP_EAPD | PINCAP_OUTPUT | PINCAP_PRESENCEDETECT;
+	node->params[PARAM_OUTPUT_AMP_CAP] = AMP_CAP_MUTE_CAPABLE;
+	node->pinSense = 1u << 31;
+	set_config_default(node, 0x01014010);
+
+	// Headphones
+	node = add_node(codec, 5, (WIDGET_TYPE_PIN_COMPLEX << 20) | WIDGET_CAP_CONN_LIST | WIDGET_CAP_AMP_PARAM_OVERRIDE | WIDGET_CAP_OUTPUT_AMP | 1);
+	set_connections(node, (const uint16_t[]){ 3 }, 1);
+	node->params[PARAM_PIN_CAP] = PINCAP_OUTPUT | (1 << 3);
+	node->params[PARAM_OUTPUT_AMP_CAP] = AMP_CAP_MUTE_CAPABLE;
+	set_config_default(node, 0x0221401F);
+
+	// Mic
+	node = add_node(codec, 6, (WIDGET_TYPE_PIN_COMPLEX << 20) | 1);
+	node->params[PARAM_PIN_CAP] = PINCAP_INPUT;
+	set_config_default(node, 0x01A19020);
+
+	// Second DAC, only heard through the mixer
+	node = add_node(codec, 7, (WIDGET_TYPE_AUDIO_OUTPUT << 20) | WIDGET_CAP_POWER_CNTRL | WIDGET_CAP_AMP_PARAM_OVERRIDE | WIDGET_CAP_OUTPUT_AMP | 1);
+	node->params[PARAM_SUPP_POWER_STATES] = 0xF;
+	node->params[PARAM_SUPP_PCM_SIZE_RATE] = PCM_SUPP_16BIT | PCM_SUPP_24BIT | 0x7F;
+	node->params[PARAM_SUPP_STREAM_FORMATS] = 1;
+	node->params[PARAM_OUTPUT_AMP_CAP] = AMP_CAP_MUTE_CAPABLE | (3 << 16) | (0x4A << 8) | 0x4A;
+
+	return codec;
+}
+
+//------------------------------------------------------------------------------
+// Linux codec dumps
+//------------------------------------------------------------------------------
+
+// Codec models can be built from the contents of /proc/asound/card*/codec#*
+// on a Linux system, or from the output of "hdactl -x", which uses the same
+// format. Linux prints every parameter the driver reads, along with the
+// current value of most controls. Lines that aren't understood are ignored.
+
+static BOOL starts_with(const char *str, const char *prefix, const char **rest)
+{
+	size_t len = strlen(prefix);
+	if (strncmp(str, prefix, len) != 0)
+		return FALSE;
+	*rest = str + len;
+	return TRUE;
+}
+
+static uint32_t parse_power_states(const char *str)
+{
+	static const struct { const char *name; int bit; } states[] =
+	{
+		{ "D0", 0 }, { "D1", 1 }, { "D2", 2 }, { "D3", 3 }, { "D3cold", 4 },
+		{ "S3D3cold", 29 }, { "CLKSTOP", 30 }, { "EPSS", 31 },
+	};
+	char name[16];
+	int len;
+	uint32_t value = 0;
+
+	while (sscanf(str, " %15s%n", name, &len) == 1)
+	{
+		for (int i = 0; i < ARRAY_COUNT(states); i++)
+			if (strcmp(name, states[i].name) == 0)
+				value |= 1u << states[i].bit;
+		str += len;
+	}
+	return value;
+}
+
+static uint32_t parse_amp_caps(const char *str)
+{
+	unsigned int ofs, nsteps, stepsize, mute;
+	if (sscanf(str, " ofs=0x%x, nsteps=0x%x, stepsize=0x%x, mute=%x", &ofs, &nsteps, &stepsize, &mute) != 4)
+		return 0;
+	return ((uint32_t)mute << 31) | (stepsize << 16) | (nsteps << 8) | ofs;
+}
+
+// Each value is printed as [left right] for stereo widgets and [value] for
+// mono widgets, one per input (or one for an output amp)
+static void parse_amp_vals(struct SimNode *node, int output, const char *str)
+{
+	unsigned int left, right;
+	int index = 0;
+
+	while ((str = strchr(str, '[')) != NULL && index < 16)
+	{
+		int n = sscanf(str, "[0x%x 0x%x]", &left, &right);
+		if (n < 1)
+			break;
+		if (n == 1)
+			right = left;
+		node->amp[output][1][index] = left;
+		node->amp[output][0][index] = right;
+		index++;
+		str++;
+	}
+}
+
+static void parse_connections(struct SimNode *node, const char *str, int count)
+{
+	unsigned int nid;
+	int len;
+	BOOL longForm = FALSE;
+
+	node->connsCount = 0;
+	while (node->connsCount < MIN(count, SIM_MAX_CONNS) && sscanf(str, " 0x%x%n", &nid, &len) == 1)
+	{
+		str += len;
+		if (*str == '*')  // currently selected input
+		{
+			node->state[0x01] = node->connsCount;
+			str++;
+		}
+		if (nid > 0x7F)
+			longForm = TRUE;
+		node->conns[node->connsCount++] = nid;
+	}
+	node->params[PARAM_CONN_LIST_LENGTH] = node->connsCount | (longForm ? (1 << 7) : 0);
+}
+
+struct SimCodec *sim_codec_load_alsa(const char *fileName)
+{
+	FILE *file = fopen(fileName, "r");
+	if (file == NULL)
+	{
+		perror(fileName);
+		return NULL;
+	}
+
+	struct SimCodec *codec = calloc(1, sizeof(*codec));
+	// The AFG's parameters are printed before its node ID is, so collect them
+	// separately and move them into place at the end
+	struct SimNode afg = { 0 };
+	unsigned int afgNID = 1;
+	struct SimNode *node = &afg;  // node the current line describes
+	struct SimNode *pcmNode = NULL;  // node the "rates"/"bits"/"formats" lines describe
+	int connsExpected = 0;
+	int firstNID = SIM_MAX_NODES, lastNID = -1;
+	BOOL gotVendor = FALSE;
+	char line[1024];
+	const char *rest;
+	unsigned int a, b, c, d, e;
+
+	strcpy(codec->name, "unknown");
+	while (fgets(line, sizeof(line), file) != NULL)
+	{
+		line[strcspn(line, "\r\n")] = 0;
+
+		if (connsExpected > 0)
+		{
+			parse_connections(node, line, connsExpected);
+			connsExpected = 0;
+			continue;
+		}
+
+		// Codec and function group information
+		if (starts_with(line, "Codec: ", &rest))
+			snprintf(codec->name, sizeof(codec->name), "%s", rest);
+		else if (sscanf(line, "Address: %u", &a) == 1)
+			codec->addr = a;
+		else if (sscanf(line, "AFG Function Id: 0x%x (unsol %u)", &a, &b) == 2)
+			afg.params[PARAM_FUNC_GRP_TYPE] = a | (b ? FUNC_GRP_TYPE_UNSOL_CAPABLE : 0);
+		else if (sscanf(line, "Vendor Id: 0x%x", &a) == 1)
+		{
+			codec->nodes[0].params[PARAM_VENDOR_ID] = a;
+			gotVendor = TRUE;
+		}
+		else if (sscanf(line, "Subsystem Id: 0x%x", &a) == 1)
+		{
+			for (int i = 0; i < 4; i++)
+				afg.state[0x20 + i] = (a >> (i * 8)) & 0xFF;
+		}
+		else if (sscanf(line, "Revision Id: 0x%x", &a) == 1)
+			codec->nodes[0].params[PARAM_REVISION_ID] = a;
+		else if (strcmp(line, "Default PCM:") == 0)
+			pcmNode = &afg;
+		else if (starts_with(line, "Default Amp-In caps:", &rest))
+			afg.params[PARAM_INPUT_AMP_CAP] = parse_amp_caps(rest);
+		else if (starts_with(line, "Default Amp-Out caps:", &rest))
+			afg.params[PARAM_OUTPUT_AMP_CAP] = parse_amp_caps(rest);
+		else if (sscanf(line, "State of AFG node 0x%x", &a) == 1 && a < SIM_MAX_NODES)
+		{
+			afgNID = a;
+			node = &afg;
+		}
+		else if (sscanf(line, "GPIO: io=%u, o=%u, i=%u, unsolicited=%u, wake=%u", &a, &b, &c, &d, &e) == 5)
+			afg.params[PARAM_GPIO_COUNT] = a | (b << 8) | (c << 16) | (d << 30) | ((uint32_t)e << 31);
+		// Widgets
+		else if (sscanf(line, "Node 0x%x [", &a) == 1 && a < SIM_MAX_NODES)
+		{
+			const char *wcaps = strstr(line, "wcaps ");
+			node = &codec->nodes[a];
+			node->present = TRUE;
+			if (wcaps != NULL)
+				node->params[PARAM_AUDIO_WIDGET_CAP] = strtoul(wcaps + 6, NULL, 0);
+			pcmNode = NULL;
+			firstNID = MIN(firstNID, (int)a);
+			lastNID = MAX(lastNID, (int)a);
+		}
+		else if (strcmp(line, "  PCM:") == 0)
+			pcmNode = node;
+		else if (sscanf(line, "    rates [0x%x]", &a) == 1 && pcmNode != NULL)
+			pcmNode->params[PARAM_SUPP_PCM_SIZE_RATE] |= a & 0xFFF;
+		else if (sscanf(line, "    bits [0x%x]", &a) == 1 && pcmNode != NULL)
+			pcmNode->params[PARAM_SUPP_PCM_SIZE_RATE] |= (a & 0xFF) << 16;
+		else if (sscanf(line, "    formats [0x%x]", &a) == 1 && pcmNode != NULL)
+			pcmNode->params[PARAM_SUPP_STREAM_FORMATS] = a;
+		// Linux prints the AFG's amp caps for widgets that don't override them,
+		// but the widget itself doesn't report any
+		else if (starts_with(line, "  Amp-In caps:", &rest))
+		{
+			if (node->params[PARAM_AUDIO_WIDGET_CAP] & WIDGET_CAP_AMP_PARAM_OVERRIDE)
+				node->params[PARAM_INPUT_AMP_CAP] = parse_amp_caps(rest);
+		}
+		else if (starts_with(line, "  Amp-Out caps:", &rest))
+		{
+			if (node->params[PARAM_AUDIO_WIDGET_CAP] & WIDGET_CAP_AMP_PARAM_OVERRIDE)
+				node->params[PARAM_OUTPUT_AMP_CAP] = parse_amp_caps(rest);
+		}
+		else if (starts_with(line, "  Amp-In vals:", &rest))
+			parse_amp_vals(node, 0, rest);
+		else if (starts_with(line, "  Amp-Out vals:", &rest))
+			parse_amp_vals(node, 1, rest);
+		else if (sscanf(line, "  Converter: stream=%u, channel=%u", &a, &b) == 2)
+			node->state[0x06] = (a << 4) | b;
+		else if (sscanf(line, "  Pincap 0x%x", &a) == 1)
+			node->params[PARAM_PIN_CAP] = a;
+		else if (sscanf(line, "  EAPD 0x%x", &a) == 1)
+			node->state[0x0C] = a;
+		else if (sscanf(line, "  Pin Default 0x%x", &a) == 1)
+			set_config_default(node, a);
+		else if (sscanf(line, "  Pin-ctls: 0x%x", &a) == 1)
+			node->state[0x07] = a;
+		else if (sscanf(line, "  Unsolicited: tag=%x, enabled=%u", &a, &b) == 2)
+			node->state[0x08] = (b ? (1 << 7) : 0) | (a & 0x3F);
+		else if (starts_with(line, "  Power states:", &rest))
+			node->params[PARAM_SUPP_POWER_STATES] = parse_power_states(rest);
+		else if (sscanf(line, "  Power: setting=D%u, actual=D%u", &a, &b) == 2)
+			node->state[0x05] = a;
+		else if (sscanf(line, "  Processing caps: benign=%u, ncoeff=%u", &a, &b) == 2)
+			node->params[PARAM_PROCESSING_CAP] = (b << 8) | a;
+		else if (sscanf(line, "  Volume-Knob: delta=%u, steps=%u, direct=%u, val=%u", &a, &b, &c, &d) == 4)
+		{
+			node->params[PARAM_VOLUME_KNOB_CAP] = (a << 7) | b;
+			node->state[0x0F] = (c << 7) | d;
+		}
+		else if (starts_with(line, "  Digital:", &rest))
+		{
+			if (strstr(rest, "Enabled") != NULL)
+				node->state[0x0D] |= 1;
+		}
+		else if (sscanf(line, "  Digital category: 0x%x", &a) == 1)
+			node->state[0x0E] = a;
+		else if (sscanf(line, "  Connection: %u", &a) == 1)
+			connsExpected = a;
+	}
+	fclose(file);
+
+	if (!gotVendor || lastNID < 0 || afgNID >= SIM_MAX_NODES)
+	{
+		fprintf(stderr, "%s: not a codec dump\n", fileName);
+		free(codec);
+		return NULL;
+	}
+
+	codec->nodes[0].present = TRUE;
+	codec->nodes[0].params[PARAM_SUB_NODE_COUNT] = (afgNID << 16) | 1;
+	afg.present = TRUE;
+	afg.params[PARAM_SUB_NODE_COUNT] = (firstNID << 16) | (lastNID - firstNID + 1);
+	if (afg.params[PARAM_FUNC_GRP_TYPE] == 0)
+		afg.params[PARAM_FUNC_GRP_TYPE] = FUNC_GRP_AUDIO;
+	codec->nodes[afgNID] = afg;
+	return codec;
+}
+
+//------------------------------------------------------------------------------
+// Output path report
+//------------------------------------------------------------------------------
+
+#define MAX_PATH_LEN 32
+
+// Follows the inputs selected from nid towards an Audio Output widget and
+// stores the nodes passed through in path. Mixers have no selection, so each
+// of their inputs is tried in turn.
+static int trace_path(const struct SimCodec *codec, int nid, uint8_t *visited, uint16_t *path, int len)
+{
+	const struct SimNode *node = &codec->nodes[nid];
+
+	if (!node->present || visited[nid] || len == MAX_PATH_LEN)
+		return 0;
+	visited[nid] = 1;
+	path[len++] = nid;
+	switch (WIDGET_CAP_TYPE(node->params[PARAM_AUDIO_WIDGET_CAP]))
+	{
+	case WIDGET_TYPE_AUDIO_OUTPUT:
+		return len;
+	case WIDGET_TYPE_AUDIO_MIXER:
+		for (int i = 0; i < node->connsCount; i++)
+		{
+			int n = trace_path(codec, node->conns[i], visited, path, len);
+			if (n > 0)
+				return n;
+		}
+		return 0;
+	default:
+		if (node->connsCount == 0)
+			return 0;
+		if (node->state[0x01] >= node->connsCount)
+			return 0;
+		return trace_path(codec, node->conns[node->connsCount > 1 ? node->state[0x01] : 0], visited, path, len);
+	}
+}
+
+// Prints the output paths that the driver set up, as seen from the codec
+void sim_codec_print_paths(const struct SimCodec *codec)
+{
+	for (int nid = 0; nid < SIM_MAX_NODES; nid++)
+	{
+		const struct SimNode *node = &codec->nodes[nid];
+		if (!node->present || WIDGET_CAP_TYPE(node->params[PARAM_AUDIO_WIDGET_CAP]) != WIDGET_TYPE_PIN_COMPLEX
+		 || !(node->params[PARAM_PIN_CAP] & PINCAP_OUTPUT))
+			continue;
+
+		printf("  pin 0x%02X:", nid);
+		// The driver skips writing a pin control that already has the value
+		// it wants, so the current state is what counts, not what was written
+		if (!(node->state[0x07] & PIN_CONTROL_OUTPUT_ENABLE))
+		{
+			printf(" not enabled\n");
+			continue;
+		}
+		uint8_t visited[SIM_MAX_NODES] = { 0 };
+		uint16_t path[MAX_PATH_LEN];
+		int len = trace_path(codec, nid, visited, path, 0);
+		if (len == 0)
+		{
+			printf(" enabled, but no path to an Audio Output\n");
+			continue;
+		}
+		for (int i = 1; i < len; i++)
+			printf(" -> 0x%02X", path[i]);
+		const struct SimNode *dac = &codec->nodes[path[len - 1]];
+		printf(" (stream %u)\n", CONVERTER_STREAM_CHANNEL_STREAM(dac->state[0x06]));
+	}
+}
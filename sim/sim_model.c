@@ -0,0 +1,664 @@
+// Software model of an HDA controller
+//
+// The driver accesses the registers as plain memory, so the model cannot see
+// individual writes. Instead it runs whenever simulated time advances (which
+// happens on every VTD_Get_Real_Time call the driver makes in its wait loops,
+// and in the simulator's idle loop) and reacts to the register contents it
+// finds. Time is processed one link frame (1/48000 s) at a time: each frame
+// carries at most one command from the CORB to a codec and one response back,
+// and moves each running stream's DMA position forward.
+//
+// Write-1-to-clear status bits can't be observed either, so the status bits
+// that were pending when the interrupt handler was entered are considered
+// acknowledged when it returns.
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include <windows.h>
+
+#include "hdaudio.h"
+#include "hdasim.h"
+
+#define MAX_SIM_STREAMS 30
+
+struct SimConfig simConfig =
+{
+	.numInputStreams = 4,
+	.numOutputStreams = 4,
+	.codecWakeNs = 100000,
+	.lateCodec = -1,
+	.pitReadNs = 1000,
+	.tscRate = 300000000,
+	.tscReadNs = 40,
+	.irqLatencyNs = 5000,
+	.clockScale = 1.0,
+	.cpuScale = 1.0,
+};
+
+struct SimStats simStats;
+
+struct SimStreamState
+{
+	int running;
+	int halted;  // stopped by a descriptor error until RUN is cleared
+	int inReset;
+	unsigned int entry;  // current BDL entry
+	uint32_t entryPos;  // bytes consumed from the current entry
+	uint32_t lpib;
+	uint64_t sampleAccum;  // fractional samples, in units of 1/1e12
+};
+
+static struct
+{
+	struct HDARegs *regs;
+	uint64_t now;  // ns
+	uint64_t frames;  // link frames processed
+	int inReset;
+	uint64_t resetExitTime;
+	int codecsAwake;
+	struct SimCodec *codecs[15];
+
+	// Command/response path
+	uint16_t lastCorbWP;
+	int haveResponse;
+	uint32_t response;
+	uint32_t responseEx;
+	unsigned int respCount;  // responses since the last response interrupt
+	uint32_t unsolQueue[16][2];  // unsolicited responses waiting for a free slot
+	unsigned int unsolCount;
+	unsigned long lateCodecVerbs;  // commands the late codec has received
+	uint64_t lateRelease;  // when it sends the responses it is holding
+	uint32_t lateQueue[256];
+	unsigned int lateCount;
+
+	// Immediate Command interface
+	int icBusy;  // a command was taken from ICOI and is waiting for its frame
+	int icHaveResponse;
+	uint32_t icResponse;
+	uint32_t icAddr;
+
+	struct SimStreamState streams[MAX_SIM_STREAMS];
+
+	// Interrupt line
+	void (*irqHandler)(unsigned long, unsigned long);
+	unsigned long hIRQ;
+	int irqMasked;
+	int inISR;
+	int irqAsserted;
+	uint64_t irqDeliverTime;
+} model;
+
+static uint64_t read_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * SIM_NS_PER_SEC + ts.tv_nsec;
+#endif
+}
+
+static uint64_t host_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * SIM_NS_PER_SEC + ts.tv_nsec;
+}
+
+void *sim_model_regs(void)
+{
+	return model.regs;
+}
+
+void sim_model_attach_codec(int addr, struct SimCodec *codec)
+{
+	model.codecs[addr] = codec;
+}
+
+void sim_model_set_irq_handler(void (*handler)(unsigned long, unsigned long), unsigned long hIRQ)
+{
+	model.irqHandler = handler;
+	model.hIRQ = hIRQ;
+}
+
+void sim_model_set_irq_masked(int masked)
+{
+	model.irqMasked = masked;
+}
+
+uint64_t sim_now(void)
+{
+	return model.now;
+}
+
+void sim_model_init(void)
+{
+	model.regs = aligned_alloc(4096, SIM_MMIO_SIZE);
+	memset(model.regs, 0, SIM_MMIO_SIZE);
+
+	struct HDARegs *r = model.regs;
+	r->GCAP = (simConfig.numOutputStreams << 12) | (simConfig.numInputStreams << 8) | GCAP_64OK;
+	r->VMAJ = 1;
+	r->VMIN = 0;
+	r->OUTPAY = 0x3C;
+	r->INPAY = 0x1D;
+	r->CORBSIZE = CORBSIZE_CORBSZCAP_256ENT | CORBSIZE_CORBSIZE_256ENT;
+	r->RIRBSIZE = RIRBSIZE_RIRBSZCAP_256ENT | RIRBSIZE_RIRBSIZE_256ENT;
+	// Left running by the BIOS
+	r->GCTL = GCTL_CRST;
+	model.codecsAwake = 1;
+	for (int i = 0; i < 15; i++)
+		if (model.codecs[i] != NULL)
+			r->STATESTS |= 1 << i;
+}
+
+static unsigned int ring_size(uint8_t sizeReg)
+{
+	switch (sizeReg & 3)
+	{
+	case 0: return 2;
+	case 1: return 16;
+	default: return 256;
+	}
+}
+
+//------------------------------------------------------------------------------
+// Command/response path
+//------------------------------------------------------------------------------
+
+static void count_verb(uint32_t command)
+{
+	uint32_t verb = (command >> 8) & 0xFFF;
+	if (verb == VERB_GET_PARAMETER)
+		simStats.getParamVerbs++;
+	else if ((verb >> 8) == 0xF || (verb >> 8) == 0xA || (verb >> 8) == 0xB)
+		simStats.getVerbs++;
+	else
+		simStats.setVerbs++;
+}
+
+static void rirb_write(uint32_t response, uint32_t responseEx)
+{
+	struct HDARegs *r = model.regs;
+
+	if (!(r->RIRBCTL & RIRBCTL_RIRBDMAEN))
+		return;
+	unsigned int size = ring_size(r->RIRBSIZE);
+	unsigned int wp = ((r->RIRBWP & RIRBWP_RIRBWP_MASK) + 1) % size;
+	uint32_t *entry = sim_phys_to_virt(r->RIRBLBASE + wp * 8, 8);
+	if (entry == NULL)
+	{
+		simStats.dmaErrors++;
+		return;
+	}
+	entry[0] = response;
+	entry[1] = responseEx;
+	r->RIRBWP = wp;
+	model.respCount++;
+	unsigned int rintcnt = r->RINTCNT & RINTCNT_RINTCNT_MASK;
+	if (rintcnt == 0)
+		rintcnt = 256;
+	if (model.respCount >= rintcnt)
+	{
+		model.respCount = 0;
+		if (r->RIRBCTL & RIRBCTL_RINTCTL)
+			r->RIRBSTS |= 1;  // RINTFL
+	}
+}
+
+// The late codec stalls once it has received this many commands
+#define SIM_LATE_AFTER_VERBS 10
+
+// Returns nonzero if a codec at addr responds to commands
+static int codec_answers(unsigned int addr)
+{
+	return addr < 15 && model.codecs[addr] != NULL && model.codecsAwake
+	 && !(simConfig.deadCodecs & (1 << addr));
+}
+
+// The Immediate Command interface sends the command in ICOI once ICB is set.
+// Like a CORB command, its response comes back in the following frame.
+static void immediate_frame(void)
+{
+	struct HDARegs *r = model.regs;
+
+	if (model.icBusy)
+	{
+		model.icBusy = 0;
+		if (model.icHaveResponse)
+		{
+			r->ICII = model.icResponse;
+			r->ICIS = (r->ICIS & ~(ICIS_ICB | ICIS_IRRUNSOL | (0xF << 4))) | ICIS_IRV | (model.icAddr << 4);
+		}
+		else
+			r->ICIS &= ~ICIS_ICB;  // nothing answered; software times out waiting for IRV
+		return;
+	}
+	if (!(r->ICIS & ICIS_ICB))
+		return;
+
+	uint32_t command = r->ICOI;
+	unsigned int addr = command >> 28;
+	simStats.immediateVerbs++;
+	count_verb(command);
+	model.icBusy = 1;
+	model.icHaveResponse = 0;
+	if (codec_answers(addr))
+	{
+		model.icResponse = sim_codec_verb(model.codecs[addr], command);
+		model.icAddr = addr;
+		model.icHaveResponse = 1;
+	}
+	else
+		simStats.unanswered++;
+}
+
+static void command_frame(void)
+{
+	struct HDARegs *r = model.regs;
+
+	// Response to the command sent in the previous frame. Unsolicited
+	// responses go in frames that have no solicited one.
+	if (model.haveResponse)
+	{
+		rirb_write(model.response, model.responseEx);
+		model.haveResponse = 0;
+	}
+	else if (model.lateCount > 0 && model.now >= model.lateRelease)
+	{
+		rirb_write(model.lateQueue[0], simConfig.lateCodec);
+		simStats.lateResponses++;
+		model.lateCount--;
+		memmove(model.lateQueue, model.lateQueue + 1, model.lateCount * sizeof(model.lateQueue[0]));
+	}
+	else if (model.unsolCount > 0 && (r->GCTL & GCTL_UNSOL))
+	{
+		rirb_write(model.unsolQueue[0][0], model.unsolQueue[0][1]);
+		simStats.unsolicited++;
+		model.unsolCount--;
+		memmove(model.unsolQueue[0], model.unsolQueue[1], model.unsolCount * sizeof(model.unsolQueue[0]));
+	}
+	else if (model.respCount > 0)
+	{
+		// An empty response slot also raises the response interrupt
+		model.respCount = 0;
+		if (r->RIRBCTL & RIRBCTL_RINTCTL)
+			r->RIRBSTS |= 1;
+	}
+
+	if (r->CORBRP & CORBRP_CORBRPRST)
+	{
+		r->CORBRP = CORBRP_CORBRPRST;
+		return;
+	}
+	if (r->RIRBWP & RIRBWP_RIRBWPRST)
+		r->RIRBWP = 0;
+
+	if (r->CORBWP != model.lastCorbWP)
+	{
+		simStats.corbDoorbells++;
+		model.lastCorbWP = r->CORBWP;
+	}
+
+	if (!(r->CORBCTL & CORBCTL_CORBRUN))
+		return;
+	unsigned int size = ring_size(r->CORBSIZE);
+	unsigned int rp = r->CORBRP & CORBRP_CORBRP_MASK;
+	if (rp == (r->CORBWP & CORBWP_CORBWP_MASK))
+		return;
+	rp = (rp + 1) % size;
+	uint32_t *entry = sim_phys_to_virt(r->CORBLBASE + rp * 4, 4);
+	if (entry == NULL)
+	{
+		simStats.dmaErrors++;
+		r->CORBSTS |= 1;  // CMEI
+		return;
+	}
+	uint32_t command = *entry;
+	r->CORBRP = rp;
+	simStats.corbVerbs++;
+	count_verb(command);
+
+	unsigned int addr = command >> 28;
+	if (codec_answers(addr))
+	{
+		model.response = sim_codec_verb(model.codecs[addr], command);
+		model.responseEx = addr;
+		model.haveResponse = 1;
+		// The late codec holds on to its responses for a while, and then
+		// sends them in order, ahead of the ones that come after them
+		if (addr == simConfig.lateCodec && ++model.lateCodecVerbs == SIM_LATE_AFTER_VERBS)
+			model.lateRelease = model.now + simConfig.lateNs;
+		if (addr == simConfig.lateCodec && (model.now < model.lateRelease || model.lateCount > 0)
+		 && model.lateCount < ARRAY_COUNT(model.lateQueue))
+		{
+			model.lateQueue[model.lateCount++] = model.response;
+			model.haveResponse = 0;
+		}
+	}
+	else
+		simStats.unanswered++;
+}
+
+// Plugs or unplugs whatever is connected to a pin. If the pin has unsolicited
+// responses enabled, the codec reports the change with its tag.
+void sim_model_set_pin_sense(int addr, int nid, int present)
+{
+	struct SimCodec *codec = model.codecs[addr];
+	if (codec == NULL || nid < 0 || nid >= SIM_MAX_NODES)
+		return;
+	struct SimNode *node = &codec->nodes[nid];
+	node->pinSense = present ? (1u << 31) : 0;
+	uint8_t unsol = node->state[VERB_SET_UNSOLRESP & 0xFF];
+	if ((unsol & (1 << 7)) && model.unsolCount < ARRAY_COUNT(model.unsolQueue))
+	{
+		model.unsolQueue[model.unsolCount][0] = (uint32_t)(unsol & 0x3F) << 26;
+		model.unsolQueue[model.unsolCount][1] = addr | (1 << 4);
+		model.unsolCount++;
+	}
+}
+
+//------------------------------------------------------------------------------
+// Streams
+//------------------------------------------------------------------------------
+
+static uint64_t stream_rate_millihz(uint16_t fmt)
+{
+	uint64_t base = (fmt & SDFMT_BASE_44KHZ) ? 44100 : 48000;
+	uint64_t mult = 1 + GET_BITS(fmt, 11, 3);
+	uint64_t div = 1 + GET_BITS(fmt, 8, 3);
+	return (uint64_t)(base * 1000 * mult / div * simConfig.clockScale);
+}
+
+static uint32_t stream_frame_bytes(uint16_t fmt)
+{
+	static const uint8_t containerSize[8] = { 1, 2, 4, 4, 4, 4, 4, 4 };
+	return (1 + (fmt & SDFMT_CHAN_MASK)) * containerSize[GET_BITS(fmt, 4, 3)];
+}
+
+// Played buffer entries are overwritten with this value, so that the DMA
+// engine can tell when it comes back to an entry the driver has not refilled.
+// Real hardware leaves the buffer alone, but the driver never reads it back.
+#define STALE_BYTE 0xA5
+
+static BOOL is_stale(const uint8_t *data, uint32_t size)
+{
+	for (uint32_t i = 0; i < size; i++)
+		if (data[i] != STALE_BYTE)
+			return FALSE;
+	return TRUE;
+}
+
+static void stream_error(struct HDAStreamDesc *sdesc, struct SimStreamState *st)
+{
+	simStats.dmaErrors++;
+	sdesc->SDSTS |= SDSTS_DESE;
+	st->halted = 1;
+}
+
+// Mirrors a stream's position to the DMA position buffer, if it is enabled
+static void stream_write_position(int index, uint32_t lpib)
+{
+	struct HDARegs *r = model.regs;
+	uint32_t cbl = MAX(r->SDESC[index].SDCBL, 1);
+
+	if (!(r->DPLBASE & DPLBASE_DPBE))
+		return;
+	uint32_t *entry = sim_phys_to_virt((r->DPLBASE & ~0x7F) + index * 8, 8);
+	if (entry != NULL)
+		entry[0] = (lpib + cbl + simConfig.positionSkew % (int32_t)cbl) % cbl;
+}
+
+static void stream_frame(int index, uint64_t frameNs)
+{
+	struct HDAStreamDesc *sdesc = &model.regs->SDESC[index];
+	struct SimStreamState *st = &model.streams[index];
+	int isOutput = index >= simConfig.numInputStreams;
+
+	if (sdesc->SDCTLb0 & SDCTLb0_SRST)
+	{
+		if (!st->inReset)
+		{
+			memset(st, 0, sizeof(*st));
+			st->inReset = 1;
+			sdesc->SDSTS = 0;
+			sdesc->SDLPIB = 0;
+			stream_write_position(index, 0);
+		}
+		return;
+	}
+	st->inReset = 0;
+
+	if (!(sdesc->SDCTLb0 & SDCTLb0_RUN))
+	{
+		st->running = 0;
+		st->halted = 0;
+		return;
+	}
+	if (st->halted)
+		return;
+	if (!st->running)
+	{
+		st->running = 1;
+		if (sdesc->SDLVI >= 256 || sim_phys_to_virt(sdesc->SDBDPL, (sdesc->SDLVI + 1) * 16) == NULL)
+		{
+			stream_error(sdesc, st);
+			return;
+		}
+	}
+	if (!isOutput)
+		return;
+
+	uint16_t fmt = sdesc->SDFMT;
+	uint32_t frameBytes = stream_frame_bytes(fmt);
+	st->sampleAccum += frameNs * stream_rate_millihz(fmt);
+	uint64_t samples = st->sampleAccum / 1000000000000ULL;
+	st->sampleAccum %= 1000000000000ULL;
+	uint32_t bytes = samples * frameBytes;
+
+	const uint32_t *bdl = sim_phys_to_virt(sdesc->SDBDPL, (sdesc->SDLVI + 1) * 16);
+	while (bytes > 0)
+	{
+		const uint32_t *desc = bdl + st->entry * 4;
+		uint32_t entrySize = desc[2];
+		if (entrySize == 0 || sim_phys_to_virt(desc[0], entrySize) == NULL)
+		{
+			stream_error(sdesc, st);
+			return;
+		}
+		if (st->entryPos == 0 && is_stale(sim_phys_to_virt(desc[0], entrySize), entrySize))
+			simStats.underruns++;
+		uint32_t n = MIN(bytes, entrySize - st->entryPos);
+		uint8_t *data = sim_phys_to_virt(desc[0] + st->entryPos, n);
+		if (simConfig.captureFile != NULL && index == simConfig.numInputStreams)
+			fwrite(data, 1, n, simConfig.captureFile);
+		simStats.bytesPlayed += n;
+		bytes -= n;
+		st->entryPos += n;
+		st->lpib = (st->lpib + n) % MAX(sdesc->SDCBL, 1);
+		if (st->entryPos == entrySize)
+		{
+			memset(sim_phys_to_virt(desc[0], entrySize), STALE_BYTE, entrySize);
+			if (desc[3] & 1)  // IOC
+			{
+				sdesc->SDSTS |= SDSTS_BCIS;
+				simStats.chunks++;
+			}
+			st->entryPos = 0;
+			st->entry = (st->entry == sdesc->SDLVI) ? 0 : st->entry + 1;
+		}
+	}
+	sdesc->SDLPIB = st->lpib;
+	stream_write_position(index, st->lpib);
+}
+
+//------------------------------------------------------------------------------
+// Interrupts
+//------------------------------------------------------------------------------
+
+static uint32_t compute_intsts(void)
+{
+	struct HDARegs *r = model.regs;
+	int numStreams = simConfig.numInputStreams + simConfig.numOutputStreams;
+	uint32_t intsts = 0;
+
+	for (int i = 0; i < numStreams; i++)
+	{
+		struct HDAStreamDesc *sdesc = &r->SDESC[i];
+		if (((sdesc->SDSTS & SDSTS_BCIS) && (sdesc->SDCTLb0 & SDCTLb0_IOCE))
+		 || ((sdesc->SDSTS & SDSTS_FIFOE) && (sdesc->SDCTLb0 & SDCTLb0_FEIE))
+		 || ((sdesc->SDSTS & SDSTS_DESE) && (sdesc->SDCTLb0 & SDCTLb0_DEIE)))
+			intsts |= 1 << i;
+	}
+	if (((r->RIRBSTS & 1) && (r->RIRBCTL & RIRBCTL_RINTCTL))
+	 || ((r->RIRBSTS & 4) && (r->RIRBCTL & RIRBCTL_RIRBOIC))
+	 || ((r->CORBSTS & 1) && (r->CORBCTL & CORBCTL_CMEIE))
+	 || (r->STATESTS & r->WAKEEN))
+		intsts |= INTSTS_CIS;
+	intsts &= r->INTCTL & (INTCTL_SIE_MASK | INTCTL_CIE);
+	if (intsts != 0 && (r->INTCTL & INTCTL_GIE))
+		intsts |= INTSTS_GIS;
+	return intsts;
+}
+
+static void run_isr(void)
+{
+	struct HDARegs *r = model.regs;
+	int numStreams = simConfig.numInputStreams + simConfig.numOutputStreams;
+	uint8_t sdsts[MAX_SIM_STREAMS];
+
+	for (int i = 0; i < numStreams; i++)
+		sdsts[i] = r->SDESC[i].SDSTS;
+	uint8_t rirbsts = r->RIRBSTS;
+
+	model.inISR = 1;
+	simCarryFlag = 1;
+	uint64_t hostStart = host_ns();
+	uint64_t start = read_cycles();
+	model.irqHandler(model.hIRQ, 0);
+	uint64_t cycles = read_cycles() - start;
+	uint64_t hostTime = host_ns() - hostStart;
+	model.inISR = 0;
+
+	simStats.interrupts++;
+	if (simCarryFlag)
+		simStats.spuriousInterrupts++;
+	simStats.isrCycles += cycles;
+	if (cycles > simStats.isrMaxCycles)
+		simStats.isrMaxCycles = cycles;
+
+	// Everything that was pending has now been acknowledged
+	for (int i = 0; i < numStreams; i++)
+		r->SDESC[i].SDSTS &= ~sdsts[i];
+	r->RIRBSTS &= ~rirbsts;
+	r->INTSTS = compute_intsts();
+	model.irqAsserted = 0;
+
+	sim_advance((uint64_t)(hostTime * simConfig.cpuScale));
+}
+
+void sim_model_check_irq(void)
+{
+	struct HDARegs *r = model.regs;
+
+	r->INTSTS = compute_intsts();
+	if (!(r->INTSTS & INTSTS_GIS))
+	{
+		model.irqAsserted = 0;
+		return;
+	}
+	if (!model.irqAsserted)
+	{
+		model.irqAsserted = 1;
+		model.irqDeliverTime = model.now + simConfig.irqLatencyNs;
+		if (simConfig.irqJitterNs > 0)
+			model.irqDeliverTime += (uint64_t)rand() % simConfig.irqJitterNs;
+	}
+	if (model.irqHandler == NULL || model.irqMasked || model.inISR || !sim_cpu_interrupts_enabled())
+		return;
+	if (model.now >= model.irqDeliverTime)
+		run_isr();
+}
+
+//------------------------------------------------------------------------------
+// Time
+//------------------------------------------------------------------------------
+
+static void controller_frame(uint64_t frameNs)
+{
+	struct HDARegs *r = model.regs;
+
+	if (!(r->GCTL & GCTL_CRST))
+	{
+		if (!model.inReset)
+		{
+			model.inReset = 1;
+			model.codecsAwake = 0;
+			model.haveResponse = 0;
+			model.respCount = 0;
+			model.unsolCount = 0;
+			model.icBusy = 0;
+			r->STATESTS = 0;
+			r->DPLBASE = 0;
+			r->DPUBASE = 0;
+		}
+		return;
+	}
+	if (model.inReset)
+	{
+		model.inReset = 0;
+		model.resetExitTime = model.now;
+	}
+	if (!model.codecsAwake && model.now - model.resetExitTime >= simConfig.codecWakeNs)
+	{
+		model.codecsAwake = 1;
+		for (int i = 0; i < 15; i++)
+			if (model.codecs[i] != NULL)
+				r->STATESTS |= 1 << i;
+	}
+
+	command_frame();
+	immediate_frame();
+
+	int numStreams = simConfig.numInputStreams + simConfig.numOutputStreams;
+	for (int i = 0; i < numStreams; i++)
+		stream_frame(i, frameNs);
+}
+
+// Advances simulated time, running the controller for every link frame that
+// elapses and delivering any resulting interrupt
+void sim_advance(uint64_t ns)
+{
+	model.now += ns;
+	for (;;)
+	{
+		uint64_t frameEnd = (model.frames + 1) * SIM_NS_PER_SEC / SIM_LINK_RATE;
+		if (frameEnd > model.now)
+			break;
+		uint64_t frameStart = model.frames * SIM_NS_PER_SEC / SIM_LINK_RATE;
+		model.frames++;
+		controller_frame(frameEnd - frameStart);
+	}
+	model.regs->WALCLK = (uint32_t)(model.now * (SIM_WALCLK_RATE / 1000) / 1000000);
+	if (!model.inISR)
+		sim_model_check_irq();
+}
+
+// Lets time pass while the driver is not running, in small steps so that
+// interrupts are delivered close to when they are due
+void sim_idle(uint64_t ns)
+{
+	const uint64_t step = SIM_NS_PER_SEC / SIM_LINK_RATE;
+	while (ns > 0)
+	{
+		uint64_t n = MIN(ns, step);
+		sim_advance(n);
+		ns -= n;
+	}
+}
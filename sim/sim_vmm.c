@@ -0,0 +1,544 @@
+// Stub implementations of the VMM, VTD, VPICD, CONFIGMG, SHELL and MMDEVLDR
+// services that the VxD calls, backed by the controller model
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vmm.h>
+#include <configmg.h>
+#include <mmdevldr.h>
+#include <pci.h>
+#include <shell.h>
+#include <vpicd.h>
+#include <vtd.h>
+
+#include "hdasim.h"
+#include "hdasim_port.h"
+
+//------------------------------------------------------------------------------
+// Memory
+//------------------------------------------------------------------------------
+
+#define PAGESIZE 4096
+#define MAX_PHYS_REGIONS 256
+
+// Regions handed out by _PageAllocate. Physical addresses are made up, and are
+// separated by an unmapped guard page so that DMA overruns are caught.
+struct PhysRegion
+{
+	uint32_t phys;
+	uint32_t size;
+	uint8_t *virt;
+};
+
+static struct PhysRegion physRegions[MAX_PHYS_REGIONS];
+static int physRegionsCount;
+static uint32_t nextPhys = 0x01000000;
+
+static unsigned long heapBytes;
+static unsigned long heapPeak;
+static unsigned long pageBytes;
+
+void *sim_phys_to_virt(uint32_t phys, uint32_t size)
+{
+	for (int i = 0; i < physRegionsCount; i++)
+	{
+		struct PhysRegion *r = &physRegions[i];
+		if (phys >= r->phys && phys - r->phys + (uint64_t)size <= r->size)
+			return r->virt + (phys - r->phys);
+	}
+	return NULL;
+}
+
+unsigned long sim_heap_bytes(void) { return heapBytes; }
+unsigned long sim_heap_peak(void) { return heapPeak; }
+unsigned long sim_page_bytes(void) { return pageBytes; }
+
+PVOID _HeapAllocate(ULONG nBytes, ULONG flags)
+{
+	// The size is stored in front of the block so that _HeapFree can account for it
+	size_t *p = malloc(sizeof(size_t) * 2 + nBytes);
+	if (p == NULL)
+		return NULL;
+	p[0] = nBytes;
+	heapBytes += nBytes;
+	if (heapBytes > heapPeak)
+		heapPeak = heapBytes;
+	return p + 2;
+}
+
+ULONG _HeapFree(PVOID hAddress, ULONG flags)
+{
+	if (hAddress == NULL)
+		return 0;
+	size_t *p = (size_t *)hAddress - 2;
+	heapBytes -= p[0];
+	free(p);
+	return 1;
+}
+
+PVOID _PageAllocate(DWORD nPages, DWORD pType, HVM hvm, DWORD AlignMask, DWORD minPhys, DWORD maxPhys, PVOID *PhysAddr, DWORD flags)
+{
+	if (physRegionsCount == MAX_PHYS_REGIONS)
+		return NULL;
+	uint32_t size = nPages * PAGESIZE;
+	uint8_t *virt = aligned_alloc(PAGESIZE, size);
+	if (virt == NULL)
+		return NULL;
+	memset(virt, 0xCC, size);  // real pages are not zeroed either
+	struct PhysRegion *r = &physRegions[physRegionsCount++];
+	r->phys = nextPhys;
+	r->size = size;
+	r->virt = virt;
+	nextPhys += size + PAGESIZE;
+	pageBytes += size;
+	// The driver passes a pointer to a 32-bit physaddr_t here, so only 32 bits
+	// may be written even though PVOID is 64 bits on the host.
+	if (PhysAddr != NULL)
+		*(uint32_t *)PhysAddr = r->phys;
+	return virt;
+}
+
+PVOID _MapPhysToLinear(ULONG PhysAddr, ULONG nBytes, ULONG flags)
+{
+	if (PhysAddr == SIM_MMIO_BASE && nBytes <= SIM_MMIO_SIZE)
+		return sim_model_regs();
+	void *virt = sim_phys_to_virt(PhysAddr, nBytes);
+	return virt != NULL ? virt : (PVOID)0xFFFFFFFF;
+}
+
+//------------------------------------------------------------------------------
+// 16:16 pointers
+//------------------------------------------------------------------------------
+
+#define MAX_SELECTORS 1024
+
+static void *selectors[MAX_SELECTORS];
+static int selectorsCount = 1;  // selector 0 is the null selector
+static CLIENT_STRUCT *currClientRegs;
+
+// Gives ptr its own selector and returns a far pointer to it
+uint32_t sim_far_alloc(void *ptr)
+{
+	if (selectorsCount == MAX_SELECTORS)
+	{
+		fprintf(stderr, "hdasim: out of selectors\n");
+		exit(1);
+	}
+	selectors[selectorsCount] = ptr;
+	return (uint32_t)(selectorsCount++ << 3) << 16;
+}
+
+void *sim_far_to_flat(uint32_t segOff)
+{
+	unsigned int sel = (segOff >> 16) >> 3;
+	if (sel == 0 || sel >= selectorsCount)
+		return NULL;
+	return (uint8_t *)selectors[sel] + (segOff & 0xFFFF);
+}
+
+void sim_set_client_regs(void *clientRegs)
+{
+	currClientRegs = clientRegs;
+}
+
+PVOID Map_Flat(unsigned char segOffset, unsigned char offOffset)
+{
+	const uint8_t *regs = (const uint8_t *)currClientRegs;
+	uint16_t seg, off;
+	memcpy(&seg, regs + segOffset, sizeof(seg));
+	memcpy(&off, regs + offOffset, sizeof(off));
+	PVOID flat = sim_far_to_flat(((uint32_t)seg << 16) | off);
+	return flat != NULL ? flat : (PVOID)-1;
+}
+
+//------------------------------------------------------------------------------
+// Debug output
+//------------------------------------------------------------------------------
+
+VOID Out_Debug_Chr(char c)
+{
+	fputc(c, stdout);
+}
+
+VOID Out_Debug_String(const char *s)
+{
+	fputs(s, stdout);
+}
+
+VOID Fatal_Error_Handler(PCHAR pszMessage, DWORD dwExitFlag)
+{
+	fprintf(stderr, "hdasim: fatal error: %s\n", pszMessage);
+	exit(1);
+}
+
+void hda_debug_init(void)
+{
+}
+
+void hda_debug_assert_fail(const char *expr, const char *file, int line)
+{
+	fprintf(stderr, "hdasim: assertion failed: %s (%s:%i)\n", expr, file, line);
+	abort();
+}
+
+//------------------------------------------------------------------------------
+// CPU
+//------------------------------------------------------------------------------
+
+static uint16_t cpuInterruptFlag = 0x200;
+int simCarryFlag;
+
+void hdasim_breakpoint(const char *file, int line)
+{
+	simStats.breakpoints++;
+	fprintf(stderr, "hdasim: breakpoint at %s:%i\n", file, line);
+}
+
+void hdasim_flush_cache(void)
+{
+}
+
+void hdasim_set_carry(int carry)
+{
+	simCarryFlag = carry;
+}
+
+uint16_t hdasim_disable_interrupts(void)
+{
+	uint16_t prev = cpuInterruptFlag;
+	cpuInterruptFlag = 0;
+	return prev;
+}
+
+void hdasim_restore_interrupts(uint16_t iflag)
+{
+	cpuInterruptFlag |= iflag;
+	sim_model_check_irq();
+}
+
+// Models STI; HLT. The CPU sleeps until the controller interrupts or the
+// system timer ticks.
+void hdasim_wait_for_interrupt(void)
+{
+	const uint64_t step = 1000;  // fine enough not to delay the wakeup noticeably
+	unsigned long interrupts = simStats.interrupts;
+	uint64_t start = sim_now();
+
+	simStats.halts++;
+	cpuInterruptFlag = 0x200;
+	sim_model_check_irq();
+	while (simStats.interrupts == interrupts && sim_now() - start < SIM_TIMER_TICK_NS)
+		sim_advance(step);
+	simStats.haltNs += sim_now() - start;
+}
+
+int hdasim_cpu_has_tsc(void)
+{
+	return simConfig.tscRate != 0;
+}
+
+unsigned long long hdasim_read_tsc(void)
+{
+	simStats.tscReads++;
+	sim_advance(simConfig.tscReadNs);
+	return (unsigned __int128)sim_now() * simConfig.tscRate / SIM_NS_PER_SEC;
+}
+
+int sim_cpu_interrupts_enabled(void)
+{
+	return cpuInterruptFlag != 0;
+}
+
+//------------------------------------------------------------------------------
+// VTD
+//------------------------------------------------------------------------------
+
+unsigned long long VTD_Get_Real_Time(void)
+{
+	simStats.timerReads++;
+	sim_advance(simConfig.pitReadNs);
+	return sim_now() * SIM_PIT_RATE / SIM_NS_PER_SEC;
+}
+
+//------------------------------------------------------------------------------
+// VPICD
+//------------------------------------------------------------------------------
+
+static VID installedVID;
+
+HIRQ VPICD_Virtualize_IRQ(PVID pvid)
+{
+	installedVID = *pvid;
+	sim_model_set_irq_handler((void (*)(unsigned long, unsigned long))pvid->VID_Hw_Int_Proc, 1);
+	return 1;
+}
+
+void VPICD_Phys_EOI(HIRQ hirq)
+{
+	simStats.eois++;
+}
+
+void VPICD_Physically_Mask(HIRQ hirq)
+{
+	sim_model_set_irq_masked(1);
+}
+
+void VPICD_Physically_Unmask(HIRQ hirq)
+{
+	sim_model_set_irq_masked(0);
+}
+
+//------------------------------------------------------------------------------
+// CONFIGMG and MMDEVLDR
+//------------------------------------------------------------------------------
+
+unsigned long simConfigHandler;
+
+// PCI configuration space of an ICH6 HDA controller, as emulated by QEMU
+static uint8_t pciConfig[256] =
+{
+	0x86, 0x80, 0x68, 0x26, 0x06, 0x01, 0x10, 0x00, 0x01, 0x00, 0x03, 0x04, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0xBF, 0xFE,
+	[0x3C] = SIM_IRQ, 0x01,
+};
+
+CONFIGRET CM_Get_Alloc_Log_Conf(PCMCONFIG pccBuffer, DEVNODE dnDevNode, ULONG ulFlags)
+{
+	memset(pccBuffer, 0, sizeof(*pccBuffer));
+	pccBuffer->wNumMemWindows = 1;
+	pccBuffer->dMemBase[0] = SIM_MMIO_BASE;
+	pccBuffer->dMemLength[0] = SIM_MMIO_SIZE;
+	pccBuffer->wNumIRQs = 1;
+	pccBuffer->bIRQRegisters[0] = SIM_IRQ;
+	return CR_SUCCESS;
+}
+
+CONFIGRET CM_Call_Enumerator_Function(DEVNODE dnDevNode, ENUMFUNC efFunc, ULONG ulRefData, PFARVOID pBuffer, ULONG ulBufferSize, ULONG ulFlags)
+{
+	if (efFunc != PCI_ENUM_FUNC_GET_DEVICE_INFO || ulRefData + ulBufferSize > sizeof(pciConfig))
+		return CR_FAILURE;
+	memcpy(pBuffer, pciConfig + ulRefData, ulBufferSize);
+	return CR_SUCCESS;
+}
+
+void MMDEVLDR_Register_Device_Driver(DEVNODE dnDevNode, DWORD fnConfigHandler, DWORD dwUserData)
+{
+	simConfigHandler = fnConfigHandler;
+}
+
+//------------------------------------------------------------------------------
+// Registry
+//------------------------------------------------------------------------------
+
+// Values in the devnode's hardware and software keys. They can be loaded from
+// and saved to a file so that the driver sees what it wrote on the previous
+// "boot".
+
+#define MAX_REGISTRY_VALUES 32
+#define REGISTRY_ACCESS_NS 100000  // cost of one read or write of a value
+
+struct RegistryValue
+{
+	char name[32];
+	ULONG flags;
+	ULONG type;
+	ULONG length;
+	uint8_t *data;
+};
+
+static struct RegistryValue registry[MAX_REGISTRY_VALUES];
+static int registryCount;
+
+static struct RegistryValue *registry_find(const char *name, ULONG flags, int create)
+{
+	for (int i = 0; i < registryCount; i++)
+	{
+		if (registry[i].flags == flags && strcmp(registry[i].name, name) == 0)
+			return &registry[i];
+	}
+	if (!create || registryCount == MAX_REGISTRY_VALUES || strlen(name) >= sizeof(registry[0].name))
+		return NULL;
+	struct RegistryValue *value = &registry[registryCount++];
+	memset(value, 0, sizeof(*value));
+	strcpy(value->name, name);
+	value->flags = flags;
+	return value;
+}
+
+static int registry_set(const char *name, ULONG flags, ULONG type, const void *data, ULONG length)
+{
+	struct RegistryValue *value = registry_find(name, flags, 1);
+	uint8_t *copy;
+
+	if (value == NULL || (copy = malloc(length ? length : 1)) == NULL)
+		return 0;
+	memcpy(copy, data, length);
+	free(value->data);
+	value->type = type;
+	value->length = length;
+	value->data = copy;
+	return 1;
+}
+
+CONFIGRET CM_Read_Registry_Value(DEVNODE dnDevNode, PFARCHAR pszSubKey, PFARCHAR pszValueName, ULONG ulExpectedType, PFARVOID pBuffer, PFARULONG pulLength, ULONG ulFlags)
+{
+	struct RegistryValue *value;
+
+	sim_advance(REGISTRY_ACCESS_NS);
+	if (pszSubKey != NULL || (value = registry_find(pszValueName, ulFlags, 0)) == NULL)
+		return CR_NO_SUCH_VALUE;
+	if (value->type != ulExpectedType)
+		return CR_FAILURE;
+	if (pBuffer == NULL || *pulLength < value->length)
+	{
+		*pulLength = value->length;
+		return CR_BUFFER_SMALL;
+	}
+	memcpy(pBuffer, value->data, value->length);
+	*pulLength = value->length;
+	return CR_SUCCESS;
+}
+
+CONFIGRET CM_Write_Registry_Value(DEVNODE dnDevNode, PFARCHAR pszSubKey, PFARCHAR pszValueName, ULONG ulType, PFARVOID pBuffer, ULONG ulLength, ULONG ulFlags)
+{
+	sim_advance(REGISTRY_ACCESS_NS);
+	if (pszSubKey != NULL || !registry_set(pszValueName, ulFlags, ulType, pBuffer, ulLength))
+		return CR_FAILURE;
+	return CR_SUCCESS;
+}
+
+// The file is a sequence of values, each a line "name flags type length"
+// followed by the data
+int sim_registry_load(const char *fileName)
+{
+	FILE *file = fopen(fileName, "rb");
+	char name[32];
+	unsigned long flags, type, length;
+
+	if (file == NULL)
+		return 0;
+	while (fscanf(file, "%31s %lu %lu %lu", name, &flags, &type, &length) == 4 && fgetc(file) == '\n')
+	{
+		uint8_t *data = malloc(length ? length : 1);
+
+		if (data == NULL || fread(data, 1, length, file) != length || !registry_set(name, flags, type, data, length))
+		{
+			free(data);
+			break;
+		}
+		free(data);
+	}
+	fclose(file);
+	return 1;
+}
+
+int sim_registry_save(const char *fileName)
+{
+	FILE *file = fopen(fileName, "wb");
+
+	if (file == NULL)
+		return 0;
+	for (int i = 0; i < registryCount; i++)
+	{
+		const struct RegistryValue *value = &registry[i];
+
+		fprintf(file, "%s %lu %lu %lu\n", value->name, (unsigned long)value->flags, (unsigned long)value->type, (unsigned long)value->length);
+		fwrite(value->data, 1, value->length, file);
+	}
+	return fclose(file) == 0;
+}
+
+//------------------------------------------------------------------------------
+// Global events
+//------------------------------------------------------------------------------
+
+#define MAX_GLOBAL_EVENTS 64
+
+struct GlobalEvent
+{
+	void (*callback)(HVM hVM, ULONG refData);
+	ULONG refData;
+};
+
+static struct GlobalEvent globalEvents[MAX_GLOBAL_EVENTS];
+static int globalHead, globalTail;
+
+EVENTHANDLE Schedule_Global_Event(PVOID callback, ULONG refData)
+{
+	int next = (globalTail + 1) % MAX_GLOBAL_EVENTS;
+	if (next == globalHead)
+	{
+		fprintf(stderr, "hdasim: too many global events\n");
+		return 0;
+	}
+	globalEvents[globalTail].callback = (void (*)(HVM, ULONG))callback;
+	globalEvents[globalTail].refData = refData;
+	globalTail = next;
+	return next + 1;
+}
+
+// Runs all scheduled global events. Called from the simulator's main loop,
+// which stands in for the VMM leaving the interrupt and returning to a VM.
+void sim_run_global_events(void)
+{
+	while (globalHead != globalTail)
+	{
+		struct GlobalEvent ev = globalEvents[globalHead];
+		globalHead = (globalHead + 1) % MAX_GLOBAL_EVENTS;
+		ev.callback(1, ev.refData);
+	}
+}
+
+//------------------------------------------------------------------------------
+// SHELL
+//------------------------------------------------------------------------------
+
+#define MAX_APPY_EVENTS 1024
+
+struct AppyEvent
+{
+	APPY_CALLBACK callback;
+	DWORD refData;
+};
+
+static struct AppyEvent appyEvents[MAX_APPY_EVENTS];
+static int appyHead, appyTail;
+
+void (*sim_wave_block_finished)(uint32_t wavHdrSegOff);
+
+APPY_HANDLE _SHELL_CallAtAppyTime(APPY_CALLBACK pfnAppyCallBack, DWORD dwRefData, DWORD dwFlags, DWORD dwTimeout)
+{
+	int next = (appyTail + 1) % MAX_APPY_EVENTS;
+	if (next == appyHead)
+		return 0;
+	appyEvents[appyTail].callback = pfnAppyCallBack;
+	appyEvents[appyTail].refData = dwRefData;
+	appyTail = next;
+	return 1;
+}
+
+// Runs all pending appy-time events. Called from the simulator's main loop,
+// which stands in for the system VM becoming schedulable.
+void sim_run_appy_events(void)
+{
+	while (appyHead != appyTail)
+	{
+		struct AppyEvent ev = appyEvents[appyHead];
+		appyHead = (appyHead + 1) % MAX_APPY_EVENTS;
+		ev.callback(ev.refData);
+	}
+}
+
+DWORD _SHELL_CallDll(PCHAR lpszDll, PCHAR lpszProcName, DWORD cbArgs, PVOID lpvArgs)
+{
+	if (strcmp(lpszDll, "HDAUDIO") == 0 && strcmp(lpszProcName, "wave_block_finished") == 0)
+	{
+		if (sim_wave_block_finished != NULL)
+			sim_wave_block_finished(*(DWORD *)lpvArgs);
+		return 1;
+	}
+	fprintf(stderr, "hdasim: call to unknown ring-3 function %s!%s\n", lpszDll, lpszProcName);
+	return 0;
+}
@@ -0,0 +1,98 @@
+// High-resolution time (see timer.h)
+
+#include <vmm.h>
+#include <vtd.h>
+
+#include "tinyprintf.h"
+#include "hdaudio.h"
+#include "timer.h"
+
+#ifdef HDA_SIM
+#include "hdasim_port.h"
+#else
+// Returns TRUE if the CPU has the CPUID instruction and it reports a
+// time-stamp counter. A 486 without CPUID can't toggle the ID flag in EFLAGS.
+static BOOL __declspec(naked) __cdecl cpu_has_tsc(void)
+{
+	__asm {
+		pushfd
+		pop eax
+		mov ecx, eax
+		xor eax, 0x200000  // try to flip the ID flag
+		push eax
+		popfd
+		pushfd
+		pop eax
+		push ecx  // put the flags back the way they were
+		popfd
+		xor eax, ecx
+		and eax, 0x200000
+		jz done
+		push ebx
+		mov eax, 1
+		db 0x0F, 0xA2  // cpuid
+		pop ebx
+		mov eax, edx
+		shr eax, 4  // TSC feature flag
+		and eax, 1
+	done:
+		ret
+	}
+}
+
+// Reads the time-stamp counter
+static unsigned long long __declspec(naked) __cdecl read_tsc(void)
+{
+	__asm {
+		db 0x0F, 0x31  // rdtsc
+		ret
+	}
+}
+#endif
+
+// Length of the calibration, in PIT ticks (about 250 microseconds). Both
+// ends are lined up with a PIT tick, so the result is within a fraction of
+// a percent, which is plenty for timeouts and statistics.
+#define CALIBRATION_PIT_TICKS 300
+
+uint32_t timerRate = TIMER_CLOCK_RATE;
+static BOOL useTsc = FALSE;
+static unsigned int tscShift;  // the time-stamp counter is scaled down by this to keep timerRate in 32 bits
+
+// Measures the rate of the time-stamp counter against the PIT
+void timer_init(void)
+{
+	unsigned long long pitStart, pitEnd, tscStart, tscEnd, rate;
+
+	if (useTsc)
+		return;
+	if (!cpu_has_tsc())
+	{
+		dprintf("no time-stamp counter, timing with the PIT\n");
+		return;
+	}
+	pitStart = VTD_Get_Real_Time();
+	while ((pitEnd = VTD_Get_Real_Time()) == pitStart)
+		;
+	tscStart = read_tsc();
+	pitStart = pitEnd;
+	while ((pitEnd = VTD_Get_Real_Time()) - pitStart < CALIBRATION_PIT_TICKS)
+		;
+	tscEnd = read_tsc();
+	rate = (tscEnd - tscStart) * TIMER_CLOCK_RATE / (pitEnd - pitStart);
+	// Counters faster than 4.29 GHz are read at half rate (or less)
+	while (rate > 0xFFFFFFFF)
+	{
+		rate >>= 1;
+		tscShift++;
+	}
+	timerRate = rate;
+	useTsc = TRUE;
+	dprintf("time-stamp counter runs at %u Hz after dividing by %u\n", timerRate, 1 << tscShift);
+}
+
+// Returns the current time in ticks
+unsigned long long timer_read(void)
+{
+	return useTsc ? (read_tsc() >> tscShift) : VTD_Get_Real_Time();
+}
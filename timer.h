@@ -0,0 +1,18 @@
+#pragma once
+
+#include <stdint.h>
+
+// High-resolution time
+//
+// Reading the PIT through VTD_Get_Real_Time takes several slow port accesses
+// and only counts at 1.19 MHz. On CPUs that have a time-stamp counter, it is
+// used instead, once its rate has been measured against the PIT. Timestamps
+// are in ticks of whichever counter is in use; timerRate converts them. A
+// time-stamp counter too fast for timerRate to hold is scaled down first.
+
+extern uint32_t timerRate;  // ticks per second
+
+#define MICROSECS_TO_TICKS(microsecs) ((unsigned long long)(microsecs) * timerRate / 1000000)
+
+void timer_init(void);
+unsigned long long timer_read(void);
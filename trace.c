@@ -0,0 +1,76 @@
+// Binary event trace rings (see hda_trace.h)
+
+#include <string.h>
+#include <vmm.h>
+
+#include "tinyprintf.h"
+#include "hdaudio.h"
+#include "hda_trace.h"
+#include "timer.h"
+
+// The VMM never runs two pieces of non-interrupt VxD code at the same time, so
+// the task ring's only writer is whatever is running outside the interrupt
+// handler. The interrupt handler has a ring of its own, since it may interrupt
+// the task ring's writer halfway through an event.
+struct TraceRing
+{
+	volatile uint32_t head;  // sequence number of the next event
+	struct HDATraceEvent events[HDA_TRACE_RING_SIZE];
+};
+
+static struct TraceRing traceRings[HDA_TRACE_RING_COUNT];
+
+BOOL traceInInterrupt = FALSE;
+
+// Records an event
+void hda_trace(unsigned int id, uint32_t arg0, uint32_t arg1, uint32_t arg2, uint32_t arg3)
+{
+	struct TraceRing *ring = &traceRings[traceInInterrupt ? HDA_TRACE_RING_ISR : HDA_TRACE_RING_TASK];
+	uint32_t seq = ring->head;
+	struct HDATraceEvent *event = &ring->events[seq % HDA_TRACE_RING_SIZE];
+
+	event->time = timer_read();
+	event->seq = seq;
+	event->id = id;
+	event->args[0] = arg0;
+	event->args[1] = arg1;
+	event->args[2] = arg2;
+	event->args[3] = arg3;
+	ring->head = seq + 1;  // publish the event
+}
+
+// Copies the events of a ring starting at sequence number "since" to events,
+// which must have room for HDA_TRACE_RING_SIZE events. Must not be called from
+// the interrupt handler.
+void hda_trace_read(unsigned int ringIndex, uint32_t since, struct HDATraceHeader *header, struct HDATraceEvent *events)
+{
+	struct TraceRing *ring = &traceRings[ringIndex];
+	uint32_t head = ring->head;
+
+	ASSERT(ringIndex < HDA_TRACE_RING_COUNT);
+	header->timerRate = timerRate;
+	header->lost = 0;
+	if ((int32_t)(head - since) < 0)  // asked for events that haven't happened yet
+		since = head;
+	if (head - since > HDA_TRACE_RING_SIZE)
+	{
+		header->lost = head - since - HDA_TRACE_RING_SIZE;
+		since = head - HDA_TRACE_RING_SIZE;
+	}
+	for (uint32_t seq = since; seq != head; seq++)
+		events[seq - since] = ring->events[seq % HDA_TRACE_RING_SIZE];
+
+	// The interrupt handler may have overwritten some of the oldest events
+	// while they were being copied
+	uint32_t overwritten = ring->head - head;
+	if (overwritten > head - since)
+		overwritten = head - since;
+	if (overwritten > 0)
+	{
+		memmove(events, events + overwritten, (head - since - overwritten) * sizeof(*events));
+		header->lost += overwritten;
+		since += overwritten;
+	}
+	header->count = head - since;
+	header->next = head;
+}